@@ -27,6 +27,7 @@
 
 #include "clientwin.h"
 #include "dsimple.h"
+#include "profile.h"
 
 static xcb_atom_t atom_wm_state = XCB_ATOM_NONE;
 
@@ -55,25 +56,42 @@ window_has_property(xcb_connection_t * dpy, xcb_window_t win, xcb_atom_t atom)
 }
 
 /*
- * Check if window is viewable
+ * A window considered while searching for a client, with the requests
+ * sent for it.  parent is the index of the frontier window it is a
+ * child of.
  */
-static int
-window_is_viewable(xcb_connection_t * dpy, xcb_window_t win)
-{
-    int ok = 0;
+struct search_node {
+    xcb_window_t win;
+    unsigned int parent;
     xcb_get_window_attributes_cookie_t attr_cookie;
-    xcb_get_window_attributes_reply_t *xwa;
+    xcb_get_property_cookie_t prop_cookie;
+    xcb_query_tree_cookie_t qt_cookie;
+};
 
-    attr_cookie = xcb_get_window_attributes (dpy, win);
-    xwa = xcb_get_window_attributes_reply (dpy, attr_cookie, NULL);
+/*
+ * Check whether a search_node is viewable and has WM_STATE set
+ */
+static void
+collect_search_node(xcb_connection_t * dpy, struct search_node *node,
+                    int *viewable, int *has_state)
+{
+    xcb_get_window_attributes_reply_t *xwa;
+    xcb_get_property_reply_t *prop_reply;
 
+    *viewable = 0;
+    xwa = xcb_get_window_attributes_reply (dpy, node->attr_cookie, NULL);
     if (xwa) {
-        ok = (xwa->_class == XCB_WINDOW_CLASS_INPUT_OUTPUT) &&
+        *viewable = (xwa->_class == XCB_WINDOW_CLASS_INPUT_OUTPUT) &&
             (xwa->map_state == XCB_MAP_STATE_VIEWABLE);
         free (xwa);
     }
 
-    return ok;
+    *has_state = 0;
+    prop_reply = xcb_get_property_reply (dpy, node->prop_cookie, NULL);
+    if (prop_reply) {
+        *has_state = (prop_reply->type != XCB_NONE);
+        free (prop_reply);
+    }
 }
 
 /*
@@ -81,56 +99,146 @@ window_is_viewable(xcb_connection_t * dpy, xcb_window_t win)
  * Unmapped/unviewable windows are not considered valid matches.
  * Children are searched in top-down stacking order.
  * The first matching window is returned, None if no match is found.
+ *
+ * The tree is searched one level at a time: the attributes, WM_STATE and
+ * children of every window on a level are requested in a single flight,
+ * so the search costs a round trip per level rather than several per
+ * window.  The children are asked for before we know whether we will
+ * descend, and discarded if we don't.
+ *
+ * The result is the same as a depth-first search that checks a window's
+ * children before descending into them.  That search picks the first
+ * window, in depth-first order, having a matching child; so once a match
+ * is found on a level, only the subtrees of windows ahead of its parent on
+ * that level can still contain a better one.
+ *
+ * qt_cookie is a QueryTree request already sent for win.
  */
 static xcb_window_t
-find_client_in_children(xcb_connection_t * dpy, xcb_window_t win)
+find_client_in_children(xcb_connection_t * dpy, xcb_window_t win,
+                        xcb_query_tree_cookie_t qt_cookie)
 {
-    xcb_query_tree_cookie_t qt_cookie;
-    xcb_query_tree_reply_t *tree;
-    xcb_window_t *children;
-    unsigned int n_children;
-    int i;
-
-    qt_cookie = xcb_query_tree (dpy, win);
-    tree = xcb_query_tree_reply (dpy, qt_cookie, NULL);
-    if (!tree)
-        return XCB_WINDOW_NONE;
-    n_children = xcb_query_tree_children_length (tree);
-    if (!n_children) {
-        free (tree);
+    struct search_node *frontier, *level = NULL, *tmp;
+    unsigned int n_frontier, frontier_size, n_level, level_size = 0;
+    unsigned int i, parent;
+    int matched, failed = 0;
+    xcb_window_t found = XCB_WINDOW_NONE;
+
+    frontier = malloc (sizeof(struct search_node));
+    if (!frontier) {
+        xcb_discard_reply (dpy, qt_cookie.sequence);
         return XCB_WINDOW_NONE;
     }
-    children = xcb_query_tree_children (tree);
-
-    /* Check each child for WM_STATE and other validity */
-    win = XCB_WINDOW_NONE;
-    for (i = (int) n_children - 1; i >= 0; i--) {
-        if (!window_is_viewable(dpy, children[i])) {
-            /* Don't bother descending into this one */
-            children[i] = XCB_WINDOW_NONE;
-            continue;
+    frontier[0].win = win;
+    frontier[0].qt_cookie = qt_cookie;
+    n_frontier = frontier_size = 1;
+
+    while (n_frontier) {
+        /* Request everything about the children of this level */
+        n_level = 0;
+        for (parent = 0; parent < n_frontier; parent++) {
+            xcb_query_tree_reply_t *tree;
+            xcb_window_t *children;
+            int j;
+
+            tree = xcb_query_tree_reply (dpy, frontier[parent].qt_cookie,
+                                         NULL);
+            if (!tree)
+                continue;
+            children = xcb_query_tree_children (tree);
+            j = xcb_query_tree_children_length (tree);
+
+            if (n_level + j > level_size) {
+                level_size = (n_level + j) * 2;
+                tmp = realloc (level, level_size * sizeof(struct search_node));
+                if (!tmp) {
+                    free (tree);
+                    failed = 1;
+                    break;
+                }
+                level = tmp;
+            }
+
+            /* Top-down stacking order */
+            while (--j >= 0) {
+                struct search_node *node = &level[n_level++];
+
+                node->win = children[j];
+                node->parent = parent;
+                node->attr_cookie =
+                    xcb_get_window_attributes (dpy, node->win);
+                node->prop_cookie =
+                    xcb_get_property (dpy, 0, node->win, atom_wm_state,
+                                      XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
+                node->qt_cookie = xcb_query_tree (dpy, node->win);
+            }
+            free (tree); /* includes children */
+        }
+        if (failed) {
+            /* Out of memory; drop the rest of the search */
+            while (++parent < n_frontier)
+                xcb_discard_reply (dpy, frontier[parent].qt_cookie.sequence);
+            for (i = 0; i < n_level; i++) {
+                xcb_discard_reply (dpy, level[i].attr_cookie.sequence);
+                xcb_discard_reply (dpy, level[i].prop_cookie.sequence);
+                xcb_discard_reply (dpy, level[i].qt_cookie.sequence);
+            }
+            break;
         }
-        if (!window_has_property(dpy, children[i], atom_wm_state))
-            continue;
 
-        /* Got one */
-        win = children[i];
-        goto done;
-    }
+        /*
+         * Check the children, keeping the viewable ones as the next
+         * frontier.  Past the first match, the children of its parent and
+         * of the windows after it are no longer of interest.
+         */
+        n_frontier = 0;
+        matched = 0;
+        for (i = 0; i < n_level; i++) {
+            struct search_node *node = &level[i];
+            int viewable, has_state;
+
+            if (matched) {
+                xcb_discard_reply (dpy, node->attr_cookie.sequence);
+                xcb_discard_reply (dpy, node->prop_cookie.sequence);
+                xcb_discard_reply (dpy, node->qt_cookie.sequence);
+                continue;
+            }
+
+            collect_search_node (dpy, node, &viewable, &has_state);
+            if (viewable && has_state) {
+                /* Got one */
+                found = node->win;
+                while (n_frontier > 0 &&
+                       level[n_frontier - 1].parent == node->parent) {
+                    n_frontier--;
+                    xcb_discard_reply (dpy,
+                                       level[n_frontier].qt_cookie.sequence);
+                }
+                xcb_discard_reply (dpy, node->qt_cookie.sequence);
+                matched = 1;
+                continue;
+            }
+            if (!viewable) {
+                /* Don't bother descending into this one */
+                xcb_discard_reply (dpy, node->qt_cookie.sequence);
+                continue;
+            }
+            level[n_frontier++] = *node;
+        }
 
-    /* No children matched, now descend into each child */
-    for (i = (int) n_children - 1; i >= 0; i--) {
-        if (children[i] == XCB_WINDOW_NONE)
-            continue;
-        win = find_client_in_children(dpy, children[i]);
-        if (win != XCB_WINDOW_NONE)
-            break;
+        /* The next level's frontier is this level's survivors */
+        tmp = frontier;
+        frontier = level;
+        level = tmp;
+        i = frontier_size;
+        frontier_size = level_size;
+        level_size = i;
     }
 
-  done:
-    free (tree); /* includes children */
+    free (frontier);
+    free (level);
 
-    return win;
+    return found;
 }
 
 /*
@@ -212,6 +320,7 @@ find_client(xcb_connection_t * dpy, xcb_window_t root, xcb_window_t subwin)
     xcb_window_t *roots;
     unsigned int i, n_roots;
     xcb_window_t win;
+    xcb_query_tree_cookie_t qt_cookie;
 
     /* Check if subwin is a virtual root */
     roots = find_roots(dpy, root, &n_roots);
@@ -234,12 +343,15 @@ find_client(xcb_connection_t * dpy, xcb_window_t root, xcb_window_t subwin)
             return subwin;
     }
 
-    /* Check if subwin has WM_STATE */
-    if (window_has_property(dpy, subwin, atom_wm_state))
+    /* Check if subwin has WM_STATE, asking for its children meanwhile */
+    qt_cookie = xcb_query_tree (dpy, subwin);
+    if (window_has_property(dpy, subwin, atom_wm_state)) {
+        xcb_discard_reply (dpy, qt_cookie.sequence);
         return subwin;
+    }
 
     /* Attempt to find a client window in subwin's children */
-    win = find_client_in_children(dpy, subwin);
+    win = find_client_in_children(dpy, subwin, qt_cookie);
     if (win != XCB_WINDOW_NONE)
         return win;             /* Found a client */
 
@@ -56,8 +56,17 @@ from The Open Group.
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "clientwin.h"
 #include "dsimple.h"
+#include "profile.h"
+#include "replay.h"
 
 /*
  * Just_display: A group of routines designed to make the writing of simple
@@ -107,7 +116,7 @@ void setup_display_and_screen (
     int screen_number, i, err;
 
     /* Open Display */
-    *dpy = xcb_connect (display_name, &screen_number);
+    *dpy = replay_connect (display_name, &screen_number);
     if ((err = xcb_connection_has_error (*dpy)) != 0) {
         switch (err) {
         case XCB_CONN_CLOSED_MEM_INSUFFICIENT:
@@ -401,7 +410,7 @@ window_with_name (
 void fatal_error (const char *msg, ...)
 {
     va_list args;
-    fflush (stdout);
+    out_flush ();
     fflush (stderr);
     fprintf (stderr, "%s: error: ", program_name);
     va_start (args, msg);
@@ -411,6 +420,142 @@ void fatal_error (const char *msg, ...)
     exit (EXIT_FAILURE);
 }
 
+/*
+ * Output to stdout is gathered in one buffer and written out in large
+ * chunks, bypassing stdio, with the common conversions done by hand.
+ * When stdout is a terminal, it is written out at the end of every line
+ * instead, as stdio would.
+ */
+#define OUT_BUFFER_SIZE 65536
+
+static char *out_buf;
+static size_t out_used, out_size;
+static int out_interactive;
+
+void out_flush (void)
+{
+    size_t done = 0;
+
+    while (done < out_used) {
+	ssize_t n = write (STDOUT_FILENO, out_buf + done, out_used - done);
+
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;	/* like stdio, drop what can't be written */
+	}
+	profile_output (n);
+	done += n;
+    }
+    out_used = 0;
+}
+
+/* Make room for len more bytes, and return where they go */
+static char *
+out_reserve (size_t len)
+{
+    if (!out_buf) {
+	out_size = OUT_BUFFER_SIZE;
+	out_buf = malloc (out_size);
+	if (!out_buf) {
+	    out_size = 0;
+	    fatal_error ("Out of memory!");
+	}
+	out_interactive = isatty (STDOUT_FILENO);
+	atexit (out_flush);
+    }
+    if (len > out_size - out_used) {
+	out_flush ();
+	if (len > out_size) {
+	    char *b = realloc (out_buf, len);
+
+	    if (!b)
+		fatal_error ("Out of memory!");
+	    out_buf = b;
+	    out_size = len;
+	}
+    }
+    return out_buf + out_used;
+}
+
+static void
+out_commit (size_t len)
+{
+    out_used += len;
+    if (out_interactive && memchr (out_buf + out_used - len, '\n', len))
+	out_flush ();
+}
+
+void out_write (const char *s, size_t len)
+{
+    memcpy (out_reserve (len), s, len);
+    out_commit (len);
+}
+
+void out_str (const char *s)
+{
+    out_write (s, strlen (s));
+}
+
+void out_char (char c)
+{
+    out_write (&c, 1);
+}
+
+void out_uint (unsigned long value)
+{
+    char buf[24], *p = buf + sizeof(buf);
+
+    do
+	*--p = '0' + value % 10;
+    while ((value /= 10) != 0);
+    out_write (p, buf + sizeof(buf) - p);
+}
+
+void out_int (long value)
+{
+    if (value < 0) {
+	out_char ('-');
+	out_uint (-(unsigned long) value);
+    } else
+	out_uint (value);
+}
+
+/* Write value in hex, with a 0x prefix, as printf's "0x%lx" does */
+void out_hex (unsigned long value)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[24], *p = buf + sizeof(buf);
+
+    do
+	*--p = digits[value & 0xf];
+    while ((value >>= 4) != 0);
+    *--p = 'x';
+    *--p = '0';
+    out_write (p, buf + sizeof(buf) - p);
+}
+
+void out_printf (const char *fmt, ...)
+{
+    va_list args;
+    char *p;
+    int len;
+
+    p = out_reserve (256);
+    va_start (args, fmt);
+    len = vsnprintf (p, out_size - out_used, fmt, args);
+    va_end (args);
+    if (len < 0)
+	return;
+    if ((size_t) len >= out_size - out_used) {
+	p = out_reserve (len + 1);
+	va_start (args, fmt);
+	vsnprintf (p, len + 1, fmt, args);
+	va_end (args);
+    }
+    out_commit (len);
+}
+
 /*
  * Print X error information like the default Xlib error handler
  */
@@ -535,15 +680,464 @@ print_x_error (
 
 /*
  * Cache for atom lookups in either direction
+ * Entries are hashed both by name and by atom, each once it is known.
  */
+#define ATOM_CACHE_SIZE 256	/* must be a power of two */
+
 struct atom_cache_entry {
     xcb_atom_t atom;
     const char *name;
     xcb_intern_atom_cookie_t intern_atom;
-    struct atom_cache_entry *next;
+    xcb_get_atom_name_cookie_t atom_name;
+    int from_disk;	/* atom read from the cache file, not yet trusted */
+    int absent;		/* the server had no such atom, when last asked */
+    struct atom_cache_entry *next_by_name;
+    struct atom_cache_entry *next_by_atom;
+};
+
+static struct atom_cache_entry *atoms_by_name[ATOM_CACHE_SIZE];
+static struct atom_cache_entry *atoms_by_atom[ATOM_CACHE_SIZE];
+
+/*
+ * Atom cache file, as written by save_atom_cache(): a header, then count
+ * entries, then names_size bytes of nul-terminated names that the entries
+ * and the header point into by offset.  The file is only meant to be read
+ * back on the machine that wrote it, so everything is in native order.
+ *
+ * A cache is only good for the server that handed out its atoms.  When it
+ * is written, a uniquely named sentinel atom is created on the server;
+ * when it is read back, the sentinel is looked up along with the first
+ * requests we make, and if the server no longer has it with the same value
+ * the server has been restarted since and the cache is thrown away.
+ *
+ * Atoms the server didn't have are kept too, with an atom of None, so a
+ * run needn't wait to learn again that there is no _NET_FRAME_EXTENTS
+ * on a server without a window manager.  The sentinel can't vouch for
+ * them, as anyone may create such an atom without restarting the server,
+ * so each is still looked up, but in the same flight as the requests the
+ * answer was guessed for, like the sentinel: see check_atom_cache().
+ */
+#define ATOM_CACHE_MAGIC "XWIATOM1"
+
+struct atom_cache_file_header {
+    char magic[8];
+    uint32_t root;		/* root window of the first screen */
+    uint32_t sentinel;		/* value of the sentinel atom */
+    uint32_t sentinel_name;	/* offset of the sentinel atom's name */
+    uint32_t display_name;	/* offset of the display name */
+    uint32_t count;
+    uint32_t names_size;
 };
 
-static struct atom_cache_entry *atom_cache;
+struct atom_cache_file_entry {
+    uint32_t atom;
+    uint32_t name;		/* offset of the atom's name */
+};
+
+static const char *disk_cache_path;
+static const struct atom_cache_file_header *disk_cache;
+static const struct atom_cache_file_entry *disk_cache_entries;
+static const char *disk_cache_names;
+static xcb_intern_atom_cookie_t disk_cache_sentinel;
+static enum { DISK_CACHE_UNVERIFIED, DISK_CACHE_VALID, DISK_CACHE_INVALID }
+    disk_cache_state = DISK_CACHE_INVALID;
+static int disk_cache_dirty;	/* learned atoms the file doesn't have */
+static int disk_cache_speculating;	/* hand atoms out unverified */
+static int disk_cache_speculated;	/* and some were */
+static const char *disk_cache_display;
+
+/* Atoms are handed out sequentially, so their low bits spread well */
+#define hash_atom(atom) ((atom) & (ATOM_CACHE_SIZE - 1))
+
+static unsigned int
+hash_atom_name (const char *name)
+{
+    unsigned int h = 2166136261u;	/* FNV-1a */
+
+    while (*name)
+	h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h & (ATOM_CACHE_SIZE - 1);
+}
+
+static void
+atom_cache_add_by_name (struct atom_cache_entry *a)
+{
+    unsigned int h = hash_atom_name (a->name);
+
+    a->next_by_name = atoms_by_name[h];
+    atoms_by_name[h] = a;
+}
+
+static void
+atom_cache_add_by_atom (struct atom_cache_entry *a)
+{
+    unsigned int h = hash_atom (a->atom);
+
+    a->next_by_atom = atoms_by_atom[h];
+    atoms_by_atom[h] = a;
+}
+
+static struct atom_cache_entry *
+atom_cache_find_atom (xcb_atom_t atom)
+{
+    struct atom_cache_entry *a;
+
+    for (a = atoms_by_atom[hash_atom (atom)] ; a != NULL ; a = a->next_by_atom) {
+	if (a->atom == atom)
+	    return a;
+    }
+    return NULL;
+}
+
+static struct atom_cache_entry *
+atom_cache_find_name (const char *name)
+{
+    struct atom_cache_entry *a;
+
+    for (a = atoms_by_name[hash_atom_name (name)] ; a != NULL ;
+	 a = a->next_by_name) {
+	if (strcmp (a->name, name) == 0)
+	    return a;
+    }
+    return NULL;
+}
+
+/* Wait for the lookup of an atom by name and note what it found */
+static void
+atom_cache_resolve (xcb_connection_t * dpy, struct atom_cache_entry *a)
+{
+    xcb_intern_atom_reply_t *reply;
+
+    reply = xcb_intern_atom_reply(dpy, a->intern_atom, NULL);
+    a->intern_atom.sequence = 0; /* an atom that doesn't exist stays None */
+    if (reply) {
+	a->atom = reply->atom;
+	free (reply);
+	if (a->atom != XCB_ATOM_NONE) {
+	    atom_cache_add_by_atom (a);
+	    a->absent = 0;
+	    disk_cache_dirty = 1;
+	} else if (!a->absent) {
+	    a->absent = 1;
+	    disk_cache_dirty = 1;
+	}
+    } else {
+	a->atom = (xcb_atom_t) -1;
+    }
+}
+
+/* Look up an atom in the cache file, NULL if it isn't there */
+static const struct atom_cache_file_entry *
+disk_cache_find_name (const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < disk_cache->count; i++) {
+	if (strcmp (disk_cache_names + disk_cache_entries[i].name, name) == 0)
+	    return &disk_cache_entries[i];
+    }
+    return NULL;
+}
+
+/* Look up an atom's name in the cache file, NULL if it isn't there */
+static const char *
+disk_cache_find_atom (xcb_atom_t atom)
+{
+    uint32_t i;
+
+    for (i = 0; i < disk_cache->count; i++) {
+	if (disk_cache_entries[i].atom == atom && atom != XCB_ATOM_NONE)
+	    return disk_cache_names + disk_cache_entries[i].name;
+    }
+    return NULL;
+}
+
+/*
+ * Wait for the sentinel lookup sent by load_atom_cache(), then either
+ * trust the atoms taken from the cache file so far or ask the server for
+ * all of them after all.
+ */
+static void
+verify_atom_cache (xcb_connection_t * dpy)
+{
+    xcb_intern_atom_reply_t *reply;
+    struct atom_cache_entry *a;
+    int h;
+
+    if (disk_cache_state != DISK_CACHE_UNVERIFIED)
+	return;
+
+    reply = xcb_intern_atom_reply (dpy, disk_cache_sentinel, NULL);
+    if (reply && reply->atom != XCB_ATOM_NONE
+	&& reply->atom == disk_cache->sentinel)
+	disk_cache_state = DISK_CACHE_VALID;
+    else
+	disk_cache_state = DISK_CACHE_INVALID;
+    free (reply);
+
+    for (h = 0; h < ATOM_CACHE_SIZE; h++) {
+	for (a = atoms_by_name[h] ; a != NULL ; a = a->next_by_name) {
+	    if (!a->from_disk)
+		continue;
+	    a->from_disk = 0;
+	    if (disk_cache_state == DISK_CACHE_VALID) {
+		atom_cache_add_by_atom (a);
+	    } else {
+		a->atom = XCB_ATOM_NONE;
+		a->intern_atom =
+		    xcb_intern_atom (dpy, 1, strlen (a->name), a->name);
+	    }
+	}
+    }
+}
+
+/*
+ * While on, get_atom() returns atoms from the cache file without waiting
+ * for it to be verified, so requests using them can go out in the same
+ * flight as the check.  Once their replies are in, check_atom_cache()
+ * says whether they can be used.
+ */
+void speculate_atom_cache (int on)
+{
+    disk_cache_speculating = on;
+}
+
+/*
+ * Wait for the cache file to be verified, and return false if atoms
+ * handed out by speculate_atom_cache() turned out to be stale, in which
+ * case get_atom() now asks the server for them.  Atoms the file says
+ * don't exist are stale if they have been created since.
+ */
+int check_atom_cache (xcb_connection_t * dpy)
+{
+    struct atom_cache_entry *a;
+    int speculated = disk_cache_speculated, created = 0, h;
+
+    disk_cache_speculated = 0;
+    if (!speculated)
+	return 1;
+    verify_atom_cache (dpy);
+    for (h = 0; h < ATOM_CACHE_SIZE; h++) {
+	for (a = atoms_by_name[h] ; a != NULL ; a = a->next_by_name) {
+	    if (a->absent && a->intern_atom.sequence) {
+		atom_cache_resolve (dpy, a);
+		if (a->atom != XCB_ATOM_NONE)
+		    created = 1;
+	    }
+	}
+    }
+    return disk_cache_state == DISK_CACHE_VALID && !created;
+}
+
+/*
+ * Read atoms from a cache file written by an earlier save_atom_cache()
+ * for the same display, so we need not ask the server for them.  A
+ * missing or unusable file just means starting with an empty cache.
+ * Must be called before any other atom lookups.
+ */
+void load_atom_cache (xcb_connection_t * dpy, const char *displayname,
+		      const char *path)
+{
+    const struct atom_cache_file_header *header;
+    const char *names;
+    struct stat st;
+    void *map;
+    size_t size;
+    uint32_t i;
+    int fd;
+
+    disk_cache_path = path;
+    disk_cache_display = get_display_name (displayname);
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+	return;
+    if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof(*header)) {
+	close (fd);
+	return;
+    }
+    size = st.st_size;
+    map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+	return;
+
+    /* Check that everything the header points at lies in the file */
+    header = map;
+    names = (const char *) map + sizeof(*header)
+	+ (size_t) header->count * sizeof(struct atom_cache_file_entry);
+    if (memcmp (header->magic, ATOM_CACHE_MAGIC, sizeof(header->magic))
+	|| header->count > size / sizeof(struct atom_cache_file_entry)
+	|| header->names_size == 0
+	|| names + header->names_size != (const char *) map + size
+	|| names[header->names_size - 1] != '\0'
+	|| header->sentinel_name >= header->names_size
+	|| header->display_name >= header->names_size
+	|| header->root != xcb_setup_roots_iterator
+				(xcb_get_setup (dpy)).data->root
+	|| strcmp (names + header->display_name, disk_cache_display)) {
+	munmap (map, size);
+	return;
+    }
+    disk_cache = header;
+    disk_cache_entries = (const struct atom_cache_file_entry *) (header + 1);
+    disk_cache_names = names;
+    for (i = 0; i < header->count; i++) {
+	if (disk_cache_entries[i].name >= header->names_size) {
+	    munmap (map, size);
+	    disk_cache = NULL;
+	    return;
+	}
+    }
+
+    disk_cache_sentinel = xcb_intern_atom
+	(dpy, 1, strlen (names + header->sentinel_name),
+	 names + header->sentinel_name);
+    disk_cache_state = DISK_CACHE_UNVERIFIED;
+}
+
+/*
+ * Write every atom we know of to the file given to load_atom_cache(), if
+ * that adds anything to what the file already had.  The cache is only an
+ * optimization, so failing to write it is not an error.
+ */
+void save_atom_cache (xcb_connection_t * dpy)
+{
+    struct atom_cache_file_header header;
+    struct atom_cache_file_entry *entries;
+    struct atom_cache_entry *a;
+    char sentinel_name[64], *tmp_path, *names;
+    const char *sentinel = NULL;
+    size_t names_size, max_count, count = 0, len;
+    uint32_t i;
+    int h, fd, ok;
+
+    if (disk_cache_path == NULL || !disk_cache_dirty)
+	return;
+    verify_atom_cache (dpy);
+
+    if (disk_cache_state == DISK_CACHE_VALID) {
+	header.sentinel = disk_cache->sentinel;
+	sentinel = disk_cache_names + disk_cache->sentinel_name;
+    } else {
+	/* A name nobody else will have created on this server */
+	xcb_intern_atom_reply_t *reply;
+
+	snprintf (sentinel_name, sizeof(sentinel_name),
+		  "_XWININFO_ATOM_CACHE_%lx_%lx",
+		  (unsigned long) time (NULL), (unsigned long) getpid ());
+	reply = xcb_intern_atom_reply
+	    (dpy, xcb_intern_atom (dpy, 0, strlen (sentinel_name),
+				   sentinel_name), NULL);
+	if (reply == NULL)
+	    return;
+	header.sentinel = reply->atom;
+	free (reply);
+	sentinel = sentinel_name;
+    }
+
+    /* Size up the atoms we know and those in the file we never needed */
+    names_size = strlen (sentinel) + 1 + strlen (disk_cache_display) + 1;
+    max_count = 0;
+    for (h = 0; h < ATOM_CACHE_SIZE; h++) {
+	for (a = atoms_by_atom[h] ; a != NULL ; a = a->next_by_atom) {
+	    max_count++;
+	    if (a->name)
+		names_size += strlen (a->name) + 1;
+	}
+	for (a = atoms_by_name[h] ; a != NULL ; a = a->next_by_name) {
+	    if (a->absent) {
+		max_count++;
+		names_size += strlen (a->name) + 1;
+	    }
+	}
+    }
+    if (disk_cache_state == DISK_CACHE_VALID) {
+	max_count += disk_cache->count;
+	names_size += disk_cache->names_size;
+    }
+
+    entries = calloc (max_count ? max_count : 1, sizeof(*entries));
+    names = malloc (names_size);
+    if (entries == NULL || names == NULL)
+	goto out;
+
+    memcpy (names, sentinel, strlen (sentinel) + 1);
+    header.sentinel_name = 0;
+    names_size = strlen (sentinel) + 1;
+    len = strlen (disk_cache_display) + 1;
+    memcpy (names + names_size, disk_cache_display, len);
+    header.display_name = names_size;
+    names_size += len;
+
+    for (h = 0; h < ATOM_CACHE_SIZE; h++) {
+	for (a = atoms_by_atom[h] ; a != NULL ; a = a->next_by_atom) {
+	    if (a->name == NULL || a->atom == XCB_ATOM_NONE
+		|| a->atom == (xcb_atom_t) -1
+		|| atom_cache_find_atom (a->atom) != a)
+		continue; /* unknown, or a duplicate */
+	    len = strlen (a->name) + 1;
+	    memcpy (names + names_size, a->name, len);
+	    entries[count].atom = a->atom;
+	    entries[count].name = names_size;
+	    names_size += len;
+	    count++;
+	}
+	for (a = atoms_by_name[h] ; a != NULL ; a = a->next_by_name) {
+	    if (!a->absent)
+		continue;
+	    len = strlen (a->name) + 1;
+	    memcpy (names + names_size, a->name, len);
+	    entries[count].atom = XCB_ATOM_NONE;
+	    entries[count].name = names_size;
+	    names_size += len;
+	    count++;
+	}
+    }
+    if (disk_cache_state == DISK_CACHE_VALID) {
+	for (i = 0; i < disk_cache->count; i++) {
+	    const char *name = disk_cache_names + disk_cache_entries[i].name;
+
+	    if (disk_cache_entries[i].atom == XCB_ATOM_NONE ?
+		atom_cache_find_name (name) != NULL :
+		atom_cache_find_atom (disk_cache_entries[i].atom) != NULL)
+		continue;
+	    len = strlen (name) + 1;
+	    memcpy (names + names_size, name, len);
+	    entries[count].atom = disk_cache_entries[i].atom;
+	    entries[count].name = names_size;
+	    names_size += len;
+	    count++;
+	}
+    }
+
+    memcpy (header.magic, ATOM_CACHE_MAGIC, sizeof(header.magic));
+    header.root = xcb_setup_roots_iterator (xcb_get_setup (dpy)).data->root;
+    header.count = count;
+    header.names_size = names_size;
+
+    /* Replace the file in one go, in case another instance is reading it */
+    tmp_path = malloc (strlen (disk_cache_path) + sizeof(".XXXXXX"));
+    if (tmp_path == NULL)
+	goto out;
+    sprintf (tmp_path, "%s.XXXXXX", disk_cache_path);
+    fd = mkstemp (tmp_path);
+    if (fd >= 0) {
+	ok = write (fd, &header, sizeof(header)) == sizeof(header)
+	    && write (fd, entries, count * sizeof(*entries))
+		== (ssize_t) (count * sizeof(*entries))
+	    && write (fd, names, names_size) == (ssize_t) names_size;
+	if (close (fd) < 0)
+	    ok = 0;
+	if (!ok || rename (tmp_path, disk_cache_path) < 0)
+	    unlink (tmp_path);
+    }
+    free (tmp_path);
+
+  out:
+    free (entries);
+    free (names);
+}
 
 /*
  * Send a request to the server for an atom by name
@@ -551,19 +1145,28 @@ static struct atom_cache_entry *atom_cache;
  */
 struct atom_cache_entry *Intern_Atom (xcb_connection_t * dpy, const char *name)
 {
+    const struct atom_cache_file_entry *entry = NULL;
     struct atom_cache_entry *a;
 
-    for (a = atom_cache ; a != NULL ; a = a->next) {
-	if (strcmp (a->name, name) == 0)
-	    return a; /* already requested or found */
-    }
+    a = atom_cache_find_name (name);
+    if (a != NULL)
+	return a; /* already requested or found */
 
     a = calloc(1, sizeof(struct atom_cache_entry));
     if (a != NULL) {
 	a->name = name;
-	a->intern_atom = xcb_intern_atom (dpy, 1, strlen (name), (name));
-	a->next = atom_cache;
-	atom_cache = a;
+	if (disk_cache_state != DISK_CACHE_INVALID)
+	    entry = disk_cache_find_name (name);
+	if (entry != NULL)
+	    a->atom = entry->atom;
+	if (a->atom != XCB_ATOM_NONE)
+	    a->from_disk = 1;
+	else {
+	    /* if the file says it doesn't exist, that is checked too */
+	    a->absent = entry != NULL;
+	    a->intern_atom = xcb_intern_atom (dpy, 1, strlen (name), (name));
+	}
+	atom_cache_add_by_name (a);
     }
     return a;
 }
@@ -576,40 +1179,95 @@ xcb_atom_t get_atom (xcb_connection_t * dpy, const char *name)
     if (a == NULL)
 	return XCB_ATOM_NONE;
 
-    if (a->atom == XCB_ATOM_NONE) {
-	xcb_intern_atom_reply_t *reply;
-
-	reply = xcb_intern_atom_reply(dpy, a->intern_atom, NULL);
-	if (reply) {
-	    a->atom = reply->atom;
-	    free (reply);
-	} else {
-	    a->atom = (xcb_atom_t) -1;
+    if (a->from_disk) {
+	if (disk_cache_speculating && disk_cache_state == DISK_CACHE_UNVERIFIED) {
+	    disk_cache_speculated = 1;
+	    return a->atom;
 	}
+	verify_atom_cache (dpy);
+    }
+    if (a->absent && a->intern_atom.sequence && disk_cache_speculating) {
+	disk_cache_speculated = 1;
+	return XCB_ATOM_NONE;
     }
+
+    if (a->atom == XCB_ATOM_NONE && a->intern_atom.sequence)
+	atom_cache_resolve (dpy, a);
     if (a->atom == (xcb_atom_t) -1) /* internal error */
 	return XCB_ATOM_NONE;
 
     return a->atom;
 }
 
-/* Get the name for an atom when it is needed. */
-const char *get_atom_name (xcb_connection_t * dpy, xcb_atom_t atom)
+/*
+ * Send requests to the server for the names of any of these atoms we
+ * don't know yet, so get_atom_name() finds their replies waiting.
+ */
+void prefetch_atom_names (xcb_connection_t * dpy,
+			  const xcb_atom_t *atoms, unsigned int count)
 {
     struct atom_cache_entry *a;
+    unsigned int i;
 
-    for (a = atom_cache ; a != NULL ; a = a->next) {
-	if (a->atom == atom)
-	    return a->name; /* already requested or found */
+    if (disk_cache_state == DISK_CACHE_UNVERIFIED)
+	verify_atom_cache (dpy);
+
+    for (i = 0; i < count; i++) {
+	if (atom_cache_find_atom (atoms[i]) != NULL)
+	    continue; /* already requested or found */
+
+	a = calloc(1, sizeof(struct atom_cache_entry));
+	if (a == NULL)
+	    return;
+	a->atom = atoms[i];
+	if (disk_cache_state == DISK_CACHE_VALID)
+	    a->name = disk_cache_find_atom (atoms[i]);
+	if (a->name != NULL)
+	    atom_cache_add_by_name (a);
+	else
+	    a->atom_name = xcb_get_atom_name (dpy, atoms[i]);
+	atom_cache_add_by_atom (a);
     }
+}
+
+/*
+ * Tell the cache the name of an atom learned some other way, such as from
+ * a -from-snapshot file, so get_atom_name() never asks the server for it.
+ * The name is not copied.
+ */
+void add_atom_name (xcb_atom_t atom, const char *name)
+{
+    struct atom_cache_entry *a;
+
+    if (atom_cache_find_atom (atom) != NULL)
+	return;
 
     a = calloc(1, sizeof(struct atom_cache_entry));
-    if (a != NULL) {
-	xcb_get_atom_name_cookie_t cookie = xcb_get_atom_name (dpy, atom);
+    if (a == NULL)
+	return;
+    a->atom = atom;
+    a->name = name;
+    atom_cache_add_by_name (a);
+    atom_cache_add_by_atom (a);
+}
+
+/* Get the name for an atom when it is needed. */
+const char *get_atom_name (xcb_connection_t * dpy, xcb_atom_t atom)
+{
+    struct atom_cache_entry *a = atom_cache_find_atom (atom);
+
+    if (a == NULL) {
+	prefetch_atom_names (dpy, &atom, 1);
+	a = atom_cache_find_atom (atom);
+	if (a == NULL)
+	    return NULL;
+    }
+
+    if (a->atom_name.sequence) {
 	xcb_get_atom_name_reply_t *reply
-	    = xcb_get_atom_name_reply (dpy, cookie, NULL);
+	    = xcb_get_atom_name_reply (dpy, a->atom_name, NULL);
 
-	a->atom = atom;
+	a->atom_name.sequence = 0;
 	if (reply) {
 	    int len = xcb_get_atom_name_name_length (reply);
 	    char *name = malloc(len + 1);
@@ -617,14 +1275,11 @@ const char *get_atom_name (xcb_connection_t * dpy, xcb_atom_t atom)
 		memcpy (name, xcb_get_atom_name_name (reply), len);
 		name[len] = '\0';
 		a->name = name;
+		atom_cache_add_by_name (a);
+		disk_cache_dirty = 1;
 	    }
 	    free (reply);
 	}
-
-	a->next = atom_cache;
-	atom_cache = a;
-
-	return a->name;
     }
-    return NULL;
+    return a->name;
 }
@@ -56,6 +56,21 @@ void fatal_error (const char *, ...) _X_NORETURN _X_ATTRIBUTE_PRINTF(1, 2) _X_CO
 
 void print_x_error (xcb_connection_t *, xcb_generic_error_t *);
 
+void out_write (const char *, size_t);
+void out_str (const char *);
+void out_char (char);
+void out_int (long);
+void out_uint (unsigned long);
+void out_hex (unsigned long);
+void out_printf (const char *, ...) _X_ATTRIBUTE_PRINTF(1, 2);
+void out_flush (void);
+
 struct atom_cache_entry *Intern_Atom (xcb_connection_t *, const char *);
 xcb_atom_t get_atom (xcb_connection_t *, const char *);
 const char *get_atom_name (xcb_connection_t *, xcb_atom_t);
+void add_atom_name (xcb_atom_t, const char *);
+void prefetch_atom_names (xcb_connection_t *, const xcb_atom_t *, unsigned int);
+void load_atom_cache (xcb_connection_t *, const char *, const char *);
+void save_atom_cache (xcb_connection_t *);
+void speculate_atom_cache (int);
+int check_atom_cache (xcb_connection_t *);
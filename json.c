@@ -0,0 +1,232 @@
+/*
+ * json.c: a streaming JSON writer for the -json and -ndjson output modes.
+ *
+ * See json.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+#include "dsimple.h"
+#include "utf8.h"
+
+/* Open objects and arrays, outermost first, grown as -tree goes deeper */
+static struct json_level {
+    char	in_array;
+    char	has_values;
+} *levels;
+static int depth = 0;
+static int levels_size = 0;
+static int pretty = 0;
+
+/* Indent every value on a line of its own, rather than one line per value */
+void
+json_set_pretty (int on)
+{
+    pretty = on;
+}
+
+static void
+json_newline (int indent)
+{
+    int i;
+
+    out_char ('\n');
+    for (i = 0; i < indent; i++)
+	out_write ("  ", 2);
+}
+
+static void json_quote (const char *, size_t);
+
+/* Write the separator and key (if in an object) that go before a value */
+static void
+json_key (const char *key)
+{
+    struct json_level *l;
+
+    if (depth == 0)
+	return;
+    l = &levels[depth - 1];
+    if (l->has_values)
+	out_char (',');
+    l->has_values = 1;
+    if (pretty)
+	json_newline (depth);
+    if (!l->in_array) {
+	json_quote (key, strlen (key));
+	out_write (": ", pretty ? 2 : 1);
+    }
+}
+
+static void
+json_begin (const char *key, int in_array)
+{
+    json_key (key);
+    if (depth == levels_size) {
+	int size = levels_size ? 2 * levels_size : 16;
+	struct json_level *grown =
+	    realloc (levels, size * sizeof(struct json_level));
+
+	if (grown == NULL)
+	    fatal_error ("Failed to allocate memory in json_begin");
+	levels = grown;
+	levels_size = size;
+    }
+    levels[depth].in_array = in_array;
+    levels[depth].has_values = 0;
+    depth++;
+    out_char (in_array ? '[' : '{');
+}
+
+static void
+json_end (void)
+{
+    depth--;
+    if (pretty && levels[depth].has_values)
+	json_newline (depth);
+    out_char (levels[depth].in_array ? ']' : '}');
+    if (depth == 0)
+	out_char ('\n');
+}
+
+void
+json_begin_object (const char *key)
+{
+    json_begin (key, 0);
+}
+
+void
+json_end_object (void)
+{
+    json_end ();
+}
+
+void
+json_begin_array (const char *key)
+{
+    json_begin (key, 1);
+}
+
+void
+json_end_array (void)
+{
+    json_end ();
+}
+
+void
+json_int (const char *key, long value)
+{
+    json_key (key);
+    out_int (value);
+}
+
+void
+json_uint (const char *key, unsigned long value)
+{
+    json_key (key);
+    out_uint (value);
+}
+
+void
+json_bool (const char *key, int value)
+{
+    json_key (key);
+    out_str (value ? "true" : "false");
+}
+
+void
+json_null (const char *key)
+{
+    json_key (key);
+    out_write ("null", 4);
+}
+
+void
+json_string (const char *key, const char *value)
+{
+    if (value)
+	json_string_len (key, value, strlen (value));
+    else
+	json_null (key);
+}
+
+/* Write one character of a string, escaping it if JSON requires that */
+static void
+json_char (unsigned char c)
+{
+    switch (c) {
+    case '"':	out_str ("\\\""); break;
+    case '\\':	out_str ("\\\\"); break;
+    case '\b':	out_str ("\\b"); break;
+    case '\f':	out_str ("\\f"); break;
+    case '\n':	out_str ("\\n"); break;
+    case '\r':	out_str ("\\r"); break;
+    case '\t':	out_str ("\\t"); break;
+    default:
+	if (c < 0x20)
+	    out_printf ("\\u%04x", c);
+	else
+	    out_char (c);
+    }
+}
+
+/*
+ * Quote a UTF-8 string, which need not be NUL terminated.  Bytes that
+ * aren't part of a valid UTF-8 sequence are replaced by U+FFFD, so the
+ * output is valid JSON whatever a client put in its properties.
+ */
+static void
+json_quote (const char *value, size_t len)
+{
+    const unsigned char *s = (const unsigned char *) value;
+    size_t i, n;
+
+    out_char ('"');
+    for (i = 0; i < len; i += n) {
+	/* Copy runs of characters that need no escaping in one go */
+	for (n = 0; i + n < len && s[i + n] >= 0x20 && s[i + n] < 0x80 &&
+		 s[i + n] != '"' && s[i + n] != '\\'; n++)
+	    ;
+	if (n > 0)
+	    out_write (value + i, n);
+	else if (s[i] < 0x80) {
+	    json_char (s[i]);
+	    n = 1;
+	} else if ((n = utf8_sequence_length (s + i, len - i)) > 0) {
+	    out_write ((const char *) s + i, n);
+	} else {
+	    out_str ("\\ufffd");
+	    n = 1;
+	}
+    }
+    out_char ('"');
+}
+
+void
+json_string_len (const char *key, const char *value, size_t len)
+{
+    json_key (key);
+    json_quote (value, len);
+}
+
+/* Write an ISO 8859-1 string, such as a property of type STRING */
+void
+json_string_latin1 (const char *key, const char *value, size_t len)
+{
+    const unsigned char *s = (const unsigned char *) value;
+    size_t i;
+
+    json_key (key);
+    out_char ('"');
+    for (i = 0; i < len; i++) {
+	if (s[i] < 0x80)
+	    json_char (s[i]);
+	else {
+	    out_char (0xC0 | (s[i] >> 6));
+	    out_char (0x80 | (s[i] & 0x3F));
+	}
+    }
+    out_char ('"');
+}
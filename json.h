@@ -0,0 +1,29 @@
+/*
+ * json.h: a streaming JSON writer for the -json and -ndjson output modes.
+ *
+ * Values are written out as soon as they are given, so nothing is
+ * held back however big the document grows.  Every value is given a key,
+ * which is ignored for values inside an array.  When the outermost object
+ * or array is closed a newline is written, so each top-level value is a
+ * line of its own unless pretty printing is on.
+ */
+
+#ifndef _JSON_H_
+#define _JSON_H_
+
+#include <stddef.h>
+
+void json_set_pretty (int);
+void json_begin_object (const char *key);
+void json_end_object (void);
+void json_begin_array (const char *key);
+void json_end_array (void);
+void json_int (const char *key, long value);
+void json_uint (const char *key, unsigned long value);
+void json_bool (const char *key, int value);
+void json_null (const char *key);
+void json_string (const char *key, const char *value);
+void json_string_len (const char *key, const char *value, size_t len);
+void json_string_latin1 (const char *key, const char *value, size_t len);
+
+#endif
@@ -0,0 +1,353 @@
+/*
+ * profile.c: -profile, see profile.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+
+#define PROFILE_NO_WRAP
+#include "profile.h"
+#include "dsimple.h"
+
+#define PROFILE_MAX_PHASES 32
+
+static int profiling = 0;
+
+/* Requests are sent and replies waited for by the -jobs threads too */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *request_names[PROFILE_NUM_REQUESTS] = {
+    [PROFILE_CHANGE_WINDOW_ATTRIBUTES] = "ChangeWindowAttributes",
+    [PROFILE_GET_ATOM_NAME] = "GetAtomName",
+    [PROFILE_GET_GEOMETRY] = "GetGeometry",
+    [PROFILE_GET_PROPERTY] = "GetProperty",
+    [PROFILE_GET_WINDOW_ATTRIBUTES] = "GetWindowAttributes",
+    [PROFILE_GRAB_POINTER] = "GrabPointer",
+    [PROFILE_INTERN_ATOM] = "InternAtom",
+    [PROFILE_QUERY_POINTER] = "QueryPointer",
+    [PROFILE_QUERY_TREE] = "QueryTree",
+    [PROFILE_SHAPE_QUERY_EXTENTS] = "ShapeQueryExtents",
+    [PROFILE_TRANSLATE_COORDINATES] = "TranslateCoordinates",
+};
+
+static struct {
+    unsigned long	sent;
+    unsigned long	waited;		/* replies (or errors) waited for */
+    unsigned long long	bytes;		/* in those replies */
+} requests[PROFILE_NUM_REQUESTS];
+static double wait_time;	/* waiting for replies, over all threads */
+static unsigned long windows;	/* shown, or saved by -snapshot */
+static unsigned long round_trips;	/* made by tree walks */
+static unsigned long all_round_trips;
+
+/*
+ * Each connection's last request sent, and the last one sent when the
+ * latest round trip on it began.  A reply to a request after that one
+ * can't have been asked for in that round trip, so taking it is another,
+ * however fast the server answers.  That keeps the count the same from
+ * run to run.
+ */
+struct profile_connection {
+    xcb_connection_t		*c;
+    unsigned int		sent;
+    unsigned int		synced;
+    struct profile_connection	*next;
+};
+static struct profile_connection *connections;
+static unsigned long output_writes;	/* to stdout */
+static unsigned long long output_bytes;
+
+/* Phases are named with string constants, and time adds up over repeats */
+static struct {
+    const char		*name;
+    double		time;
+} phases[PROFILE_MAX_PHASES];
+static int num_phases = 0;
+static int current_phase = -1;
+static double start_time, phase_start;
+
+static double
+profile_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* End the current phase, and start the named one unless name is NULL */
+void
+profile_phase (const char *name)
+{
+    double now;
+    int i;
+
+    if (!profiling)
+	return;
+    now = profile_now ();
+    if (current_phase >= 0)
+	phases[current_phase].time += now - phase_start;
+    phase_start = now;
+    current_phase = -1;
+    if (!name)
+	return;
+
+    for (i = 0; i < num_phases; i++)
+	if (phases[i].name == name || !strcmp (phases[i].name, name))
+	    break;
+    if (i == num_phases) {
+	if (num_phases == PROFILE_MAX_PHASES)
+	    return;
+	phases[num_phases++].name = name;
+    }
+    current_phase = i;
+}
+
+static void
+profile_report (void)
+{
+    unsigned long sent = 0, waited = 0;
+    unsigned long long bytes = 0;
+    struct rusage usage;
+    int i;
+
+    profile_phase (NULL);
+
+    fprintf (stderr, "\n%s: profile:\n", program_name);
+    fprintf (stderr, "  %-24s %12s\n", "Phase", "ms");
+    for (i = 0; i < num_phases; i++)
+	fprintf (stderr, "  %-24s %12.3f\n", phases[i].name,
+		 phases[i].time * 1e3);
+    fprintf (stderr, "  %-24s %12.3f\n", "total",
+	     (profile_now () - start_time) * 1e3);
+
+    fprintf (stderr, "\n  %-24s %12s %12s %12s\n",
+	     "Request", "sent", "waited", "bytes");
+    for (i = 0; i < PROFILE_NUM_REQUESTS; i++) {
+	if (!requests[i].sent && !requests[i].waited)
+	    continue;
+	fprintf (stderr, "  %-24s %12lu %12lu %12llu\n", request_names[i],
+		 requests[i].sent, requests[i].waited, requests[i].bytes);
+	sent += requests[i].sent;
+	waited += requests[i].waited;
+	bytes += requests[i].bytes;
+    }
+    fprintf (stderr, "  %-24s %12lu %12lu %12llu\n",
+	     "total", sent, waited, bytes);
+    if (getrusage (RUSAGE_SELF, &usage) == 0)
+	fprintf (stderr, "\n  %.3f ms of CPU: %.3f ms user, %.3f ms system\n",
+		 (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+		 (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3,
+		 usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3,
+		 usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3);
+    fprintf (stderr, "  %llu bytes of output in %lu writes\n",
+	     output_bytes, output_writes);
+    fprintf (stderr, "  %.3f ms waiting for replies\n", wait_time * 1e3);
+    fprintf (stderr, "  %lu round trips for replies\n", all_round_trips);
+    if (round_trips > 0)
+	fprintf (stderr, "  %lu round trips walking the tree\n", round_trips);
+    if (windows > 0)
+	fprintf (stderr, "  %lu windows: %.2f requests and %.2f replies waited"
+		 " for per window\n", windows, (double) sent / windows,
+		 (double) waited / windows);
+}
+
+void
+profile_start (void)
+{
+    profiling = 1;
+    start_time = phase_start = profile_now ();
+    atexit (profile_report);
+}
+
+/* Find the counts for a connection, with profile_lock held */
+static struct profile_connection *
+profile_connection (xcb_connection_t *c)
+{
+    struct profile_connection *pc;
+
+    for (pc = connections; pc; pc = pc->next)
+	if (pc->c == c)
+	    return pc;
+    pc = calloc (1, sizeof(struct profile_connection));
+    if (pc == NULL)
+	fatal_error ("Failed to allocate memory in profile_connection");
+    pc->c = c;
+    pc->next = connections;
+    connections = pc;
+    return pc;
+}
+
+void
+profile_request (enum profile_request type, xcb_connection_t *c,
+		 unsigned int sequence)
+{
+    struct profile_connection *pc;
+
+    if (!profiling)
+	return;
+    pthread_mutex_lock (&profile_lock);
+    requests[type].sent++;
+    pc = profile_connection (c);
+    /* a new connection where a closed one was starts again from 1 */
+    if (sequence < pc->sent)
+	pc->synced = 0;
+    pc->sent = sequence;
+    pthread_mutex_unlock (&profile_lock);
+}
+
+/* Count the round trip taking the reply to a request may take */
+void
+profile_reply (xcb_connection_t *c, unsigned int sequence)
+{
+    struct profile_connection *pc;
+
+    if (!profiling)
+	return;
+    pthread_mutex_lock (&profile_lock);
+    pc = profile_connection (c);
+    if (sequence > pc->synced) {
+	all_round_trips++;
+	pc->synced = pc->sent;
+    }
+    pthread_mutex_unlock (&profile_lock);
+}
+
+/* Count windows shown, for the figures per window */
+void
+profile_windows (unsigned long n)
+{
+    windows += n;
+}
+
+/* Count the times a tree walk had to wait on the server */
+void
+profile_round_trips (unsigned long n)
+{
+    if (!profiling)
+	return;
+    pthread_mutex_lock (&profile_lock);
+    round_trips += n;
+    pthread_mutex_unlock (&profile_lock);
+}
+
+/* Count a write of the output to stdout */
+void
+profile_output (size_t bytes)
+{
+    if (!profiling)
+	return;
+    output_writes++;
+    output_bytes += bytes;
+}
+
+/* Time a wait for a reply, which profile_wait_end() accounts for */
+double
+profile_wait_begin (xcb_connection_t *c, unsigned int sequence)
+{
+    if (!profiling)
+	return 0;
+    profile_reply (c, sequence);
+    return profile_now ();
+}
+
+/* Account for a reply (or error) of the given length in 4 byte units */
+void
+profile_wait_end (enum profile_request type, double start, int received,
+		  uint32_t length)
+{
+    double end;
+
+    if (!profiling)
+	return;
+    end = profile_now ();
+    pthread_mutex_lock (&profile_lock);
+    requests[type].waited++;
+    if (received)
+	requests[type].bytes += 32 + 4 * (unsigned long long) length;
+    wait_time += end - start;
+    pthread_mutex_unlock (&profile_lock);
+}
+
+#define PROFILE_REPLY(func, type)					\
+xcb_##func##_reply_t *							\
+profile_##func##_reply (xcb_connection_t *c, xcb_##func##_cookie_t cookie, \
+			xcb_generic_error_t **e)			\
+{									\
+    double start = profile_wait_begin (c, cookie.sequence);		\
+    xcb_##func##_reply_t *reply = xcb_##func##_reply (c, cookie, e);	\
+									\
+    profile_wait_end (type, start, reply || (e && *e),			\
+		      reply ? reply->length : 0);			\
+    return reply;							\
+}
+
+PROFILE_REPLY (get_atom_name, PROFILE_GET_ATOM_NAME)
+PROFILE_REPLY (get_geometry, PROFILE_GET_GEOMETRY)
+PROFILE_REPLY (get_property, PROFILE_GET_PROPERTY)
+PROFILE_REPLY (get_window_attributes, PROFILE_GET_WINDOW_ATTRIBUTES)
+PROFILE_REPLY (grab_pointer, PROFILE_GRAB_POINTER)
+PROFILE_REPLY (intern_atom, PROFILE_INTERN_ATOM)
+PROFILE_REPLY (query_pointer, PROFILE_QUERY_POINTER)
+PROFILE_REPLY (query_tree, PROFILE_QUERY_TREE)
+PROFILE_REPLY (shape_query_extents, PROFILE_SHAPE_QUERY_EXTENTS)
+PROFILE_REPLY (translate_coordinates, PROFILE_TRANSLATE_COORDINATES)
+
+uint8_t
+profile_icccm_get_wm_name_reply (xcb_connection_t *c,
+				 xcb_get_property_cookie_t cookie,
+				 xcb_icccm_get_text_property_reply_t *prop,
+				 xcb_generic_error_t **e)
+{
+    double start = profile_wait_begin (c, cookie.sequence);
+    uint8_t ret = xcb_icccm_get_wm_name_reply (c, cookie, prop, e);
+
+    profile_wait_end (PROFILE_GET_PROPERTY, start, ret || (e && *e),
+		      ret ? prop->_reply->length : 0);
+    return ret;
+}
+
+uint8_t
+profile_icccm_get_wm_class_reply (xcb_connection_t *c,
+				  xcb_get_property_cookie_t cookie,
+				  xcb_icccm_get_wm_class_reply_t *prop,
+				  xcb_generic_error_t **e)
+{
+    double start = profile_wait_begin (c, cookie.sequence);
+    uint8_t ret = xcb_icccm_get_wm_class_reply (c, cookie, prop, e);
+
+    profile_wait_end (PROFILE_GET_PROPERTY, start, ret || (e && *e),
+		      ret ? prop->_reply->length : 0);
+    return ret;
+}
+
+/* These decode the reply as xcb-icccm does, to see how long it was */
+uint8_t
+profile_icccm_get_wm_size_hints_reply (xcb_connection_t *c,
+				       xcb_get_property_cookie_t cookie,
+				       xcb_size_hints_t *hints,
+				       xcb_generic_error_t **e)
+{
+    xcb_get_property_reply_t *reply = profile_get_property_reply (c, cookie, e);
+    uint8_t ret = reply && xcb_icccm_get_wm_size_hints_from_reply (hints, reply);
+
+    free (reply);
+    return ret;
+}
+
+uint8_t
+profile_icccm_get_wm_hints_reply (xcb_connection_t *c,
+				  xcb_get_property_cookie_t cookie,
+				  xcb_icccm_wm_hints_t *hints,
+				  xcb_generic_error_t **e)
+{
+    xcb_get_property_reply_t *reply = profile_get_property_reply (c, cookie, e);
+    uint8_t ret = reply && xcb_icccm_get_wm_hints_from_reply (hints, reply);
+
+    free (reply);
+    return ret;
+}
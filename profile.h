@@ -0,0 +1,186 @@
+/*
+ * profile.h: -profile, which reports on stderr where xwininfo spends its
+ * time: how long each phase of the run takes, how many requests of each
+ * kind were sent, how many of their replies were waited for and how many
+ * bytes those replies held, and how many round trips it all took.
+ *
+ * Included after the xcb headers, this wraps the xcb calls xwininfo uses,
+ * so every request and reply is counted without changing the callers.
+ * The wrappers cost a test of a flag when -profile isn't given.
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+#include <xcb/xcb_icccm.h>
+#include <xcb/shape.h>
+
+enum profile_request {
+    PROFILE_CHANGE_WINDOW_ATTRIBUTES,
+    PROFILE_GET_ATOM_NAME,
+    PROFILE_GET_GEOMETRY,
+    PROFILE_GET_PROPERTY,
+    PROFILE_GET_WINDOW_ATTRIBUTES,
+    PROFILE_GRAB_POINTER,
+    PROFILE_INTERN_ATOM,
+    PROFILE_QUERY_POINTER,
+    PROFILE_QUERY_TREE,
+    PROFILE_SHAPE_QUERY_EXTENTS,
+    PROFILE_TRANSLATE_COORDINATES,
+    PROFILE_NUM_REQUESTS
+};
+
+void profile_start (void);
+void profile_phase (const char *name);
+void profile_request (enum profile_request, xcb_connection_t *,
+		      unsigned int sequence);
+void profile_windows (unsigned long);
+void profile_round_trips (unsigned long);
+void profile_output (size_t);
+void profile_reply (xcb_connection_t *, unsigned int sequence);
+double profile_wait_begin (xcb_connection_t *, unsigned int sequence);
+void profile_wait_end (enum profile_request, double start, int received,
+		       uint32_t length);
+
+xcb_get_atom_name_reply_t *profile_get_atom_name_reply
+    (xcb_connection_t *, xcb_get_atom_name_cookie_t, xcb_generic_error_t **);
+xcb_get_geometry_reply_t *profile_get_geometry_reply
+    (xcb_connection_t *, xcb_get_geometry_cookie_t, xcb_generic_error_t **);
+xcb_get_property_reply_t *profile_get_property_reply
+    (xcb_connection_t *, xcb_get_property_cookie_t, xcb_generic_error_t **);
+xcb_get_window_attributes_reply_t *profile_get_window_attributes_reply
+    (xcb_connection_t *, xcb_get_window_attributes_cookie_t,
+     xcb_generic_error_t **);
+xcb_grab_pointer_reply_t *profile_grab_pointer_reply
+    (xcb_connection_t *, xcb_grab_pointer_cookie_t, xcb_generic_error_t **);
+xcb_intern_atom_reply_t *profile_intern_atom_reply
+    (xcb_connection_t *, xcb_intern_atom_cookie_t, xcb_generic_error_t **);
+xcb_query_pointer_reply_t *profile_query_pointer_reply
+    (xcb_connection_t *, xcb_query_pointer_cookie_t, xcb_generic_error_t **);
+xcb_query_tree_reply_t *profile_query_tree_reply
+    (xcb_connection_t *, xcb_query_tree_cookie_t, xcb_generic_error_t **);
+xcb_shape_query_extents_reply_t *profile_shape_query_extents_reply
+    (xcb_connection_t *, xcb_shape_query_extents_cookie_t,
+     xcb_generic_error_t **);
+xcb_translate_coordinates_reply_t *profile_translate_coordinates_reply
+    (xcb_connection_t *, xcb_translate_coordinates_cookie_t,
+     xcb_generic_error_t **);
+
+uint8_t profile_icccm_get_wm_name_reply
+    (xcb_connection_t *, xcb_get_property_cookie_t,
+     xcb_icccm_get_text_property_reply_t *, xcb_generic_error_t **);
+uint8_t profile_icccm_get_wm_class_reply
+    (xcb_connection_t *, xcb_get_property_cookie_t,
+     xcb_icccm_get_wm_class_reply_t *, xcb_generic_error_t **);
+uint8_t profile_icccm_get_wm_size_hints_reply
+    (xcb_connection_t *, xcb_get_property_cookie_t, xcb_size_hints_t *,
+     xcb_generic_error_t **);
+uint8_t profile_icccm_get_wm_hints_reply
+    (xcb_connection_t *, xcb_get_property_cookie_t, xcb_icccm_wm_hints_t *,
+     xcb_generic_error_t **);
+
+#ifndef PROFILE_NO_WRAP
+
+/*
+ * Count a request as it is sent, and pass its cookie on.  The connection
+ * is evaluated twice, once for xcb and once for the count, which is fine
+ * as long as it has no side effects: in xwininfo it never has.
+ */
+#define PROFILE_COOKIE(cookie)						\
+static inline xcb_##cookie##_cookie_t					\
+profile_sent_##cookie (enum profile_request type, xcb_connection_t *c,	\
+		       xcb_##cookie##_cookie_t sent)			\
+{									\
+    profile_request (type, c, sent.sequence);				\
+    return sent;							\
+}
+
+PROFILE_COOKIE (void)
+PROFILE_COOKIE (get_atom_name)
+PROFILE_COOKIE (get_geometry)
+PROFILE_COOKIE (get_property)
+PROFILE_COOKIE (get_window_attributes)
+PROFILE_COOKIE (grab_pointer)
+PROFILE_COOKIE (intern_atom)
+PROFILE_COOKIE (query_pointer)
+PROFILE_COOKIE (query_tree)
+PROFILE_COOKIE (shape_query_extents)
+PROFILE_COOKIE (translate_coordinates)
+
+#define PROFILE_SEND(type, cookie, c, request) \
+    profile_sent_##cookie (type, c, request)
+
+#define xcb_change_window_attributes(c, ...) \
+    PROFILE_SEND (PROFILE_CHANGE_WINDOW_ATTRIBUTES, void, c, \
+		  xcb_change_window_attributes (c, __VA_ARGS__))
+#define xcb_get_atom_name(c, ...) \
+    PROFILE_SEND (PROFILE_GET_ATOM_NAME, get_atom_name, c, \
+		  xcb_get_atom_name (c, __VA_ARGS__))
+#define xcb_get_geometry(c, ...) \
+    PROFILE_SEND (PROFILE_GET_GEOMETRY, get_geometry, c, \
+		  xcb_get_geometry (c, __VA_ARGS__))
+#define xcb_get_property(c, ...) \
+    PROFILE_SEND (PROFILE_GET_PROPERTY, get_property, c, \
+		  xcb_get_property (c, __VA_ARGS__))
+#define xcb_get_window_attributes(c, ...) \
+    PROFILE_SEND (PROFILE_GET_WINDOW_ATTRIBUTES, get_window_attributes, c, \
+		  xcb_get_window_attributes (c, __VA_ARGS__))
+#define xcb_grab_pointer(c, ...) \
+    PROFILE_SEND (PROFILE_GRAB_POINTER, grab_pointer, c, \
+		  xcb_grab_pointer (c, __VA_ARGS__))
+#define xcb_intern_atom(c, ...) \
+    PROFILE_SEND (PROFILE_INTERN_ATOM, intern_atom, c, \
+		  xcb_intern_atom (c, __VA_ARGS__))
+#define xcb_query_pointer(c, ...) \
+    PROFILE_SEND (PROFILE_QUERY_POINTER, query_pointer, c, \
+		  xcb_query_pointer (c, __VA_ARGS__))
+#define xcb_query_tree(c, ...) \
+    PROFILE_SEND (PROFILE_QUERY_TREE, query_tree, c, \
+		  xcb_query_tree (c, __VA_ARGS__))
+#define xcb_shape_query_extents(c, ...) \
+    PROFILE_SEND (PROFILE_SHAPE_QUERY_EXTENTS, shape_query_extents, c, \
+		  xcb_shape_query_extents (c, __VA_ARGS__))
+#define xcb_translate_coordinates(c, ...) \
+    PROFILE_SEND (PROFILE_TRANSLATE_COORDINATES, translate_coordinates, c, \
+		  xcb_translate_coordinates (c, __VA_ARGS__))
+
+/* The ICCCM requests are all GetProperty */
+#define xcb_icccm_get_wm_name(c, ...) \
+    PROFILE_SEND (PROFILE_GET_PROPERTY, get_property, c, \
+		  xcb_icccm_get_wm_name (c, __VA_ARGS__))
+#define xcb_icccm_get_wm_class(c, ...) \
+    PROFILE_SEND (PROFILE_GET_PROPERTY, get_property, c, \
+		  xcb_icccm_get_wm_class (c, __VA_ARGS__))
+#define xcb_icccm_get_wm_normal_hints(c, ...) \
+    PROFILE_SEND (PROFILE_GET_PROPERTY, get_property, c, \
+		  xcb_icccm_get_wm_normal_hints (c, __VA_ARGS__))
+#define xcb_icccm_get_wm_size_hints(c, ...) \
+    PROFILE_SEND (PROFILE_GET_PROPERTY, get_property, c, \
+		  xcb_icccm_get_wm_size_hints (c, __VA_ARGS__))
+#define xcb_icccm_get_wm_hints(c, ...) \
+    PROFILE_SEND (PROFILE_GET_PROPERTY, get_property, c, \
+		  xcb_icccm_get_wm_hints (c, __VA_ARGS__))
+
+#define xcb_get_atom_name_reply		profile_get_atom_name_reply
+#define xcb_get_geometry_reply		profile_get_geometry_reply
+#define xcb_get_property_reply		profile_get_property_reply
+#define xcb_get_window_attributes_reply	profile_get_window_attributes_reply
+#define xcb_grab_pointer_reply		profile_grab_pointer_reply
+#define xcb_intern_atom_reply		profile_intern_atom_reply
+#define xcb_query_pointer_reply		profile_query_pointer_reply
+#define xcb_query_tree_reply		profile_query_tree_reply
+#define xcb_shape_query_extents_reply	profile_shape_query_extents_reply
+#define xcb_translate_coordinates_reply	profile_translate_coordinates_reply
+
+#define xcb_icccm_get_wm_name_reply	profile_icccm_get_wm_name_reply
+#define xcb_icccm_get_wm_class_reply	profile_icccm_get_wm_class_reply
+#define xcb_icccm_get_wm_size_hints_reply profile_icccm_get_wm_size_hints_reply
+#define xcb_icccm_get_wm_normal_hints_reply \
+    profile_icccm_get_wm_size_hints_reply
+#define xcb_icccm_get_wm_hints_reply	profile_icccm_get_wm_hints_reply
+
+#endif /* PROFILE_NO_WRAP */
+
+#endif
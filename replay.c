@@ -0,0 +1,553 @@
+/*
+ * replay.c: -record and -replay, see replay.h.
+ *
+ * The log starts with a struct replay_header and the setup reply the
+ * server sent when the connection was made.  Then comes a record for each
+ * request sent and each reply, error or event received, in the order
+ * they crossed the connection: a struct replay_record followed by the
+ * bytes of the request or packet.  Like snapshots, logs are in the
+ * machine's own byte order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+#include "replay.h"
+#include "dsimple.h"
+
+#define REPLAY_MAGIC "XWIREC01"
+
+struct replay_header {
+    char		magic[8];
+    uint32_t		screen;
+    uint32_t		setup_size;	/* followed by that many bytes */
+};
+
+#define REPLAY_REQUEST	1	/* a request xwininfo sent */
+#define REPLAY_PACKET	2	/* a reply, error or event the server sent */
+
+struct replay_record {
+    uint32_t		type;
+    uint32_t		sequence;	/* of the request, or that answered */
+    uint32_t		size;		/* followed by that many bytes */
+};
+
+/* Bytes read from a socket until they make up whole packets, or to send */
+struct stream {
+    unsigned char	*data;
+    size_t		used;
+    size_t		size;
+};
+
+static const char *record_file, *replay_file;
+static unsigned int replay_latency;	/* ms */
+
+static int proxy_fd;		/* our end of the socket pair xcb uses */
+static int server_fd;		/* the real connection, when recording */
+static const unsigned char *setup;
+static size_t setup_size;
+
+/* -record */
+static FILE *log_file;
+static int log_closed;		/* by record_finish(), so nothing is added */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* -replay: the whole log, and where its requests and packets are */
+static unsigned char *log_data;
+static const struct replay_record **requests, **packets;
+static size_t num_requests, num_packets;
+
+void
+record_connection (const char *file)
+{
+    record_file = file;
+}
+
+void
+replay_connection (const char *file, unsigned int latency_ms)
+{
+    replay_file = file;
+    replay_latency = latency_ms;
+}
+
+static double
+replay_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Add what can be read from fd to s, returning 0 at the end */
+static int
+stream_read (struct stream *s, int fd)
+{
+    ssize_t n;
+
+    if (s->size - s->used < 4096) {
+	s->size = s->size ? s->size * 2 : 65536;
+	s->data = realloc (s->data, s->size);
+	if (s->data == NULL)
+	    fatal_error ("Failed to allocate memory in stream_read");
+    }
+    do
+	n = read (fd, s->data + s->used, s->size - s->used);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+	return 0;
+    s->used += n;
+    return 1;
+}
+
+static void
+stream_consume (struct stream *s, size_t n)
+{
+    memmove (s->data, s->data + n, s->used - n);
+    s->used -= n;
+}
+
+static void
+stream_append (struct stream *s, const void *data, size_t n)
+{
+    if (s->size - s->used < n) {
+	while (s->size - s->used < n)
+	    s->size = s->size ? s->size * 2 : 65536;
+	s->data = realloc (s->data, s->size);
+	if (s->data == NULL)
+	    fatal_error ("Failed to allocate memory in stream_append");
+    }
+    memcpy (s->data + s->used, data, n);
+    s->used += n;
+}
+
+/* Send what fd will take of s without blocking, returning 0 on error */
+static int
+stream_send (struct stream *s, int fd)
+{
+    ssize_t n;
+
+    do
+	n = send (fd, s->data, s->used, MSG_DONTWAIT | MSG_NOSIGNAL);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+    stream_consume (s, n);
+    return 1;
+}
+
+static int
+write_all (int fd, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len > 0) {
+	ssize_t n = send (fd, p, len, MSG_NOSIGNAL);
+
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	p += n;
+	len -= n;
+    }
+    return 1;
+}
+
+/* Size of the connection setup request in s, or 0 if it isn't all there */
+static size_t
+setup_request_size (const struct stream *s)
+{
+    uint16_t name_len, data_len;
+    size_t size;
+
+    if (s->used < 12)
+	return 0;
+    memcpy (&name_len, s->data + 6, 2);
+    memcpy (&data_len, s->data + 8, 2);
+    size = 12 + ((name_len + 3) & ~3) + ((data_len + 3) & ~3);
+    return size <= s->used ? size : 0;
+}
+
+/* Wait for xcb's setup request, which is answered with the saved reply */
+static int
+answer_setup (struct stream *s)
+{
+    size_t n;
+
+    while ((n = setup_request_size (s)) == 0)
+	if (!stream_read (s, proxy_fd))
+	    return 0;
+    stream_consume (s, n);
+    return write_all (proxy_fd, setup, setup_size);
+}
+
+/* Size of the request at the start of s, or 0 if it isn't all there */
+static size_t
+request_size (const struct stream *s)
+{
+    uint16_t len16;
+    uint32_t len32;
+    size_t size;
+
+    if (s->used < 4)
+	return 0;
+    memcpy (&len16, s->data + 2, 2);
+    if (len16 != 0)
+	size = 4 * (size_t) len16;
+    else {
+	/* BIG-REQUESTS */
+	if (s->used < 8)
+	    return 0;
+	memcpy (&len32, s->data + 4, 4);
+	size = 4 * (size_t) len32;
+    }
+    if (size < 4)
+	size = 4;
+    return size <= s->used ? size : 0;
+}
+
+/* Size of the packet at the start of s, or 0 if it isn't all there */
+static size_t
+packet_size (const struct stream *s)
+{
+    uint32_t extra = 0;
+    size_t size;
+
+    if (s->used < 32)
+	return 0;
+    if (s->data[0] == 1 || (s->data[0] & 0x7f) == XCB_GE_GENERIC)
+	memcpy (&extra, s->data + 4, 4);
+    size = 32 + 4 * (size_t) extra;
+    return size <= s->used ? size : 0;
+}
+
+/* The full sequence number of a packet, after sent requests */
+static uint32_t
+packet_sequence (const unsigned char *packet, uint32_t sent)
+{
+    uint16_t sequence;
+    uint32_t full;
+
+    if ((packet[0] & 0x7f) == XCB_KEYMAP_NOTIFY)
+	return sent;
+    memcpy (&sequence, packet + 2, 2);
+    full = (sent & ~0xFFFFu) | sequence;
+    if (full > sent && full >= 0x10000)
+	full -= 0x10000;
+    return full;
+}
+
+static void
+log_record (uint32_t type, uint32_t sequence, const void *data, size_t size)
+{
+    struct replay_record r;
+
+    r.type = type;
+    r.sequence = sequence;
+    r.size = size;
+    pthread_mutex_lock (&log_lock);
+    if (!log_closed) {
+	fwrite (&r, sizeof(r), 1, log_file);
+	fwrite (data, 1, size, log_file);
+    }
+    pthread_mutex_unlock (&log_lock);
+}
+
+/* Write out the log at exit, stopping the thread from adding to it */
+static void
+record_finish (void)
+{
+    pthread_mutex_lock (&log_lock);
+    if (fflush (log_file) != 0)
+	fprintf (stderr, "%s: error: Can't write %s: %s\n",
+		 program_name, record_file, strerror (errno));
+    log_closed = 1;
+    pthread_mutex_unlock (&log_lock);
+}
+
+/*
+ * Pass the traffic between xcb and the server on, logging it.  Neither
+ * side is written to unless it can take it: the server may itself be
+ * waiting to send us replies before it reads more requests.
+ */
+static void *
+record_thread (void *closure)
+{
+    struct stream from_client = { 0 }, from_server = { 0 };
+    struct stream to_client = { 0 }, to_server = { 0 };
+    struct pollfd fds[2];
+    uint32_t sent = 0;
+    size_t n;
+
+    (void) closure;
+
+    if (!answer_setup (&from_client))
+	goto done;
+
+    fds[0].fd = proxy_fd;
+    fds[1].fd = server_fd;
+    for (;;) {
+	fds[0].events = POLLIN | (to_client.used ? POLLOUT : 0);
+	fds[1].events = POLLIN | (to_server.used ? POLLOUT : 0);
+	if (poll (fds, 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	if ((fds[0].revents & POLLOUT) && !stream_send (&to_client, proxy_fd))
+	    break;
+	if ((fds[1].revents & POLLOUT) && !stream_send (&to_server, server_fd))
+	    break;
+	if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+	    if (!stream_read (&from_client, proxy_fd))
+		break;
+	    while ((n = request_size (&from_client)) > 0) {
+		log_record (REPLAY_REQUEST, ++sent, from_client.data, n);
+		stream_append (&to_server, from_client.data, n);
+		stream_consume (&from_client, n);
+	    }
+	}
+	if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+	    if (!stream_read (&from_server, server_fd))
+		break;
+	    while ((n = packet_size (&from_server)) > 0) {
+		log_record (REPLAY_PACKET,
+			    packet_sequence (from_server.data, sent),
+			    from_server.data, n);
+		stream_append (&to_client, from_server.data, n);
+		stream_consume (&from_server, n);
+	    }
+	}
+    }
+
+  done:
+    shutdown (proxy_fd, SHUT_RDWR);
+    free (from_client.data);
+    free (from_server.data);
+    free (to_client.data);
+    free (to_server.data);
+    return NULL;
+}
+
+/*
+ * Answer xcb from the log: each packet is sent once the request it
+ * answers has come in and the latency asked for has passed since.
+ */
+static void *
+replay_thread (void *closure)
+{
+    struct stream from_client = { 0 };
+    double *arrivals;		/* when each request came, [0] the setup */
+    size_t arrivals_size = 1024;
+    uint32_t received = 0;
+    size_t next = 0, n;
+
+    (void) closure;
+    arrivals = malloc (arrivals_size * sizeof(double));
+    if (arrivals == NULL)
+	fatal_error ("Failed to allocate memory in replay_thread");
+    if (!answer_setup (&from_client))
+	goto done;
+    arrivals[0] = replay_now ();
+
+    for (;;) {
+	struct pollfd pfd;
+	int timeout = -1;
+
+	while (next < num_packets && packets[next]->sequence <= received) {
+	    double due = arrivals[packets[next]->sequence] +
+		replay_latency / 1e3;
+	    double now = replay_now ();
+
+	    if (now < due) {
+		timeout = (int) ((due - now) * 1e3) + 1;
+		break;
+	    }
+	    if (!write_all (proxy_fd, packets[next] + 1, packets[next]->size))
+		goto done;
+	    next++;
+	}
+
+	pfd.fd = proxy_fd;
+	pfd.events = POLLIN;
+	if (poll (&pfd, 1, timeout) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	if (!pfd.revents)
+	    continue;
+	if (!stream_read (&from_client, proxy_fd))
+	    break;
+
+	while ((n = request_size (&from_client)) > 0) {
+	    received++;
+	    if (received >= arrivals_size) {
+		arrivals_size *= 2;
+		arrivals = realloc (arrivals, arrivals_size * sizeof(double));
+		if (arrivals == NULL)
+		    fatal_error ("Failed to allocate memory in replay_thread");
+	    }
+	    arrivals[received] = replay_now ();
+
+	    /*
+	     * Past a request that wasn't recorded the replies no longer
+	     * match, and the one xcb waits for may never come, so stop
+	     */
+	    if (received <= num_requests) {
+		const struct replay_record *r = requests[received - 1];
+
+		if (r->size != n || memcmp (r + 1, from_client.data, n) != 0) {
+		    fprintf (stderr, "%s: error: request %u differs from"
+			     " the one recorded\n", program_name, received);
+		    goto done;
+		}
+	    } else if (next == num_packets)
+		goto done;
+	    stream_consume (&from_client, n);
+	}
+    }
+
+  done:
+    shutdown (proxy_fd, SHUT_RDWR);
+    free (from_client.data);
+    free (arrivals);
+    return NULL;
+}
+
+static void
+load_log (int *screen)
+{
+    FILE *in;
+    long size;
+    struct replay_header h;
+    size_t offset;
+
+    in = fopen (replay_file, "rb");
+    if (in == NULL)
+	fatal_error ("Can't open %s: %s", replay_file, strerror (errno));
+    if (fseek (in, 0, SEEK_END) != 0 || (size = ftell (in)) < 0 ||
+	fseek (in, 0, SEEK_SET) != 0)
+	fatal_error ("Can't read %s: %s", replay_file, strerror (errno));
+    log_data = malloc (size ? size : 1);
+    if (log_data == NULL)
+	fatal_error ("Failed to allocate memory in load_log");
+    if (fread (log_data, 1, size, in) != (size_t) size)
+	fatal_error ("Can't read %s", replay_file);
+    fclose (in);
+
+    if ((size_t) size < sizeof(h))
+	fatal_error ("%s is not an xwininfo recording", replay_file);
+    memcpy (&h, log_data, sizeof(h));
+    if (memcmp (h.magic, REPLAY_MAGIC, sizeof(h.magic)) != 0 ||
+	h.setup_size < 8 || h.setup_size > (size_t) size - sizeof(h))
+	fatal_error ("%s is not an xwininfo recording", replay_file);
+    *screen = h.screen;
+    setup = log_data + sizeof(h);
+    setup_size = h.setup_size;
+
+    /* Records are kept 4 byte aligned, as xcb's packets are */
+    offset = (sizeof(h) + setup_size + 3) & ~(size_t) 3;
+    while (offset < (size_t) size) {
+	const struct replay_record *r =
+	    (const struct replay_record *) (log_data + offset);
+	const struct replay_record ***list;
+	size_t *count;
+
+	if ((size_t) size - offset < sizeof(*r) ||
+	    r->size > (size_t) size - offset - sizeof(*r) ||
+	    (r->type == REPLAY_PACKET && r->size < 32) ||
+	    (r->type != REPLAY_REQUEST && r->type != REPLAY_PACKET))
+	    fatal_error ("%s is damaged", replay_file);
+
+	if (r->type == REPLAY_REQUEST) {
+	    list = &requests;
+	    count = &num_requests;
+	} else {
+	    list = &packets;
+	    count = &num_packets;
+	}
+	if ((*count & (*count - 1)) == 0) {
+	    *list = realloc (*list, (*count ? *count * 2 : 1) * sizeof(**list));
+	    if (*list == NULL)
+		fatal_error ("Failed to allocate memory in load_log");
+	}
+	(*list)[(*count)++] = r;
+	offset += (sizeof(*r) + r->size + 3) & ~(size_t) 3;
+    }
+}
+
+static void
+start_log (int screen)
+{
+    static const char zeros[3];
+    struct replay_header h;
+
+    log_file = fopen (record_file, "wb");
+    if (log_file == NULL)
+	fatal_error ("Can't create %s: %s", record_file, strerror (errno));
+    memset (&h, 0, sizeof(h));
+    memcpy (h.magic, REPLAY_MAGIC, sizeof(h.magic));
+    h.screen = screen;
+    h.setup_size = setup_size;
+    fwrite (&h, sizeof(h), 1, log_file);
+    fwrite (setup, 1, setup_size, log_file);
+    fwrite (zeros, 1, -(sizeof(h) + setup_size) & 3, log_file);
+    atexit (record_finish);
+}
+
+/*
+ * Connect to the display as xcb_connect() does, unless -record or
+ * -replay was given, in which case the connection goes through the
+ * thread that records or replays it.
+ */
+xcb_connection_t *
+replay_connect (const char *display_name, int *screen)
+{
+    xcb_connection_t *real;
+    pthread_t thread;
+    int fds[2];
+
+    if (!record_file && !replay_file)
+	return xcb_connect (display_name, screen);
+
+    if (record_file) {
+	/*
+	 * Let xcb connect and authenticate, then take the socket over:
+	 * the connection made through the proxy is given the same setup.
+	 */
+	real = xcb_connect (display_name, screen);
+	if (xcb_connection_has_error (real))
+	    return real;
+	setup = (const unsigned char *) xcb_get_setup (real);
+	setup_size = 8 + 4 * (size_t) ((const xcb_setup_t *) setup)->length;
+	server_fd = xcb_get_file_descriptor (real);
+	start_log (*screen);
+    } else {
+	*screen = 0;
+	load_log (screen);
+    }
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+	fatal_error ("Can't create a socket pair: %s", strerror (errno));
+    proxy_fd = fds[1];
+    if (pthread_create (&thread, NULL,
+			record_file ? record_thread : replay_thread, NULL) != 0)
+	fatal_error ("Can't start a thread for %s",
+		     record_file ? "-record" : "-replay");
+    pthread_detach (thread);
+
+    return xcb_connect_to_fd (fds[0], NULL);
+}
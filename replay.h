@@ -0,0 +1,22 @@
+/*
+ * replay.h: -record and -replay, which save everything the X server sends
+ * over the connection to a file, and later play it back to xwininfo in
+ * place of the server, so runs can be repeated without one.
+ *
+ * Both work underneath xcb: the connection is made over a socket pair
+ * with a thread on the other end, which either passes the traffic on to
+ * the real server, logging it, or answers from the log.  Each packet from
+ * the server is played back once the request it answers has been sent,
+ * so xwininfo sees the same replies, errors and events in the same order.
+ */
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#include <xcb/xcb.h>
+
+void record_connection (const char *file);
+void replay_connection (const char *file, unsigned int latency_ms);
+xcb_connection_t *replay_connect (const char *display_name, int *screen);
+
+#endif
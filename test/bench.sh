@@ -0,0 +1,163 @@
+#!/bin/sh
+#
+# bench.sh: time xwininfo on window trees of growing size, built by
+# mktree in a private Xvfb, and print a table.  Run by "make bench".
+#
+# SIZES lists the numbers of windows, and REPEAT how many times each run
+# is made, of which the fastest is shown.  Times and counts are taken
+# from -profile, so they are xwininfo's own: the requests it sent, the
+# replies it waited for and the bytes in them.  A second table gives the
+# write calls and CPU time -tree -root takes for each 10000 lines shown.
+#
+# A third shows -tree -root over a slow link: it is recorded with -record
+# and replayed with each reply held back LATENCY ms.  Its bytes are all
+# those the server sent, read from the log, so they count the replies xcb
+# throws away unread too.  Setting BASELINE to another build of xwininfo
+# adds its figures, for a before and after.
+#
+# A last one times -tree -root where names must be converted from UTF-8:
+# under LC_ALL=C and under an ISO-8859-1 locale (LATIN1_LOCALE, by default
+# the first English one locale -a lists), on a tree of LOCALE_SIZE
+# windows each with its own title, and on one where all share 16 titles.
+
+srcdir=$(dirname "$0")
+XWININFO=${XWININFO:-./xwininfo}
+MKTREE=${MKTREE:-$srcdir/mktree}
+SIZES=${SIZES:-"1000 5000 20000"}
+REPEAT=${REPEAT:-5}
+LATENCY=${LATENCY:-20}
+BASELINE=${BASELINE:-}
+LOCALE_SIZE=${LOCALE_SIZE:-5000}
+LATIN1_LOCALE=${LATIN1_LOCALE:-$(locale -a 2>/dev/null |
+    grep -i -E '^en_.*\.(iso-?8859-?1|latin-?1)$' | head -n 1)}
+
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/xwininfo-bench.XXXXXX") || exit 1
+. "$srcdir/xvfb.sh"
+trap 'xvfb_stop; rm -rf "$tmp"' EXIT
+trap 'exit 1' INT TERM
+
+# Print the total ms, requests sent, replies waited for, reply bytes,
+# CPU ms and writes to stdout from the -profile report on standard input
+profile_figures ()
+{
+    awk '/^  total / { if (!ms) ms = $2; else { sent = $2; waited = $3;
+							 bytes = $4 } }
+	 / ms of CPU:/ { cpu = $1 }
+	 / bytes of output in / { writes = $6 }
+	 END { printf "%s %s %s %s %s %s\n", ms, sent, waited, bytes, cpu,
+		       writes }'
+}
+
+# Run xwininfo REPEAT times with the given options, and print the figures
+# of the fastest run
+run ()
+{
+    best=
+    i=0
+    while [ $i -lt $REPEAT ]; do
+	"$XWININFO" -profile "$@" 2>&1 >/dev/null | profile_figures \
+	    > "$tmp/run"
+	read ms rest < "$tmp/run"
+	if [ -z "$best" ] || awk "BEGIN { exit !($ms < $best) }"; then
+	    best=$ms
+	    cp "$tmp/run" "$tmp/best"
+	fi
+	i=$((i + 1))
+    done
+    cat "$tmp/best"
+}
+
+# Print the bytes of the replies, errors and events in a -record log: the
+# header and setup come first, then records of a type, a sequence number
+# and a size followed by that many bytes, all padded to 4
+log_bytes ()
+{
+    od -An -tu4 -v "$1" | awk '
+	{ for (i = 1; i <= NF; i++) word[n++] = $i }
+	END { at = 4 + int((word[3] + 3) / 4)
+	      while (at < n) { if (word[at] == 2) bytes += word[at + 2]
+			       at += 3 + int((word[at + 2] + 3) / 4) }
+	      print bytes }'
+}
+
+# Print the ms -tree -root takes replayed over a slow link, the replies
+# it waited for and the bytes the server sent
+slow_link ()
+{
+    "$1" -tree -root -record "$tmp/log" >/dev/null 2>&1 || return
+    "$1" -tree -root -replay "$tmp/log" -replay-latency $LATENCY -profile \
+	2>&1 >/dev/null | profile_figures > "$tmp/run"
+    read ms sent waited rest < "$tmp/run"
+    echo $ms $waited $(log_bytes "$tmp/log")
+}
+
+slow_row ()
+{
+    printf "%8s  %-24s %10s %10s %12s\n" "$1" "$2" "$3" "$4" "$5"
+}
+
+locale_row ()
+{
+    printf "%8s  %-24s %-16s %10s %12s\n" "$1" "$2" "$3" "$4" "$5"
+}
+
+row ()
+{
+    printf "%8s  %-16s %10s %10s %10s %12s\n" "$1" "$2" "$3" "$4" "$5" "$6"
+}
+
+row windows mode ms requests replies "reply bytes"
+for size in $SIZES; do
+    xvfb_start || exit 1
+    if ! top=$("$MKTREE" -n $size 2>"$tmp/mktree.log"); then
+	cat "$tmp/mktree.log" >&2
+	exit 1
+    fi
+
+    row $size "-tree -root" $(run -tree -root)
+    lines=$("$XWININFO" -tree -root | wc -l)
+    awk -v size=$size -v lines=$lines '{
+	printf "%8s %10s %18.1f %18.3f\n", size, lines,
+	       $6 * 10000 / lines, $5 * 10000 / lines }' "$tmp/best" \
+	>> "$tmp/output"
+    for build in $BASELINE "$XWININFO"; do
+	slow_row $size "$build" $(slow_link "$build") >> "$tmp/slow"
+    done
+    row $size "-children" $(run -children -id $top)
+    row $size "-name" $(run -name "no such window")
+    row $size "-stats" $(run -stats -id $top)
+    xvfb_stop
+done
+
+echo
+printf "%8s %10s %18s %18s\n" windows lines "writes/10k lines" \
+    "CPU ms/10k lines"
+cat "$tmp/output"
+
+echo
+echo "-tree -root with $LATENCY ms latency:"
+printf "%8s  %-24s %10s %10s %12s\n" windows build ms replies "bytes sent"
+cat "$tmp/slow"
+
+echo
+echo "-tree -root with names converted, $LOCALE_SIZE windows:"
+locale_row titles build locale ms "CPU ms"
+for titles in 0 16; do
+    xvfb_start || exit 1
+    if ! "$MKTREE" -n $LOCALE_SIZE -titles $titles >/dev/null \
+	2>"$tmp/mktree.log"; then
+	cat "$tmp/mktree.log" >&2
+	exit 1
+    fi
+    [ $titles -eq 0 ] && shared=own || shared=$titles
+    for locale in C $LATIN1_LOCALE; do
+	for build in $BASELINE "$XWININFO"; do
+	    (LC_ALL=$locale; export LC_ALL; XWININFO=$build; run -tree -root) |
+		{ read ms sent waited bytes cpu rest
+		  locale_row $shared "$build" $locale $ms $cpu; }
+	done
+    done
+    xvfb_stop
+done
+[ -n "$LATIN1_LOCALE" ] ||
+    echo "(no ISO-8859-1 locale found: set LATIN1_LOCALE to time one)"
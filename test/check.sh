@@ -0,0 +1,121 @@
+#!/bin/sh
+#
+# check.sh: run xwininfo on a tree of windows built by mktree in a private
+# Xvfb, and fail if a mode sends more requests or waits for more replies
+# per window than it should.  Run by "make check".
+#
+# The counts are taken from -profile.  They don't depend on the speed of
+# the machine, only on how many requests xwininfo makes for each window,
+# so the bounds are fixed: a change that costs a request or a round trip
+# per window goes over them.  Without Xvfb the checks are skipped.
+
+srcdir=$(dirname "$0")
+XWININFO=${XWININFO:-./xwininfo}
+MKTREE=${MKTREE:-$srcdir/mktree}
+
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/xwininfo-check.XXXXXX") || exit 1
+. "$srcdir/xvfb.sh"
+trap 'xvfb_stop; rm -rf "$tmp"' EXIT
+trap 'exit 1' INT TERM
+
+failed=0
+
+fail ()
+{
+    echo "FAIL: $*"
+    failed=$((failed + 1))
+}
+
+# Print the windows shown, the requests sent and the replies waited for
+# in all, and the round trips of the tree walk from the -profile report
+# on standard input
+profile_counts ()
+{
+    awk '/^  total / { if (seen++) { sent = $2; waited = $3 } }
+	 / round trips walking the tree/ { trips = $1 }
+	 / windows: .* per window/ { windows = $1 }
+	 END { printf "%d %d %d %d\n", windows, sent, waited, trips }'
+}
+
+# Run xwininfo with -profile and the given options, and check that it
+# sent at most max requests and waited for at most max replies for each
+# of per windows, and made at most trips round trips walking the tree.
+# A per of 0 means the windows it showed.
+bound ()
+{
+    per=$1 max=$2 trips=$3
+    shift 3
+    "$XWININFO" -profile "$@" 2>"$tmp/profile" >/dev/null
+    status=$?
+    if [ $status -ne 0 ]; then
+	fail "xwininfo $*: exit status $status"
+	return
+    fi
+    read windows sent waited walked <<EOF
+$(profile_counts < "$tmp/profile")
+EOF
+    [ $per -eq 0 ] && per=$windows
+    if [ $per -eq 0 ]; then
+	fail "xwininfo $*: no windows in the -profile report"
+	return
+    fi
+    if awk "BEGIN { exit !($sent > $max * $per || $waited > $max * $per) }"
+    then
+	fail "xwininfo $*: $sent requests and $waited replies for $per" \
+	     "windows, over $max per window"
+    fi
+    if [ $walked -gt $trips ]; then
+	fail "xwininfo $*: $walked round trips walking the tree," \
+	     "over $trips"
+    fi
+}
+
+if ! command -v "$XVFB" >/dev/null 2>&1; then
+    echo "$0: $XVFB not found, skipping the checks"
+    exit 0
+fi
+xvfb_start || exit 1
+
+# 2000 windows, 6 levels below the top one, and a pixmap
+"$MKTREE" -n 2000 -depth 6 -pixmap >"$tmp/ids" 2>"$tmp/mktree" || {
+    cat "$tmp/mktree" >&2
+    exit 1
+}
+{ read top; read pixmap; } < "$tmp/ids"
+windows=$("$XWININFO" -profile -tree -root 2>&1 >/dev/null |
+	  profile_counts | cut -d' ' -f1)
+# the last named window of the walk, which -name looks for longest
+last=$("$XWININFO" -tree -id $top |
+       sed -n 's/^ *0x[0-9a-f]* "\(window [0-9]*\)".*/\1/p' | tail -n 1)
+
+# A walk takes a round trip a level, and may split one when the window
+# of requests in flight fills
+bound 1 12 0 -stats -id $top
+bound 1 12 0 -wm -id $top
+bound 0 5 14 -tree -id $top
+bound 0 5 2 -children -id $top
+bound 0 5 14 -all -id $top
+bound $windows 3 14 -name "$last"
+
+# Once its atoms are cached, -id takes one round trip after connecting,
+# even though the server has no _NET_FRAME_EXTENTS for -stats to read
+"$XWININFO" -id $top -stats -atom-cache "$tmp/atoms" >/dev/null
+"$XWININFO" -id $top -stats -atom-cache "$tmp/atoms" -profile \
+    2>"$tmp/profile" >/dev/null
+trips=$(awk '/ round trips for replies/ { print $1 }' "$tmp/profile")
+[ "$trips" = 1 ] || fail "xwininfo -id: ${trips:-no} round trips after connecting"
+
+# A window that doesn't exist, and a pixmap, which GetGeometry accepts
+# but every other request turns down with BadWindow
+for id in 0xdeadbeef $pixmap; do
+    if "$XWININFO" -id $id >/dev/null 2>"$tmp/err" ||
+       ! grep -q "No such window with id $id" "$tmp/err"; then
+	fail "xwininfo -id $id: $(tail -n 1 "$tmp/err")"
+    fi
+done
+
+if [ $failed -gt 0 ]; then
+    echo "$failed checks failed"
+    exit 1
+fi
+echo "all checks passed"
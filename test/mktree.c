@@ -0,0 +1,279 @@
+/*
+ * mktree: fill an X server, meant to be a private Xvfb, with a tree of
+ * windows for test/check.sh and test/bench.sh to run xwininfo on.
+ *
+ * The tree hangs from one new top-level window, whose id is printed on
+ * the standard output.  Below it windows are added breadth-first, each
+ * with up to -fanout children, until there are -n of them or the tree
+ * is -depth levels deep.  Given percentages of them get a _NET_WM_NAME,
+ * a WM_NAME, a WM_CLASS or a long UTF-8 title, and are left unmapped.
+ * Which ones is picked by a seeded generator, so the same options give
+ * the same tree.
+ *
+ * With -titles n the _NET_WM_NAMEs that aren't long are n titles shared
+ * round the tree, with a non-ASCII letter in each, like the tabs of a
+ * terminal; otherwise each is the window's own name.
+ *
+ * With -pixmap a pixmap is made too, and its id printed on a second
+ * line: GetGeometry works on it but no request about windows does.
+ *
+ * The windows outlive mktree: it sets its close-down mode so the server
+ * keeps them until it is reset.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+static const char *program_name;
+
+static unsigned long n = 1000, depth = 6, fanout = 8;
+static unsigned long pct_net_wm_name = 60, pct_wm_name = 60;
+static unsigned long pct_class = 50, pct_long = 5, pct_unmapped = 10;
+static unsigned long title_len = 6000;	/* bytes */
+static unsigned long seed = 1;
+static unsigned long titles = 0;	/* shared, 0 for none */
+static int make_pixmap = 0;
+
+static void
+usage (void)
+{
+    fprintf (stderr,
+	     "usage:  %s [-options ...]\n\n"
+	     "where options include:\n"
+	     "    -display host:dpy    X server to use\n"
+	     "    -n windows           windows below the top one (%lu)\n"
+	     "    -depth levels        deepest the tree goes (%lu)\n"
+	     "    -fanout children     most children of a window (%lu)\n"
+	     "    -net-wm-name pct     with a _NET_WM_NAME (%lu)\n"
+	     "    -wm-name pct         with a WM_NAME (%lu)\n"
+	     "    -class pct           with a WM_CLASS (%lu)\n"
+	     "    -long pct            named ones with a long title (%lu)\n"
+	     "    -title-len bytes     length of the long titles (%lu)\n"
+	     "    -titles n            share n titles between windows (%lu)\n"
+	     "    -unmapped pct        left unmapped (%lu)\n"
+	     "    -seed n              for which windows get what (%lu)\n",
+	     program_name, n, depth, fanout, pct_net_wm_name, pct_wm_name,
+	     pct_class, pct_long, title_len, titles, pct_unmapped, seed);
+    exit (1);
+}
+
+static void
+fatal (const char *msg)
+{
+    fprintf (stderr, "%s: error: %s\n", program_name, msg);
+    exit (1);
+}
+
+/* A small generator of our own, so trees are the same on every libc */
+static unsigned long
+next_random (void)
+{
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (seed >> 33) & 0x7fffffff;
+}
+
+static int
+chance (unsigned long pct)
+{
+    return next_random () % 100 < pct;
+}
+
+static xcb_atom_t
+intern (xcb_connection_t *c, const char *name)
+{
+    xcb_intern_atom_reply_t *reply;
+    xcb_atom_t atom;
+
+    reply = xcb_intern_atom_reply
+	(c, xcb_intern_atom (c, 0, strlen (name), name), NULL);
+    if (reply == NULL)
+	fatal ("can't intern atoms");
+    atom = reply->atom;
+    free (reply);
+    return atom;
+}
+
+/* A title of about len bytes, mixing two, three and four byte sequences */
+static char *
+long_title (unsigned long i, unsigned long len)
+{
+    static const char *const pieces[] = {
+	"W\xc3\xa4hrung ", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e ",
+	"\xf0\x9f\x98\x80 ", "\xe2\x98\x83 snow ",
+    };
+    char *title = malloc (len + 32);
+    size_t used;
+
+    if (title == NULL)
+	fatal ("out of memory");
+    used = snprintf (title, len + 32, "long %lu ", i);
+    while (used < len) {
+	const char *p = pieces[next_random () % 4];
+
+	memcpy (title + used, p, strlen (p));
+	used += strlen (p);
+    }
+    title[used] = '\0';
+    return title;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *display_name = NULL;
+    xcb_connection_t *c;
+    xcb_screen_t *screen;
+    xcb_generic_event_t *event;
+    xcb_atom_t net_wm_name, utf8_string;
+    xcb_window_t *windows;
+    xcb_pixmap_t pixmap = XCB_NONE;
+    unsigned long *levels;
+    unsigned long parent, made, children;
+    int screen_number, a;
+
+    program_name = argv[0];
+    for (a = 1; a < argc; a++) {
+	unsigned long *value = NULL;
+
+	if (!strcmp (argv[a], "-display") && a + 1 < argc) {
+	    display_name = argv[++a];
+	    continue;
+	}
+	if (!strcmp (argv[a], "-pixmap")) {
+	    make_pixmap = 1;
+	    continue;
+	}
+	if (!strcmp (argv[a], "-n"))
+	    value = &n;
+	else if (!strcmp (argv[a], "-depth"))
+	    value = &depth;
+	else if (!strcmp (argv[a], "-fanout"))
+	    value = &fanout;
+	else if (!strcmp (argv[a], "-net-wm-name"))
+	    value = &pct_net_wm_name;
+	else if (!strcmp (argv[a], "-wm-name"))
+	    value = &pct_wm_name;
+	else if (!strcmp (argv[a], "-class"))
+	    value = &pct_class;
+	else if (!strcmp (argv[a], "-long"))
+	    value = &pct_long;
+	else if (!strcmp (argv[a], "-title-len"))
+	    value = &title_len;
+	else if (!strcmp (argv[a], "-titles"))
+	    value = &titles;
+	else if (!strcmp (argv[a], "-unmapped"))
+	    value = &pct_unmapped;
+	else if (!strcmp (argv[a], "-seed"))
+	    value = &seed;
+	if (value == NULL || a + 1 == argc)
+	    usage ();
+	*value = strtoul (argv[++a], NULL, 0);
+    }
+    if (depth == 0 || fanout == 0)
+	usage ();
+
+    c = xcb_connect (display_name, &screen_number);
+    if (xcb_connection_has_error (c))
+	fatal ("can't open display");
+    screen = xcb_setup_roots_iterator (xcb_get_setup (c)).data;
+    net_wm_name = intern (c, "_NET_WM_NAME");
+    utf8_string = intern (c, "UTF8_STRING");
+
+    windows = calloc (n + 1, sizeof(xcb_window_t));
+    levels = calloc (n + 1, sizeof(unsigned long));
+    if (windows == NULL || levels == NULL)
+	fatal ("out of memory");
+
+    windows[0] = xcb_generate_id (c);
+    xcb_create_window (c, XCB_COPY_FROM_PARENT, windows[0], screen->root,
+		       0, 0, screen->width_in_pixels,
+		       screen->height_in_pixels, 0,
+		       XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT,
+		       0, NULL);
+    xcb_map_window (c, windows[0]);
+    if (make_pixmap) {
+	pixmap = xcb_generate_id (c);
+	xcb_create_pixmap (c, screen->root_depth, pixmap, screen->root, 16, 16);
+    }
+
+    for (parent = 0, made = 1; made <= n && parent < made; parent++) {
+	if (levels[parent] + 1 >= depth)
+	    break;	/* breadth-first, so all the rest are as deep */
+	children = parent == 0 ? fanout : next_random () % (fanout + 1);
+	for (; children > 0 && made <= n; children--, made++) {
+	    xcb_window_t w = xcb_generate_id (c);
+	    char name[64];
+
+	    windows[made] = w;
+	    levels[made] = levels[parent] + 1;
+	    xcb_create_window (c, XCB_COPY_FROM_PARENT, w, windows[parent],
+			       next_random () % 400, next_random () % 300,
+			       1 + next_random () % 600,
+			       1 + next_random () % 400,
+			       next_random () % 3,
+			       XCB_WINDOW_CLASS_INPUT_OUTPUT,
+			       XCB_COPY_FROM_PARENT, 0, NULL);
+
+	    snprintf (name, sizeof(name), "window %lu", made);
+	    if (chance (pct_net_wm_name)) {
+		char *title = NULL;
+		char shared[64];
+		const char *value = name;
+
+		if (chance (pct_long))
+		    value = title = long_title (made, title_len);
+		else if (titles > 0) {
+		    snprintf (shared, sizeof(shared), "W\xc3\xa4hrung %lu",
+			      made % titles);
+		    value = shared;
+		}
+		xcb_change_property (c, XCB_PROP_MODE_REPLACE, w,
+				     net_wm_name, utf8_string, 8,
+				     strlen (value), value);
+		free (title);
+	    }
+	    if (chance (pct_wm_name))
+		xcb_change_property (c, XCB_PROP_MODE_REPLACE, w,
+				     XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8,
+				     strlen (name), name);
+	    if (chance (pct_class)) {
+		char class[64];
+		int len;
+
+		/* instance and class, each NUL terminated */
+		len = snprintf (class, sizeof(class), "inst%lu%cClass%lu",
+				made % 7, '\0', made % 5);
+		xcb_change_property (c, XCB_PROP_MODE_REPLACE, w,
+				     XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 8,
+				     len + 1, class);
+	    }
+	    if (!chance (pct_unmapped))
+		xcb_map_window (c, w);
+	}
+    }
+
+    /* keep the windows once we are gone, and make sure all went well */
+    xcb_set_close_down_mode (c, XCB_CLOSE_DOWN_RETAIN_PERMANENT);
+    free (xcb_get_input_focus_reply (c, xcb_get_input_focus (c), NULL));
+    if (xcb_connection_has_error (c))
+	fatal ("lost the connection while making windows");
+    while ((event = xcb_poll_for_event (c)) != NULL) {
+	if (event->response_type == 0)
+	    fatal ("the server refused to make a window");
+	free (event);
+    }
+
+    printf ("0x%x\n", windows[0]);
+    if (make_pixmap)
+	printf ("0x%x\n", pixmap);
+    fprintf (stderr, "%s: %lu windows, %lu levels deep\n", program_name,
+	     made - 1, made > 1 ? levels[made - 1] : 0);
+
+    free (windows);
+    free (levels);
+    xcb_disconnect (c);
+    return 0;
+}
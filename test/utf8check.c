@@ -0,0 +1,307 @@
+/*
+ * utf8check: compare ascii_prefix_length() and is_valid_utf8(), which skip
+ * ASCII a word at a time, with the byte by byte validator xwininfo had
+ * before, on edge cases and on random strings.  Run by "make check".
+ *
+ * Each string is checked at every offset from an aligned buffer up to
+ * 15, so word boundaries fall everywhere in it.  Both validators take a
+ * sequence cut short by the end of the string as valid, so the check is
+ * that they agree, not that either is right.
+ *
+ * With -time it times the two validators instead, on names all ASCII and
+ * on names mixing in other scripts, and prints the ns each takes a name.
+ * Run so by "make bench".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utf8.h"
+
+#define MAX_LEN 80
+
+static unsigned long checked, failed;
+static unsigned long seed = 1;
+
+/* is_valid_utf8() as it was, a byte at a time */
+static int
+old_is_valid_utf8 (const char *string, size_t len)
+{
+    unsigned long codepoint;
+    int rem;
+    size_t i;
+    unsigned char c;
+
+    rem = 0;
+    for (i = 0; i < len; i++) {
+	c = (unsigned char) string[i];
+
+	if (!(c & 0x80)) {
+	    if (rem > 0) return UTF8_SHORT_TAIL;
+	    rem = 0;
+	    codepoint = c;
+	} else if ((c & 0xC0) == 0x80) {
+	    if (rem == 0) return UTF8_LONG_TAIL;
+	    rem--;
+	    codepoint |= (c & 0x3F) << (rem * 6);
+	    if (codepoint == 0) return UTF8_OVERLONG;
+	} else if ((c & 0xE0) == 0xC0) {
+	    if (rem > 0) return UTF8_SHORT_TAIL;
+	    rem = 1;
+	    codepoint = (c & 0x1F) << 6;
+	    if (codepoint == 0) return UTF8_OVERLONG;
+	} else if ((c & 0xF0) == 0xE0) {
+	    if (rem > 0) return UTF8_SHORT_TAIL;
+	    rem = 2;
+	    codepoint = (c & 0x0F) << 12;
+	} else if ((c & 0xF8) == 0xF0) {
+	    if (rem > 0) return UTF8_SHORT_TAIL;
+	    rem = 3;
+	    codepoint = (c & 0x07) << 18;
+	    if (codepoint > 0x10FFFF) return UTF8_FORBIDDEN_VALUE;
+	} else
+	    return UTF8_FORBIDDEN_VALUE;
+    }
+
+    return UTF8_VALID;
+}
+
+static size_t
+old_ascii_prefix_length (const char *string, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && !(string[i] & 0x80))
+	i++;
+    return i;
+}
+
+static void
+report (const char *what, const char *s, size_t len, size_t offset,
+	long got, long want)
+{
+    size_t i;
+
+    if (++failed > 20)
+	return;
+    printf ("FAIL: %s at offset %lu gives %ld, not %ld:", what,
+	    (unsigned long) offset, got, want);
+    for (i = 0; i < len; i++)
+	printf (" %02x", (unsigned char) s[i]);
+    printf ("\n");
+}
+
+/* Check a string at each alignment */
+static void
+check (const char *s, size_t len)
+{
+    /* a size_t array, so offset 0 is aligned for words */
+    size_t space[(MAX_LEN + 16) / sizeof(size_t) + 1];
+    char *buf = (char *) space;
+    size_t offset;
+
+    for (offset = 0; offset < 16; offset++) {
+	size_t got, want;
+
+	memcpy (buf + offset, s, len);
+	/* bytes past the end must not be looked at */
+	buf[offset + len] = (char) 0xff;
+	got = ascii_prefix_length (buf + offset, len);
+	want = old_ascii_prefix_length (s, len);
+	if (got != want)
+	    report ("ascii_prefix_length", s, len, offset, got, want);
+	got = is_valid_utf8 (buf + offset, len);
+	want = old_is_valid_utf8 (s, len);
+	if (got != want)
+	    report ("is_valid_utf8", s, len, offset, got, want);
+	checked++;
+    }
+}
+
+/* Check a piece of bytes at every place in ASCII strings of every length */
+static void
+check_in_ascii (const char *piece, size_t piece_len)
+{
+    char s[MAX_LEN];
+    size_t len, at;
+
+    for (len = piece_len; len <= 40; len++) {
+	for (at = 0; at + piece_len <= len; at++) {
+	    memset (s, 'a', len);
+	    memcpy (s + at, piece, piece_len);
+	    check (s, len);
+	}
+    }
+}
+
+static unsigned long
+next_random (void)
+{
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (seed >> 33) & 0x7fffffff;
+}
+
+#define TIME_NAMES 1000
+#define TIME_ROUNDS 2000
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ns a validator takes for each of the names, the best of a few tries */
+static double
+time_names (int (*validate) (const char *, size_t), char names[][MAX_LEN],
+	    const size_t *lens)
+{
+    double best = 0;
+    volatile int sink = 0;
+    int try, round, i;
+
+    for (try = 0; try < 5; try++) {
+	double start = now (), t;
+
+	for (round = 0; round < TIME_ROUNDS; round++)
+	    for (i = 0; i < TIME_NAMES; i++)
+		sink += validate (names[i], lens[i]);
+	t = (now () - start) * 1e9 / ((double) TIME_ROUNDS * TIME_NAMES);
+	if (try == 0 || t < best)
+	    best = t;
+    }
+    return best;
+}
+
+/*
+ * Time both validators on window names like those of a desktop: titles
+ * of 10 to 70 bytes, either plain ASCII or with a word of German,
+ * Japanese or an emoji somewhere in them
+ */
+static int
+time_validators (void)
+{
+    static const char *const words[] = {
+	"W\xc3\xa4hrung", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+	"\xf0\x9f\x98\x80", "\xe2\x98\x83",
+    };
+    static char names[TIME_NAMES][MAX_LEN];
+    static size_t lens[TIME_NAMES];
+    int mixed, i;
+
+    for (mixed = 0; mixed < 2; mixed++) {
+	for (i = 0; i < TIME_NAMES; i++) {
+	    size_t len = 10 + next_random () % 60, at;
+
+	    memset (names[i], 0, MAX_LEN);
+	    snprintf (names[i], MAX_LEN, "%d - ", i);
+	    for (at = strlen (names[i]); at < len; at++)
+		names[i][at] = 'a' + next_random () % 26;
+	    if (mixed) {
+		const char *w = words[next_random () % 4];
+
+		at = next_random () % (len - strlen (w));
+		memcpy (names[i] + at, w, strlen (w));
+	    }
+	    lens[i] = len;
+	}
+	printf ("utf8check: %s names: %.1f ns each, %.1f byte by byte\n",
+		mixed ? "mixed" : "ASCII",
+		time_names (is_valid_utf8, names, lens),
+		time_names (old_is_valid_utf8, names, lens));
+    }
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    static const char *const pieces[] = {
+	/* lone and stray bytes */
+	"\x80", "\xbf", "\xc0", "\xc1", "\xc2", "\xdf", "\xe0", "\xed",
+	"\xef", "\xf0", "\xf4", "\xf5", "\xf7", "\xf8", "\xfe", "\xff",
+	/* whole sequences */
+	"\xc3\xa4", "\xdf\xbf", "\xe0\xa0\x80", "\xe6\x97\xa5",
+	"\xef\xbf\xbf", "\xf0\x90\x80\x80", "\xf0\x9f\x98\x80",
+	"\xf4\x8f\xbf\xbf",
+	/* overlong forms */
+	"\xc0\x80", "\xc0\xaf", "\xc1\xbf", "\xe0\x80\x80", "\xe0\x80\xaf",
+	"\xe0\x9f\xbf", "\xf0\x80\x80\x80", "\xf0\x8f\xbf\xbf",
+	/* surrogates */
+	"\xed\xa0\x80", "\xed\xad\xbf", "\xed\xb0\x80", "\xed\xbf\xbf",
+	/* past 0x10FFFF */
+	"\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xf7\xbf\xbf\xbf",
+	/* too many continuation bytes, and too few before ASCII */
+	"\xc3\xa4\x80", "\xe6\x97\xa5\xa5", "\xe6\x97", "\xf0\x9f\x98",
+    };
+    static const char high[] = "\x80\xbf\xc2\xdf\xe0\xed\xef\xf0\xf4\xff";
+    char s[MAX_LEN];
+    size_t i, len;
+    unsigned long n;
+
+    if (argc > 1 && !strcmp (argv[1], "-time"))
+	return time_validators ();
+
+    for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+	size_t piece_len = strlen (pieces[i]);
+
+	check_in_ascii (pieces[i], piece_len);
+
+	/* cut short by the end of the string */
+	for (len = 1; len < piece_len; len++) {
+	    memset (s, 'a', 20);
+	    memcpy (s + 20, pieces[i], len);
+	    check (s, 20 + len);
+	}
+    }
+
+    /* ASCII with a few bytes from the edges of the ranges */
+    for (n = 0; n < 200000; n++) {
+	len = next_random () % MAX_LEN;
+	for (i = 0; i < len; i++) {
+	    if (next_random () % 16 == 0)
+		s[i] = high[next_random () % (sizeof(high) - 1)];
+	    else
+		s[i] = 0x20 + next_random () % 0x5f;
+	}
+	check (s, len);
+    }
+
+    /* valid sequences strung together, with one byte sometimes changed */
+    for (n = 0; n < 200000; n++) {
+	len = 0;
+	while (len < MAX_LEN - 4) {
+	    /* one of the whole sequences */
+	    const char *p = pieces[16 + next_random () % 8];
+
+	    if (next_random () % 3 == 0)
+		p = "ab";
+	    memcpy (s + len, p, strlen (p));
+	    len += strlen (p);
+	    if (next_random () % 8 == 0)
+		break;
+	}
+	if (len > 0 && next_random () % 2)
+	    s[next_random () % len] = next_random () & 0xff;
+	check (s, len);
+    }
+
+    /* any bytes at all */
+    for (n = 0; n < 100000; n++) {
+	len = next_random () % MAX_LEN;
+	for (i = 0; i < len; i++)
+	    s[i] = next_random () & 0xff;
+	check (s, len);
+    }
+
+    if (failed > 0) {
+	printf ("utf8check: %lu of %lu checks failed\n", failed, checked);
+	return 1;
+    }
+    printf ("utf8check: %lu checks passed\n", checked);
+    return 0;
+}
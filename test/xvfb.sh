@@ -0,0 +1,40 @@
+# xvfb.sh: sourced by check.sh and bench.sh to run xwininfo against a
+# private Xvfb, so nothing on the user's display is looked at or changed.
+#
+# XVFB names the server to run.  The caller sets tmp to a scratch
+# directory, and xvfb_start sets and exports DISPLAY.
+
+XVFB=${XVFB:-Xvfb}
+xvfb_pid=
+
+xvfb_start ()
+{
+    command -v "$XVFB" >/dev/null 2>&1 || return 1
+    rm -f "$tmp/display"
+    "$XVFB" -displayfd 3 -nolisten tcp -screen 0 1920x1080x24 \
+	3>"$tmp/display" 2>"$tmp/xvfb.log" &
+    xvfb_pid=$!
+
+    # the server writes its display number once it takes connections
+    tries=0
+    while [ ! -s "$tmp/display" ]; do
+	tries=$((tries + 1))
+	if [ $tries -gt 100 ] || ! kill -0 $xvfb_pid 2>/dev/null; then
+	    echo "$0: $XVFB did not start:" >&2
+	    cat "$tmp/xvfb.log" >&2
+	    return 1
+	fi
+	sleep 0.1
+    done
+    DISPLAY=:$(cat "$tmp/display")
+    export DISPLAY
+}
+
+xvfb_stop ()
+{
+    if [ -n "$xvfb_pid" ]; then
+	kill $xvfb_pid 2>/dev/null
+	wait $xvfb_pid 2>/dev/null
+	xvfb_pid=
+    fi
+}
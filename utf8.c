@@ -0,0 +1,150 @@
+/*
+ * utf8.c: checking that window names given as UTF8_STRING are valid
+ * UTF-8 before they are converted for printing or quoted for -json.
+ *
+ * See utf8.h.
+ */
+
+#include <string.h>
+
+#include "utf8.h"
+
+/*
+ * Length of the run of ASCII characters at the start of a string,
+ * checked a word at a time: most names are ASCII all the way through
+ */
+size_t
+ascii_prefix_length (const char *string, size_t len)
+{
+    const size_t high_bits = ((size_t) -1 / 0xFF) * 0x80;
+    size_t i;
+
+    for (i = 0; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+	size_t word;
+
+	memcpy (&word, string + i, sizeof(word));
+	if (word & high_bits)
+	    break;
+    }
+    while (i < len && !(string[i] & 0x80))
+	i++;
+    return i;
+}
+
+/* [Copied from code added by Yang Zhao to xprop/xprop.c]
+ *
+ * Validate a string as UTF-8 encoded according to RFC 3629
+ *
+ * Simply, a unicode code point (up to 21-bits long) is encoded as follows:
+ *
+ *    Char. number range  |        UTF-8 octet sequence
+ *       (hexadecimal)    |              (binary)
+ *    --------------------+---------------------------------------------
+ *    0000 0000-0000 007F | 0xxxxxxx
+ *    0000 0080-0000 07FF | 110xxxxx 10xxxxxx
+ *    0000 0800-0000 FFFF | 1110xxxx 10xxxxxx 10xxxxxx
+ *    0001 0000-0010 FFFF | 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
+ *
+ * Validation is done left-to-right, and an error condition, if any, refers to
+ * only the left-most problem in the string.
+ *
+ * Return values:
+ *   UTF8_VALID: Valid UTF-8 encoded string
+ *   UTF8_OVERLONG: Using more bytes than needed for a code point
+ *   UTF8_SHORT_TAIL: Not enough bytes in a multi-byte sequence
+ *   UTF8_LONG_TAIL: Too many bytes in a multi-byte sequence
+ *   UTF8_FORBIDDEN_VALUE: Forbidden prefix or code point outside 0x10FFFF
+ */
+int
+is_valid_utf8 (const char *string, size_t len)
+{
+    unsigned long codepoint;
+    int rem;
+    size_t i;
+    unsigned char c;
+
+    rem = 0;
+    for (i = 0; i < len; i++) {
+	/* Skip ASCII between sequences, which can't be wrong there */
+	if (rem == 0) {
+	    i += ascii_prefix_length (string + i, len - i);
+	    if (i == len)
+		break;
+	}
+	c = (unsigned char) string[i];
+
+	/* Order of type check:
+	 *   - Single byte code point
+	 *   - Non-starting byte of multi-byte sequence
+	 *   - Start of 2-byte sequence
+	 *   - Start of 3-byte sequence
+	 *   - Start of 4-byte sequence
+	 */
+	if (!(c & 0x80)) {
+	    if (rem > 0) return UTF8_SHORT_TAIL;
+	    rem = 0;
+	    codepoint = c;
+	} else if ((c & 0xC0) == 0x80) {
+	    if (rem == 0) return UTF8_LONG_TAIL;
+	    rem--;
+	    codepoint |= (c & 0x3F) << (rem * 6);
+	    if (codepoint == 0) return UTF8_OVERLONG;
+	} else if ((c & 0xE0) == 0xC0) {
+	    if (rem > 0) return UTF8_SHORT_TAIL;
+	    rem = 1;
+	    codepoint = (c & 0x1F) << 6;
+	    if (codepoint == 0) return UTF8_OVERLONG;
+	} else if ((c & 0xF0) == 0xE0) {
+	    if (rem > 0) return UTF8_SHORT_TAIL;
+	    rem = 2;
+	    codepoint = (c & 0x0F) << 12;
+	} else if ((c & 0xF8) == 0xF0) {
+	    if (rem > 0) return UTF8_SHORT_TAIL;
+	    rem = 3;
+	    codepoint = (c & 0x07) << 18;
+	    if (codepoint > 0x10FFFF) return UTF8_FORBIDDEN_VALUE;
+	} else
+	    return UTF8_FORBIDDEN_VALUE;
+    }
+
+    return UTF8_VALID;
+}
+
+/*
+ * Length of the UTF-8 sequence starting at s, or 0 if it isn't a valid
+ * one (RFC 3629: no overlong forms, surrogates or values above 0x10FFFF)
+ */
+size_t
+utf8_sequence_length (const unsigned char *s, size_t len)
+{
+    unsigned long codepoint;
+    size_t n, i;
+
+    if (s[0] < 0x80)
+	return 1;
+    else if ((s[0] & 0xE0) == 0xC0) {
+	n = 2;
+	codepoint = s[0] & 0x1F;
+    } else if ((s[0] & 0xF0) == 0xE0) {
+	n = 3;
+	codepoint = s[0] & 0x0F;
+    } else if ((s[0] & 0xF8) == 0xF0) {
+	n = 4;
+	codepoint = s[0] & 0x07;
+    } else
+	return 0;
+
+    if (n > len)
+	return 0;
+    for (i = 1; i < n; i++) {
+	if ((s[i] & 0xC0) != 0x80)
+	    return 0;
+	codepoint = (codepoint << 6) | (s[i] & 0x3F);
+    }
+
+    if ((n == 2 && codepoint < 0x80) || (n == 3 && codepoint < 0x800) ||
+	(n == 4 && codepoint < 0x10000) || codepoint > 0x10FFFF ||
+	(codepoint >= 0xD800 && codepoint <= 0xDFFF))
+	return 0;
+    return n;
+}
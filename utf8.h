@@ -0,0 +1,22 @@
+/*
+ * utf8.h: checking that window names given as UTF8_STRING are valid
+ * UTF-8 before they are converted for printing or quoted for -json.
+ */
+
+#ifndef _UTF8_H_
+#define _UTF8_H_
+
+#include <stddef.h>
+
+/* What is_valid_utf8() finds wrong, if anything, see utf8.c */
+#define UTF8_VALID 0
+#define UTF8_FORBIDDEN_VALUE 1
+#define UTF8_OVERLONG 2
+#define UTF8_SHORT_TAIL 3
+#define UTF8_LONG_TAIL 4
+
+size_t ascii_prefix_length (const char *string, size_t len);
+int is_valid_utf8 (const char *string, size_t len);
+size_t utf8_sequence_length (const unsigned char *s, size_t len);
+
+#endif
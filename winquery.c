@@ -0,0 +1,486 @@
+/*
+ * winquery.c: asynchronous window queries, see winquery.h.
+ *
+ * Each query sends up to one request per slot.  Slots are filled in
+ * sequence order as their replies come, from xcb_poll_for_reply() or
+ * xcb_wait_for_reply(), and once none are left the results are decoded
+ * and the query handed back to its caller.
+ *
+ * Names come in two waves.  Only _NET_WM_NAME is asked for at first, and
+ * only its first WINQUERY_NAME_CHUNK words.  Once its reply is in, either
+ * the rest of a long name or, for WINQUERY_NAME, WM_NAME is asked for, in
+ * the same slot or the WM_NAME one.  winquery_wait() sends all those
+ * follow-ups for the queries pending together, so they cost one round
+ * trip between them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/xproto.h>
+#include <xcb/xcb_icccm.h>
+
+#include "winquery.h"
+#include "dsimple.h"
+#include "profile.h"
+
+/*
+ * Words of a _NET_WM_NAME to ask for at first.  The server sends only what
+ * the title holds, so a big first chunk costs no bytes, while each title
+ * longer than it costs the walk a round trip for the rest.
+ */
+#define WINQUERY_NAME_CHUNK 8192
+
+struct winquery_context {
+    xcb_connection_t *			c;
+    xcb_atom_t				atom_net_wm_name;
+    xcb_atom_t				atom_utf8_string;
+
+    /* submitted and not yet done, oldest first */
+    struct winquery *			head;
+    struct winquery *			tail;
+    unsigned int			pending;
+
+    /* the oldest query still waiting for its first _NET_WM_NAME reply */
+    struct winquery *			name_first;
+};
+
+/* For -profile, which counts replies waited for */
+static const enum profile_request slot_requests[WINQUERY_NUM_SLOTS] = {
+    [WINQUERY_SLOT_NET_WM_NAME] = PROFILE_GET_PROPERTY,
+    [WINQUERY_SLOT_WM_NAME] = PROFILE_GET_PROPERTY,
+    [WINQUERY_SLOT_WM_CLASS] = PROFILE_GET_PROPERTY,
+    [WINQUERY_SLOT_GEOMETRY] = PROFILE_GET_GEOMETRY,
+    [WINQUERY_SLOT_POSITION] = PROFILE_TRANSLATE_COORDINATES,
+    [WINQUERY_SLOT_ATTRIBUTES] = PROFILE_GET_WINDOW_ATTRIBUTES,
+    [WINQUERY_SLOT_TREE] = PROFILE_QUERY_TREE,
+};
+
+/*
+ * Start queries on a connection, fetching names with the given atoms.
+ * Either being XCB_ATOM_NONE leaves _NET_WM_NAME unasked for.
+ *
+ * The atoms are passed in rather than looked up here because contexts
+ * are made on the -jobs threads too, and the atom cache of dsimple.c is
+ * not locked: callers resolve them with get_atom() on the main thread.
+ */
+struct winquery_context *
+winquery_new (xcb_connection_t *c, xcb_atom_t net_wm_name,
+	      xcb_atom_t utf8_string)
+{
+    struct winquery_context *ctx;
+
+    ctx = calloc (1, sizeof(struct winquery_context));
+    if (ctx == NULL)
+	fatal_error ("Failed to allocate memory in winquery_new");
+    ctx->c = c;
+    ctx->atom_net_wm_name = net_wm_name;
+    ctx->atom_utf8_string = utf8_string;
+    return ctx;
+}
+
+/* Drop the queries still pending, without calling them back */
+void
+winquery_free (struct winquery_context *ctx)
+{
+    struct winquery *q;
+    int i;
+
+    if (ctx == NULL)
+	return;
+    for (q = ctx->head; q; q = q->next) {
+	for (i = 0; i < WINQUERY_NUM_SLOTS; i++) {
+	    if (q->sequence[i])
+		xcb_discard_reply (ctx->c, q->sequence[i]);
+	    free (q->reply[i]);
+	    free (q->reply_error[i]);
+	}
+	free (q->name);
+    }
+    free (ctx);
+}
+
+/* The descriptor to watch for replies to pass to winquery_dispatch() */
+int
+winquery_fd (struct winquery_context *ctx)
+{
+    return xcb_get_file_descriptor (ctx->c);
+}
+
+unsigned int
+winquery_pending (struct winquery_context *ctx)
+{
+    return ctx->pending;
+}
+
+/*
+ * Send the requests for what is asked about a window.  root is the
+ * root window of its screen, which WINQUERY_POSITION is relative to.
+ * Nothing is flushed: winquery_dispatch() and winquery_wait() do that.
+ */
+void
+winquery_submit (struct winquery_context *ctx, struct winquery *q,
+		 xcb_window_t window, xcb_window_t root, unsigned int what,
+		 winquery_done_func done, void *closure)
+{
+    xcb_connection_t *c = ctx->c;
+
+    memset (q, 0, sizeof(struct winquery));
+    q->result.window = window;
+    q->result.asked = what;
+    q->done = done;
+    q->closure = closure;
+
+    if ((what & WINQUERY_NET_WM_NAME) &&
+	ctx->atom_net_wm_name && ctx->atom_utf8_string) {
+	q->sequence[WINQUERY_SLOT_NET_WM_NAME] = xcb_get_property
+	    (c, 0, window, ctx->atom_net_wm_name, ctx->atom_utf8_string,
+	     0, WINQUERY_NAME_CHUNK).sequence;
+	q->name_first = 1;
+	if (ctx->name_first == NULL)
+	    ctx->name_first = q;
+    } else if (what & WINQUERY_WM_NAME)
+	q->sequence[WINQUERY_SLOT_WM_NAME] =
+	    xcb_icccm_get_wm_name (c, window).sequence;
+    if (what & WINQUERY_CLASS)
+	q->sequence[WINQUERY_SLOT_WM_CLASS] =
+	    xcb_icccm_get_wm_class (c, window).sequence;
+    if (what & WINQUERY_GEOMETRY)
+	q->sequence[WINQUERY_SLOT_GEOMETRY] =
+	    xcb_get_geometry (c, window).sequence;
+    if (what & WINQUERY_POSITION)
+	q->sequence[WINQUERY_SLOT_POSITION] =
+	    xcb_translate_coordinates (c, window, root, 0, 0).sequence;
+    if (what & WINQUERY_ATTRIBUTES)
+	q->sequence[WINQUERY_SLOT_ATTRIBUTES] =
+	    xcb_get_window_attributes (c, window).sequence;
+    if (what & WINQUERY_CHILDREN)
+	q->sequence[WINQUERY_SLOT_TREE] = xcb_query_tree (c, window).sequence;
+
+    q->prev = ctx->tail;
+    if (ctx->tail)
+	ctx->tail->next = q;
+    else
+	ctx->head = q;
+    ctx->tail = q;
+    ctx->pending++;
+}
+
+/* Move on from a query whose first _NET_WM_NAME reply is in */
+static void
+winquery_name_first_done (struct winquery_context *ctx, struct winquery *q)
+{
+    q->name_first = 0;
+    if (ctx->name_first != q)
+	return;
+    for (q = q->next; q && !q->name_first; q = q->next)
+	;
+    ctx->name_first = q;
+}
+
+/*
+ * Add a reply to the _NET_WM_NAME read so far, and ask for the rest of
+ * it if there is more, or for WM_NAME if wanted and the window has none
+ */
+static void
+winquery_name_part (struct winquery_context *ctx, struct winquery *q,
+		    xcb_get_property_reply_t *prop, xcb_generic_error_t *e)
+{
+    xcb_window_t window = q->result.window;
+    unsigned int len;
+
+    if (q->name_first)
+	winquery_name_first_done (ctx, q);
+
+    if (prop == NULL || prop->type == XCB_NONE) {
+	/* a window that is gone has no WM_NAME either */
+	if ((q->result.asked & WINQUERY_WM_NAME) && !e && !q->name_encoding) {
+	    q->sequence[WINQUERY_SLOT_WM_NAME] =
+		xcb_icccm_get_wm_name (ctx->c, window).sequence;
+	    q->name_wave = 1;
+	}
+	free (prop);
+	return;
+    }
+
+    len = xcb_get_property_value_length (prop);
+    if (len > 0) {
+	q->name = realloc (q->name, q->name_len + len);
+	if (q->name == NULL)
+	    fatal_error ("Failed to allocate memory in winquery_name_part");
+	memcpy (q->name + q->name_len, xcb_get_property_value (prop), len);
+	q->name_len += len;
+    }
+    q->name_encoding = prop->type;
+
+    /* in another encoding, nothing of it is sent */
+    if (prop->type == ctx->atom_utf8_string && prop->bytes_after > 0) {
+	q->sequence[WINQUERY_SLOT_NET_WM_NAME] = xcb_get_property
+	    (ctx->c, 0, window, ctx->atom_net_wm_name, ctx->atom_utf8_string,
+	     q->name_len / 4, (prop->bytes_after + 3) / 4).sequence;
+	q->name_wave = 1;
+    }
+    free (prop);
+}
+
+/*
+ * Note the reply to a slot, and drop the requests it makes pointless:
+ * where a window is once it turns out not to exist.
+ */
+static void
+winquery_filled (struct winquery_context *ctx, struct winquery *q,
+		 enum winquery_slot slot, void *reply, xcb_generic_error_t *e)
+{
+    q->sequence[slot] = 0;
+    if (slot == WINQUERY_SLOT_NET_WM_NAME) {
+	winquery_name_part (ctx, q, reply, e);
+	free (e);
+	return;
+    }
+    q->reply[slot] = reply;
+    q->reply_error[slot] = e;
+
+    if (slot == WINQUERY_SLOT_GEOMETRY && !reply &&
+	q->sequence[WINQUERY_SLOT_POSITION]) {
+	xcb_discard_reply (ctx->c, q->sequence[WINQUERY_SLOT_POSITION]);
+	q->sequence[WINQUERY_SLOT_POSITION] = 0;
+    }
+}
+
+static char *
+winquery_strdup (const char *s)
+{
+    char *copy;
+
+    if (s == NULL)
+	return NULL;
+    copy = strdup (s);
+    if (copy == NULL)
+	fatal_error ("Failed to allocate memory in winquery_strdup");
+    return copy;
+}
+
+/* Copy a window name out of a property reply, if there is one */
+static int
+winquery_set_name (struct winquery_result *r, xcb_get_property_reply_t *prop)
+{
+    if (prop == NULL || prop->type == XCB_NONE)
+	return 0;
+    r->name_len = xcb_get_property_value_length (prop);
+    r->name_encoding = prop->type;
+    if (r->name_len > 0) {
+	r->name = malloc (r->name_len);
+	if (r->name == NULL)
+	    fatal_error ("Failed to allocate memory in winquery_set_name");
+	memcpy (r->name, xcb_get_property_value (prop), r->name_len);
+    }
+    r->got |= WINQUERY_WM_NAME;
+    return 1;
+}
+
+/* Turn the replies of a query into its result and hand it back */
+static void
+winquery_finish (struct winquery_context *ctx, struct winquery *q)
+{
+    struct winquery_result *r = &q->result;
+    xcb_get_geometry_reply_t *geometry;
+    xcb_translate_coordinates_reply_t *trans_coords;
+    int i;
+
+    if (q->name_encoding) {
+	r->name = q->name;
+	r->name_len = q->name_len;
+	r->name_encoding = q->name_encoding;
+	r->got |= WINQUERY_NET_WM_NAME;
+	q->name = NULL;
+    } else
+	winquery_set_name (r, q->reply[WINQUERY_SLOT_WM_NAME]);
+
+    if (q->reply[WINQUERY_SLOT_WM_CLASS]) {
+	xcb_icccm_get_wm_class_reply_t classhint;
+
+	/* this takes over the reply, and frees it in the wipe */
+	if (xcb_icccm_get_wm_class_from_reply
+		(&classhint, q->reply[WINQUERY_SLOT_WM_CLASS])) {
+	    r->got |= WINQUERY_CLASS;
+	    r->instance_name = winquery_strdup (classhint.instance_name);
+	    r->class_name = winquery_strdup (classhint.class_name);
+	    xcb_icccm_get_wm_class_reply_wipe (&classhint);
+	    q->reply[WINQUERY_SLOT_WM_CLASS] = NULL;
+	}
+    }
+
+    geometry = q->reply[WINQUERY_SLOT_GEOMETRY];
+    if (geometry) {
+	r->got |= WINQUERY_GEOMETRY;
+	r->x = geometry->x;
+	r->y = geometry->y;
+	r->width = geometry->width;
+	r->height = geometry->height;
+	r->border_width = geometry->border_width;
+	r->depth = geometry->depth;
+    } else if (q->reply_error[WINQUERY_SLOT_GEOMETRY]) {
+	r->error = q->reply_error[WINQUERY_SLOT_GEOMETRY];
+	q->reply_error[WINQUERY_SLOT_GEOMETRY] = NULL;
+    }
+
+    trans_coords = q->reply[WINQUERY_SLOT_POSITION];
+    if (trans_coords) {
+	r->got |= WINQUERY_POSITION;
+	r->abs_x = (int16_t) trans_coords->dst_x;
+	r->abs_y = (int16_t) trans_coords->dst_y;
+    } else if (q->reply_error[WINQUERY_SLOT_POSITION] && !r->error) {
+	r->error = q->reply_error[WINQUERY_SLOT_POSITION];
+	q->reply_error[WINQUERY_SLOT_POSITION] = NULL;
+    }
+
+    if (q->reply[WINQUERY_SLOT_ATTRIBUTES]) {
+	r->got |= WINQUERY_ATTRIBUTES;
+	r->attributes = q->reply[WINQUERY_SLOT_ATTRIBUTES];
+	q->reply[WINQUERY_SLOT_ATTRIBUTES] = NULL;
+    }
+
+    r->tree = q->reply[WINQUERY_SLOT_TREE];
+    if (r->tree) {
+	r->got |= WINQUERY_CHILDREN;
+	r->root = r->tree->root;
+	r->parent = r->tree->parent;
+	r->children = xcb_query_tree_children (r->tree);
+	r->num_children = xcb_query_tree_children_length (r->tree);
+	q->reply[WINQUERY_SLOT_TREE] = NULL;
+    } else {
+	r->tree_error = q->reply_error[WINQUERY_SLOT_TREE];
+	q->reply_error[WINQUERY_SLOT_TREE] = NULL;
+    }
+
+    for (i = 0; i < WINQUERY_NUM_SLOTS; i++) {
+	free (q->reply[i]);
+	free (q->reply_error[i]);
+	q->reply[i] = NULL;
+	q->reply_error[i] = NULL;
+    }
+
+    if (q->name_first)
+	winquery_name_first_done (ctx, q);
+    if (q->prev)
+	q->prev->next = q->next;
+    else
+	ctx->head = q->next;
+    if (q->next)
+	q->next->prev = q->prev;
+    else
+	ctx->tail = q->prev;
+    q->next = q->prev = NULL;
+    ctx->pending--;
+
+    if (q->done)
+	q->done (q, q->closure);
+}
+
+/*
+ * Complete the queries whose replies have all come, without blocking.
+ * Returns the number still pending.
+ */
+unsigned int
+winquery_dispatch (struct winquery_context *ctx)
+{
+    struct winquery *q;
+    void *reply;
+    xcb_generic_error_t *e;
+    int i;
+
+    xcb_flush (ctx->c);
+    while ((q = ctx->head) != NULL) {
+	for (i = 0; i < WINQUERY_NUM_SLOTS; i++) {
+	    while (q->sequence[i]) {
+		reply = NULL;
+		e = NULL;
+		if (!xcb_poll_for_reply (ctx->c, q->sequence[i], &reply, &e)) {
+		    /*
+		     * The head query's next reply isn't in, and queries are
+		     * completed in the order they were submitted, so the
+		     * rest wait behind it even if theirs have come: a second
+		     * wave name request is answered after later queries'.
+		     * Send on what the replies so far asked for.
+		     */
+		    xcb_flush (ctx->c);
+		    return ctx->pending;
+		}
+		profile_reply (ctx->c, q->sequence[i]);
+		winquery_filled (ctx, q, i, reply, e);
+	    }
+	}
+	winquery_finish (ctx, q);
+    }
+    xcb_flush (ctx->c);
+    return ctx->pending;
+}
+
+/* Wait for the reply to one slot of a query and fill it */
+static void
+winquery_wait_slot (struct winquery_context *ctx, struct winquery *q,
+		    enum winquery_slot slot)
+{
+    void *reply;
+    xcb_generic_error_t *e = NULL;
+    double start;
+
+    start = profile_wait_begin (ctx->c, q->sequence[slot]);
+    reply = xcb_wait_for_reply (ctx->c, q->sequence[slot], &e);
+    profile_wait_end (slot_requests[slot], start, reply || e,
+		      reply ? ((xcb_generic_reply_t *) reply)->length : 0);
+    winquery_filled (ctx, q, slot, reply, e);
+}
+
+/*
+ * Take in the first _NET_WM_NAME reply of every pending query, so that
+ * the second wave of name requests goes out all at once.  The server
+ * answers those replies before any of the second wave anyway.
+ */
+static void
+winquery_name_wave (struct winquery_context *ctx)
+{
+    struct winquery *q;
+
+    for (q = ctx->name_first; q; q = q->next) {
+	if (q->name_first)
+	    winquery_wait_slot (ctx, q, WINQUERY_SLOT_NET_WM_NAME);
+	q->name_wave = 0;
+    }
+    xcb_flush (ctx->c);
+}
+
+/* Wait for the replies of a query and complete it */
+void
+winquery_wait (struct winquery_context *ctx, struct winquery *q)
+{
+    int i;
+
+    for (i = 0; i < WINQUERY_NUM_SLOTS; i++) {
+	while (q->sequence[i]) {
+	    /* about to wait for a request of the second wave not yet sent */
+	    if (q->name_wave) {
+		q->name_wave = 0;
+		winquery_name_wave (ctx);
+	    }
+	    winquery_wait_slot (ctx, q, i);
+	}
+    }
+    winquery_finish (ctx, q);
+}
+
+/* Free all members of a result, but not the result itself */
+void
+winquery_result_wipe (struct winquery_result *r)
+{
+    free (r->name);
+    free (r->instance_name);
+    free (r->class_name);
+    free (r->attributes);
+    free (r->tree);
+    free (r->error);
+    free (r->tree_error);
+    memset (r, 0, sizeof(struct winquery_result));
+}
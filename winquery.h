@@ -0,0 +1,133 @@
+/*
+ * winquery.h: asynchronous queries for what xwininfo shows about a window
+ * in the tree: its name, class, geometry, position on the root, attributes
+ * and children.
+ *
+ * The caller owns the connection and a struct winquery for each window
+ * asked about.  winquery_submit() sends the requests and returns at once.
+ * The replies are then gathered either by winquery_dispatch(), which never
+ * blocks and is meant to be called whenever the connection's file
+ * descriptor, from winquery_fd(), becomes readable, or by winquery_wait()
+ * for one query.  Either way the query's done function is called once all
+ * its replies are in, with the results in query->result, which belongs to
+ * the caller from then on and is freed with winquery_result_wipe().
+ *
+ * winquery_dispatch() completes queries in the order they were submitted,
+ * so one still waiting holds back those after it.  winquery_wait()
+ * completes only the query it is given, which may be ahead of others
+ * submitted before it; their replies are kept until they are waited for
+ * or dispatched.  Contexts and queries must not be shared between
+ * threads, but each thread may have its own context on its own
+ * connection.
+ */
+
+#ifndef _WINQUERY_H_
+#define _WINQUERY_H_
+
+#include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+/* What to ask about a window, and in struct winquery_result what came */
+#define WINQUERY_NET_WM_NAME	(1 << 0)
+#define WINQUERY_WM_NAME	(1 << 1)
+#define WINQUERY_CLASS		(1 << 2)	/* WM_CLASS */
+#define WINQUERY_GEOMETRY	(1 << 3)	/* size, depth, place in parent */
+#define WINQUERY_POSITION	(1 << 4)	/* place on the root */
+#define WINQUERY_ATTRIBUTES	(1 << 5)
+#define WINQUERY_CHILDREN	(1 << 6)
+
+/* _NET_WM_NAME, else WM_NAME, which is only asked for if there is none */
+#define WINQUERY_NAME		(WINQUERY_NET_WM_NAME | WINQUERY_WM_NAME)
+
+struct winquery_result {
+    xcb_window_t			window;
+    unsigned int			asked;	/* WINQUERY_* */
+    unsigned int			got;	/* of those, answered */
+
+    /* WINQUERY_*NAME: not NUL terminated, in the encoding given */
+    char *				name;
+    unsigned int			name_len;
+    xcb_atom_t				name_encoding;
+
+    /* WINQUERY_CLASS: either may be NULL */
+    char *				instance_name;
+    char *				class_name;
+
+    /* WINQUERY_GEOMETRY */
+    int16_t				x, y;
+    uint16_t				width, height, border_width;
+    uint8_t				depth;
+
+    /* WINQUERY_POSITION: of the inside top left corner */
+    int16_t				abs_x, abs_y;
+
+    /* WINQUERY_ATTRIBUTES */
+    xcb_get_window_attributes_reply_t *	attributes;
+
+    /* WINQUERY_CHILDREN: bottom to top */
+    xcb_window_t			root, parent;
+    xcb_window_t *			children;
+    unsigned int			num_children;
+
+    /* why WINQUERY_GEOMETRY or WINQUERY_POSITION, or WINQUERY_CHILDREN,
+       wasn't got, if the server said; names and classes just may not be */
+    xcb_generic_error_t *		error;
+    xcb_generic_error_t *		tree_error;
+
+    xcb_query_tree_reply_t *		tree;	/* holds children[] */
+};
+
+enum winquery_slot {
+    WINQUERY_SLOT_NET_WM_NAME,
+    WINQUERY_SLOT_WM_NAME,
+    WINQUERY_SLOT_WM_CLASS,
+    WINQUERY_SLOT_GEOMETRY,
+    WINQUERY_SLOT_POSITION,
+    WINQUERY_SLOT_ATTRIBUTES,
+    WINQUERY_SLOT_TREE,
+    WINQUERY_NUM_SLOTS
+};
+
+struct winquery;
+typedef void (*winquery_done_func) (struct winquery *, void *closure);
+
+/* The caller allocates these, and may reuse or free them once done */
+struct winquery {
+    struct winquery_result		result;
+
+    /* private */
+    unsigned int			sequence[WINQUERY_NUM_SLOTS];
+    void *				reply[WINQUERY_NUM_SLOTS];
+    xcb_generic_error_t *		reply_error[WINQUERY_NUM_SLOTS];
+    winquery_done_func			done;
+    void *				closure;
+    struct winquery *			next;
+    struct winquery *			prev;
+
+    /* _NET_WM_NAME as read so far; WM_NAME is only asked for without */
+    char *				name;
+    unsigned int			name_len;
+    xcb_atom_t				name_encoding;
+    uint8_t				name_first;	/* no reply for it yet */
+    uint8_t				name_wave;	/* asked for more, not sent */
+};
+
+struct winquery_context;
+
+/* net_wm_name and utf8_string are from get_atom() on the main thread */
+struct winquery_context *winquery_new (xcb_connection_t *c,
+				       xcb_atom_t net_wm_name,
+				       xcb_atom_t utf8_string);
+void winquery_free (struct winquery_context *);
+int winquery_fd (struct winquery_context *);
+
+void winquery_submit (struct winquery_context *, struct winquery *,
+		      xcb_window_t window, xcb_window_t root,
+		      unsigned int what, winquery_done_func, void *closure);
+unsigned int winquery_dispatch (struct winquery_context *);
+void winquery_wait (struct winquery_context *, struct winquery *);
+unsigned int winquery_pending (struct winquery_context *);
+
+void winquery_result_wipe (struct winquery_result *);
+
+#endif
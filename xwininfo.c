@@ -71,6 +71,7 @@ of the copyright holder.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <locale.h>
 #include <langinfo.h>
 #ifdef HAVE_ICONV
@@ -78,9 +79,21 @@ of the copyright holder.
 #endif
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /* Include routines to handle parsing defaults */
 #include "dsimple.h"
+#include "json.h"
+#include "utf8.h"
+#include "winquery.h"
+#include "profile.h"
+#include "replay.h"
 
 struct binding {
     long code;
@@ -120,13 +133,226 @@ struct wininfo {
     xcb_get_geometry_reply_t *		geometry;
     xcb_get_window_attributes_reply_t *	win_attributes;
     xcb_size_hints_t *			normal_hints;
+    xcb_query_tree_reply_t *		tree;
+    xcb_get_property_reply_t *		frame_extents;
+
+    /* the child of the root over the window's corner, most likely its
+       frame, as found by fetch_position() */
+    xcb_window_t			root_child;
+};
+
+/* A window name as fetched from _NET_WM_NAME or WM_NAME */
+struct window_name {
+    char *				name;	/* not NUL terminated */
+    unsigned int			len;
+    xcb_atom_t				encoding;
+};
+
+/* What we print about each window found while walking the tree */
+struct tree_node {
+    xcb_window_t			window;
+    unsigned int			first_child;	/* index in walk */
+    unsigned int			num_children;
+
+    struct window_name			name;
+    char *				instance_name;
+    char *				class_name;
+    int16_t				x, y;
+    uint16_t				width, height, border_width;
+    int16_t				abs_x, abs_y;
+    uint8_t				depth;
+    uint8_t				map_state;
+    uint8_t				got_wm_class;
+    uint8_t				got_geometry;
+    uint8_t				got_trans_coords;
+    uint8_t				got_attributes;
+    uint8_t				tree_failed;
+
+    /* levels below the window the walk started at, and the index in the
+       walk of the window above */
+    unsigned int			level;
+    unsigned int			parent;
+
+    /* set by tree_walk_filter(): whether the window is printed, and how
+       many of its children are */
+    uint8_t				shown;
+    unsigned int			num_shown;
+
+    /* errors are reported when the window is printed */
+    xcb_generic_error_t *		error;
+    xcb_generic_error_t *		tree_error;
+
+    /* children walked on another connection, see struct tree_pool */
+    struct tree_walk *			subtree;
+};
+
+struct tree_name_query {
+    struct winquery			query;
+    unsigned int			index;	/* in walk */
+    unsigned int			after;	/* windows sent before it */
+};
+
+/* State of a breadth-first walk of the window tree */
+struct tree_walk {
+    xcb_connection_t *			dpy;
+    int					recurse;
+    unsigned int			max_inflight;	/* requests */
+
+    /* windows in breadth-first order, children of a window contiguous */
+    struct tree_node *			nodes;
+    unsigned int			num_nodes;
+    unsigned int			nodes_size;
+
+    /* ring of queries for the windows awaiting replies */
+    struct winquery_context *		queries;
+    struct winquery *			pending;
+    unsigned int			max_pending;
+    unsigned int			requests_per_window;
+
+    /* requests awaiting replies, of both rings, kept to max_inflight */
+    unsigned int			in_flight;
+
+    /* and of WM_NAME queries for those found without a _NET_WM_NAME */
+    struct tree_name_query *		names;
+    unsigned int			names_sent;
+    unsigned int			names_collected;
+    unsigned int			num_sent;	/* windows */
+
+    /* QueryTree reply for the window the walk started at, if prefetched,
+       else the request for it */
+    const xcb_query_tree_reply_t *	start_tree;
+    xcb_query_tree_cookie_t		start_cookie;
+    xcb_window_t			root;
+    xcb_window_t			parent;
+
+    /* where the inside of the window the walk started at is on the root,
+       which the positions of the windows below are worked out from */
+    xcb_translate_coordinates_cookie_t	start_origin_cookie;
+    int16_t				start_x, start_y;
+    int					start_origin;	/* 1 if known, -1 if not */
+
+    /* WINQUERY_* to ask about each window, besides its children */
+    unsigned int			what;
+
+    /* -maxdepth (0 for none) and -only-viewable, which stop the walk
+       going below windows that nothing printed can be under.  The
+       children of an unviewable window are still asked for with its map
+       state: waiting for that first would add a round trip a level. */
+    unsigned int			max_depth;
+    int					only_viewable;
+    xcb_get_window_attributes_cookie_t	start_attr_cookie;
+
+    unsigned int			round_trips;	/* for -profile */
+
+    /* set when subtrees may be handed to other connections */
+    struct tree_pool *			pool;
+    xcb_window_t			start;
+    unsigned int			start_level;
+    struct tree_walk *			next;
+};
+
+/*
+ * Subtrees waiting to be walked by the worker threads of -jobs, each of
+ * which has its own connection.  Walks hand over windows they have not
+ * expanded yet whenever a worker is idle, so big subtrees get split up
+ * no matter how deep in the tree they are.
+ */
+struct tree_pool {
+    pthread_mutex_t			lock;
+    pthread_cond_t			cond;
+    struct tree_walk *			queue;
+    unsigned int			queued;
+    unsigned int			idle;	/* workers waiting for work */
+    unsigned int			busy;	/* walks in progress */
+};
+
+/*
+ * A snapshot of the whole window tree, written by -snapshot and mmap'd
+ * back by -from-snapshot.  The header is followed by the columns listed
+ * in snapshot_columns[], each padded to the alignment of its elements.
+ * Windows are in the breadth-first order of a tree walk from the root, so
+ * the children of a window are contiguous, in stacking order.  Strings
+ * are NUL terminated and referred to by their offset in the string table.
+ * Everything is in native order, as a snapshot is only meant to be read
+ * on the kind of machine that wrote it.
+ */
+#define SNAPSHOT_MAGIC "XWISNAP1"
+#define SNAPSHOT_NONE 0xFFFFFFFF	/* no index or string */
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t num_windows;
+    uint32_t num_hints;		/* size hints records */
+    uint32_t num_extents;	/* frame extents records */
+    uint32_t num_atoms;		/* name encodings other than UTF8_STRING */
+    uint32_t strings_size;
+    uint32_t root;
+    uint32_t utf8_string;	/* value of the UTF8_STRING atom */
+    uint16_t width_in_pixels, height_in_pixels;
+    uint16_t width_in_millimeters, height_in_millimeters;
+};
+
+/* Bits in the flags column */
+#define SNAPSHOT_GOT_WM_CLASS		(1 << 0)
+#define SNAPSHOT_GOT_GEOMETRY		(1 << 1)
+#define SNAPSHOT_GOT_TRANS_COORDS	(1 << 2)
+#define SNAPSHOT_GOT_ATTRIBUTES		(1 << 3)
+
+struct snapshot {
+    struct snapshot_header *		header;
+
+    /* tables indexed by the columns below */
+    xcb_size_hints_t *			hints;
+    uint32_t *				extents;	/* 4 per record */
+    uint32_t *				atoms;
+    uint32_t *				atom_names;
+
+    /* one entry per window */
+    uint32_t *				window;
+    uint32_t *				parent;
+    uint32_t *				first_child;
+    uint32_t *				num_children;
+    uint32_t *				by_id;	/* windows in order of id */
+    uint32_t *				name;
+    uint32_t *				name_len;
+    uint32_t *				name_encoding;
+    uint32_t *				instance_name;
+    uint32_t *				class_name;
+    uint32_t *				normal_hints;
+    uint32_t *				zoom_hints;
+    uint32_t *				frame_extents;
+    uint32_t *				visual;
+    uint32_t *				colormap;
+    uint32_t *				all_event_masks;
+    uint32_t *				backing_planes;
+    uint32_t *				backing_pixel;
+    int16_t *				x;
+    int16_t *				y;
+    int16_t *				abs_x;	/* of the inside corner */
+    int16_t *				abs_y;
+    uint16_t *				width;
+    uint16_t *				height;
+    uint16_t *				border_width;
+    uint16_t *				do_not_propagate_mask;
+    uint8_t *				depth;
+    uint8_t *				win_class;
+    uint8_t *				bit_gravity;
+    uint8_t *				win_gravity;
+    uint8_t *				backing_store;
+    uint8_t *				save_under;
+    uint8_t *				map_is_installed;
+    uint8_t *				map_state;
+    uint8_t *				override_redirect;
+    uint8_t *				visual_class;	/* 0xFF if unknown */
+    uint8_t *				flags;
+
+    char *				strings;
 };
 
 static void scale_init (xcb_screen_t *scrn);
-static char *nscale (int, int, int, char *, size_t);
-static char *xscale (int);
-static char *yscale (int);
-static char *bscale (int);
+static char *xscale (int, char *);
+static char *yscale (int, char *);
+static char *bscale (int, char *);
 static const char *LookupL (long, const struct binding *);
 static const char *Lookup (int, const struct binding *);
 static void display_window_id (struct wininfo *, int);
@@ -135,15 +361,76 @@ static void display_bits_info (struct wininfo *);
 static void display_event_mask (long);
 static void display_events_info (struct wininfo *);
 static void display_tree_info (struct wininfo *, int);
-static void display_tree_info_1 (struct wininfo *, int, int);
+static void display_tree_info_1 (struct tree_walk *, unsigned int, int, int);
 static void display_hints (xcb_size_hints_t *);
 static void display_size_hints (struct wininfo *);
 static void display_window_shape (xcb_window_t);
 static void display_wm_info (struct wininfo *);
+static void json_window_info (struct wininfo *);
+static void json_tree_node (struct tree_node *);
 static void wininfo_wipe (struct wininfo *);
+static void window_request_failed (struct wininfo *, xcb_generic_error_t *,
+				  const char *) _X_NORETURN;
+static void watch_select (xcb_connection_t *, xcb_window_t, int);
+static void watch_adopt (struct tree_walk *, int);
+static void watch_events (void);
+static uint32_t snapshot_find (xcb_window_t);
+static xcb_get_geometry_reply_t *snapshot_geometry (uint32_t);
+static xcb_get_window_attributes_reply_t *snapshot_attributes (uint32_t);
+static xcb_query_tree_reply_t *snapshot_tree (uint32_t);
+static xcb_get_property_reply_t *snapshot_frame_extents (uint32_t);
+static int snapshot_size_hints (const uint32_t *, uint32_t, xcb_size_hints_t *);
+static void snapshot_walk (struct tree_walk *, xcb_window_t, int);
+static void load_snapshot (const char *);
+static void write_snapshot (const char *);
+static xcb_window_t snapshot_window_with_name (const char *);
 
 static int window_id_format_dec = 0;
 
+/* Limit on requests awaiting replies while walking the tree */
+#define DEFAULT_MAX_INFLIGHT 4096
+static unsigned int max_inflight = DEFAULT_MAX_INFLIGHT;
+
+/* Number of connections to walk the tree with */
+static unsigned int jobs = 1;
+
+/* What to display about each window */
+static int children = 0, tree = 0, stats = 0, bits = 0, events = 0, wm = 0,
+    size = 0, shape = 0;
+
+/* Write JSON instead of text; -ndjson puts each child on a line of its own */
+static int json = 0, ndjson = 0;
+
+/* The snapshot shown by -from-snapshot instead of asking the server */
+static struct snapshot *snapshot;
+
+/* Keep printing changes to the tree after it has been shown */
+static int watch = 0;
+
+/* Which windows -children and -tree print, see tree_node_matches() */
+static int only_viewable = 0;
+static const char *class_pattern = NULL;
+static unsigned int min_width = 0, min_height = 0;
+static unsigned int max_depth = 0;	/* levels below the window, 0 for all */
+
+/* What -children and -tree print about each window, as WINQUERY_* bits */
+#define TREE_FIELDS_ALL \
+    (WINQUERY_NAME | WINQUERY_CLASS | WINQUERY_GEOMETRY | WINQUERY_POSITION)
+static unsigned int tree_fields = TREE_FIELDS_ALL;
+
+/* Names of the fields -fields can choose, the window id always being one */
+static const struct binding _tree_fields[] = {
+	{ 0, "id" },
+	{ WINQUERY_NAME, "name" },
+	{ WINQUERY_CLASS, "class" },
+	{ WINQUERY_GEOMETRY, "geometry" },
+	{ WINQUERY_POSITION, "position" },
+	{ 0, NULL } };
+
+/* Number of windows -batch sends requests for ahead of the one it prints */
+#define DEFAULT_LOOKAHEAD 16
+static unsigned int lookahead = DEFAULT_LOOKAHEAD;
+
 #ifdef HAVE_ICONV
 static iconv_t iconv_from_utf8;
 #endif
@@ -151,34 +438,18 @@ static const char *user_encoding;
 static void print_utf8 (const char *, const char *, size_t, const char *);
 static char *get_friendly_name (const char *, const char *);
 
+static const char *display_name = NULL;
 static xcb_connection_t *dpy;
 static xcb_screen_t *screen;
 static xcb_generic_error_t *err;
 
-#ifndef HAVE_STRLCAT
-static size_t strlcat (char *dst, const char *src, size_t dstsize)
-{
-    size_t sd = strlen (dst);
-    size_t ss = strlen (src);
-    size_t s = sd + ss;
-
-    if (s < dstsize) {
-	strcpy (dst + sd, src);
-    } else {
-	strncpy (dst + sd, src, dstsize-sd-1);
-	dst[dstsize] = '\0';
-    }
-    return s;
-}
-#endif
-
 /*
  * Report the syntax for calling xwininfo:
  */
 static void
 usage (void)
 {
-	printf ("usage:  %s [-options ...]\n\n"
+	out_printf ("usage:  %s [-options ...]\n\n"
 		"where options include:\n"
 		"    -help                 print this message\n"
 		"    -version              print version message\n"
@@ -189,18 +460,37 @@ usage (void)
 		"    -int                  print window id in decimal\n"
 		"    -children             print parent and child identifiers\n"
 		"    -tree                 print children identifiers recursively\n"
+		"    -max-inflight <n>     limit requests in flight for -tree (%u)\n"
+		"    -jobs <n>             walk -tree over n connections in parallel\n"
+		"    -watch                print changes to the tree as they happen\n"
+		"    -only-viewable        only list children that are viewable\n"
+		"    -class <pattern>      only list children whose WM_CLASS matches\n"
+		"    -min-size <w>x<h>     only list children at least this big\n"
+		"    -maxdepth <n>         list children at most n levels down in -tree\n"
+		"    -fields <list>        list only id,name,class,geometry,position\n"
 		"    -stats                print window geometry [DEFAULT]\n"
 		"    -bits                 print window pixel information\n"
 		"    -events               print events selected for on window\n"
 		"    -size                 print size hints\n"
 		"    -wm                   print window manager hints\n"
 		"    -shape                print shape extents\n"
+		"    -json                 print as a JSON object per window\n"
+		"    -ndjson               print as JSON, one line per window\n"
 		"    -frame                don't ignore window manager frames\n"
 		"    -english              print sizes in english units\n"
 		"    -metric               print sizes in metric units\n"
 		"    -all                  -tree, -stats, -bits, -events, -wm, -size, -shape\n"
+		"    -batch <file>         print each window listed in file (- for stdin)\n"
+		"    -lookahead <n>        windows to request ahead of output in -batch (%u)\n"
+		"    -atom-cache <file>    keep atoms for this display in file\n"
+		"    -snapshot <file>      save the whole window tree in file\n"
+		"    -from-snapshot <file> show windows from a saved tree, not the server\n"
+		"    -profile              report time and requests per phase on stderr\n"
+		"    -record <file>        save all the server sends in file\n"
+		"    -replay <file>        play a -record file back instead of a server\n"
+		"    -replay-latency <ms>  delay each reply by ms in -replay (0)\n"
 		"\n",
-		program_name);
+		program_name, DEFAULT_MAX_INFLIGHT, DEFAULT_LOOKAHEAD);
 }
 
 /*
@@ -208,112 +498,162 @@ usage (void)
  * Hacked in by Mark W. Eichin <eichin@athena> [eichin:19880619.1509EST]
  *
  * Simply put: replace the old numbers with string print calls.
- * Returning a local string is ok, since we only ever get called to
- * print one x and one y, so as long as they don't collide, they're
- * fine. This is not meant to be a general purpose routine.
- *
+ * The strings are formatted into buffers of SCALE_BUFSIZE bytes given by
+ * the caller, so any number of them can be in use at once.
  */
 
-static int xp = 0, xmm = 0;
-static int yp = 0, ymm = 0;
-static int bp = 0, bmm = 0;
+#define SCALE_BUFSIZE 256
+
+/* The size of the screen along one axis, the same for every value */
+struct scale {
+    double	pixels;
+    double	mm;
+    double	inches;
+};
+
+static struct scale x_scale, y_scale, b_scale;
 static int english = 0, metric = 0;
 
+static void
+scale_axis (struct scale *scale, int pixels, int mm)
+{
+    scale->pixels = pixels;
+    scale->mm = mm;
+    scale->inches = mm / 25.4;
+}
+
 static void
 scale_init (xcb_screen_t *scale_screen)
 {
-    xp = scale_screen->width_in_pixels;
-    yp = scale_screen->height_in_pixels;
-    xmm = scale_screen->width_in_millimeters;
-    ymm = scale_screen->height_in_millimeters;
-    bp  = xp  + yp;
-    bmm = xmm + ymm;
+    int xp = scale_screen->width_in_pixels;
+    int yp = scale_screen->height_in_pixels;
+    int xmm = scale_screen->width_in_millimeters;
+    int ymm = scale_screen->height_in_millimeters;
+
+    scale_axis (&x_scale, xp, xmm);
+    scale_axis (&y_scale, yp, ymm);
+    scale_axis (&b_scale, xp + yp, xmm + ymm);
 }
 
 #define MILE (5280*12)
 #define YARD (3*12)
 #define FOOT (12)
 
-static char *
-nscale (int n, int np, int nmm, char *nbuf, size_t nbufsize)
+/* snprintf at buf + *len, moving *len past what fit */
+static void _X_ATTRIBUTE_PRINTF(4, 5)
+scale_append (char *buf, size_t size, size_t *len, const char *fmt, ...)
 {
-    int s;
-    snprintf (nbuf, nbufsize, "%d", n);
+    va_list args;
+    int n;
 
-    if (metric||english) {
-	s = strlcat (nbuf, " (", nbufsize);
-
-	if (metric) {
-	    snprintf (nbuf+s, nbufsize-s, "%.2f mm%s",
-		      ((double) n) * nmm/np , english ? "; " : "");
-	}
-	if (english) {
-	    double inch_frac;
-	    int printed_anything = 0;
-	    int mi, yar, ft, inr;
-
-	    inch_frac = ((double) n)*(nmm/25.4)/np;
-	    inr = (int)inch_frac;
-	    inch_frac -= (double)inr;
-	    if (inr >= MILE) {
-		mi = inr/MILE;
-		inr %= MILE;
-		s = strlen (nbuf);
-		snprintf (nbuf+s, nbufsize-s, "%d %s(?!?)",
+    if (*len + 1 >= size)
+	return;
+    va_start (args, fmt);
+    n = vsnprintf (buf + *len, size - *len, fmt, args);
+    va_end (args);
+    if (n > 0)
+	*len = (*len + n < size) ? *len + n : size - 1;
+}
+
+/*
+ * Format n pixels in the units asked for, without the number of pixels,
+ * such as "26.46 mm; 1.04 inches", at buf + *len
+ */
+static void
+scale_units (int n, const struct scale *scale, char *buf, size_t size,
+	     size_t *len)
+{
+    if (metric) {
+	scale_append (buf, size, len, "%.2f mm%s",
+		      ((double) n) * scale->mm / scale->pixels,
+		      english ? "; " : "");
+    }
+    if (english) {
+	double inch_frac;
+	int printed_anything = 0;
+	int mi, yar, ft, inr;
+
+	inch_frac = ((double) n) * scale->inches / scale->pixels;
+	inr = (int)inch_frac;
+	inch_frac -= (double)inr;
+	if (inr >= MILE) {
+	    mi = inr/MILE;
+	    inr %= MILE;
+	    scale_append (buf, size, len, "%d %s(?!?)",
 			  mi, (mi == 1) ? "mile" : "miles");
-		printed_anything = 1;
-	    }
-	    if (inr >= YARD) {
-		yar = inr/YARD;
-		inr %= YARD;
-		if (printed_anything)
-		    strlcat (nbuf, ", ", nbufsize);
-		s = strlen (nbuf);
-		snprintf (nbuf+s, nbufsize-s, "%d %s",
-			 yar, (yar==1) ? "yard" : "yards");
-		printed_anything = 1;
-	    }
-	    if (inr >= FOOT) {
-		ft = inr/FOOT;
-		inr  %= FOOT;
-		if (printed_anything)
-		    strlcat (nbuf, ", ", nbufsize);
-		s = strlen (nbuf);
-		snprintf (nbuf+s, nbufsize-s, "%d %s",
-			 ft, (ft==1) ? "foot" : "feet");
-		printed_anything = 1;
-	    }
-	    if (!printed_anything || inch_frac != 0.0 || inr != 0) {
-		if (printed_anything)
-		    strlcat (nbuf, ", ", nbufsize);
-		s = strlen (nbuf);
-		snprintf (nbuf+s, nbufsize-s, "%.2f inches", inr+inch_frac);
-	    }
+	    printed_anything = 1;
 	}
-	strlcat (nbuf, ")", nbufsize);
+	if (inr >= YARD) {
+	    yar = inr/YARD;
+	    inr %= YARD;
+	    scale_append (buf, size, len, "%s%d %s",
+			  printed_anything ? ", " : "",
+			  yar, (yar==1) ? "yard" : "yards");
+	    printed_anything = 1;
+	}
+	if (inr >= FOOT) {
+	    ft = inr/FOOT;
+	    inr  %= FOOT;
+	    scale_append (buf, size, len, "%s%d %s",
+			  printed_anything ? ", " : "",
+			  ft, (ft==1) ? "foot" : "feet");
+	    printed_anything = 1;
+	}
+	if (!printed_anything || inch_frac != 0.0 || inr != 0) {
+	    scale_append (buf, size, len, "%s%.2f inches",
+			  printed_anything ? ", " : "", inr+inch_frac);
+	}
+    }
+}
+
+static char *
+nscale (int n, const struct scale *scale, char *nbuf)
+{
+    size_t len = 0;
+
+    scale_append (nbuf, SCALE_BUFSIZE, &len, "%d", n);
+    if (metric||english) {
+	scale_append (nbuf, SCALE_BUFSIZE, &len, " (");
+	scale_units (n, scale, nbuf, SCALE_BUFSIZE, &len);
+	scale_append (nbuf, SCALE_BUFSIZE, &len, ")");
     }
     return (nbuf);
 }
 
-static char xbuf[BUFSIZ];
 static char *
-xscale (int x)
+xscale (int x, char *buf)
 {
-    return (nscale (x, xp, xmm, xbuf, sizeof(xbuf)));
+    return (nscale (x, &x_scale, buf));
 }
 
-static char ybuf[BUFSIZ];
 static char *
-yscale (int y)
+yscale (int y, char *buf)
 {
-    return (nscale (y, yp, ymm, ybuf, sizeof(ybuf)));
+    return (nscale (y, &y_scale, buf));
 }
 
-static char bbuf[BUFSIZ];
 static char *
-bscale (int b)
+bscale (int b, char *buf)
+{
+    return (nscale (b, &b_scale, buf));
+}
+
+/*
+ * Write a width and height in the units asked for, as -tree shows them
+ * after a window's geometry, such as "  (26.46 mm x 10.58 mm)"
+ */
+static void
+display_scaled_size (int width, int height)
 {
-    return (nscale (b, bp, bmm, bbuf, sizeof(bbuf)));
+    char buf[2 * SCALE_BUFSIZE];
+    size_t len = 0;
+
+    scale_append (buf, sizeof(buf), &len, "  (");
+    scale_units (width, &x_scale, buf, sizeof(buf), &len);
+    scale_append (buf, sizeof(buf), &len, " x ");
+    scale_units (height, &y_scale, buf, sizeof(buf), &len);
+    scale_append (buf, sizeof(buf), &len, ")");
+    out_write (buf, len);
 }
 
 static const char *
@@ -331,16 +671,337 @@ window_id_str (xcb_window_t id)
 
 /* end of pixel to inch, metric converter */
 
+/*
+ * Send requests for the properties of a window that are named by atoms
+ * we had to look up, which may be taken from -atom-cache unverified
+ */
+static void
+prefetch_window_properties (struct wininfo *w)
+{
+    w->net_wm_name_cookie = get_net_wm_name (dpy, w->window);
+    if (wm) {
+	atom_net_wm_desktop = get_atom (dpy, "_NET_WM_DESKTOP");
+	if (atom_net_wm_desktop) {
+	    w->wm_desktop_cookie = xcb_get_property
+		(dpy, 0, w->window, atom_net_wm_desktop,
+		 XCB_ATOM_CARDINAL, 0, 4);
+	}
+
+	atom_net_wm_window_type	= get_atom (dpy, "_NET_WM_WINDOW_TYPE");
+	if (atom_net_wm_window_type) {
+	    w->wm_window_type_cookie = xcb_get_property
+		(dpy, 0, w->window, atom_net_wm_window_type,
+		 XCB_ATOM_ATOM, 0, BUFSIZ);
+	}
+
+	atom_net_wm_state = get_atom (dpy, "_NET_WM_STATE");
+	if (atom_net_wm_state) {
+	    w->wm_state_cookie = xcb_get_property
+		(dpy, 0, w->window, atom_net_wm_state,
+		 XCB_ATOM_ATOM, 0, BUFSIZ);
+	}
+
+	atom_net_wm_pid	= get_atom (dpy, "_NET_WM_PID");
+	if (atom_net_wm_pid) {
+	    w->wm_pid_cookie = xcb_get_property
+		(dpy, 0, w->window, atom_net_wm_pid,
+		 XCB_ATOM_CARDINAL, 0, BUFSIZ);
+	    w->wm_client_machine_cookie = xcb_get_property
+		(dpy, 0, w->window, XCB_ATOM_WM_CLIENT_MACHINE,
+		 XCB_GET_PROPERTY_TYPE_ANY, 0, BUFSIZ);
+	}
+    }
+    if (wm || stats) {
+	atom_net_frame_extents = get_atom (dpy, "_NET_FRAME_EXTENTS");
+	if (atom_net_frame_extents) {
+	    w->frame_extents_cookie = xcb_get_property
+		(dpy, 0, w->window, atom_net_frame_extents,
+		 XCB_ATOM_CARDINAL, 0, 4 * 4);
+	}
+    }
+}
+
+/*
+ * Send them again after the atoms they were sent with turned out to be
+ * stale, dropping the first replies
+ */
+static void
+refetch_window_properties (struct wininfo *w)
+{
+    xcb_get_property_cookie_t *cookies[] = {
+	&w->net_wm_name_cookie, &w->wm_desktop_cookie,
+	&w->wm_window_type_cookie, &w->wm_state_cookie, &w->wm_pid_cookie,
+	&w->wm_client_machine_cookie, &w->frame_extents_cookie
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(cookies) / sizeof(cookies[0]); i++) {
+	if (cookies[i]->sequence)
+	    xcb_discard_reply (dpy, cookies[i]->sequence);
+	cookies[i]->sequence = 0;
+    }
+    atom_net_wm_name = atom_utf8_string = XCB_ATOM_NONE;
+    prefetch_window_properties (w);
+}
+
+/* Drop the replies to everything prefetch_window_info() sent */
+static void
+discard_window_info (struct wininfo *w)
+{
+    unsigned int *sequences[] = {
+	&w->net_wm_name_cookie.sequence, &w->wm_name_cookie.sequence,
+	&w->wm_class_cookie.sequence, &w->trans_coords_cookie.sequence,
+	&w->tree_cookie.sequence, &w->attr_cookie.sequence,
+	&w->normal_hints_cookie.sequence, &w->hints_cookie.sequence,
+	&w->wm_desktop_cookie.sequence, &w->wm_window_type_cookie.sequence,
+	&w->wm_state_cookie.sequence, &w->wm_pid_cookie.sequence,
+	&w->wm_client_machine_cookie.sequence,
+	&w->frame_extents_cookie.sequence, &w->zoom_cookie.sequence
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(sequences) / sizeof(sequences[0]); i++) {
+	if (*sequences[i])
+	    xcb_discard_reply (dpy, *sequences[i]);
+	*sequences[i] = 0;
+    }
+}
+
+/*
+ * Send requests to prefetch data we'll need.  None of them depend on the
+ * window's geometry, so they can go out in the same flight as the
+ * request for it, which checks the window exists.
+ *
+ * Requires wininfo members initialized: window
+ */
+static void
+prefetch_window_info (struct wininfo *w)
+{
+    prefetch_window_properties (w);
+    w->wm_name_cookie = xcb_icccm_get_wm_name (dpy, w->window);
+    if (watch) {
+	/* before asking for the children, so we hear of any changes after */
+	uint32_t mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY |
+	    XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+
+	xcb_change_window_attributes (dpy, w->window, XCB_CW_EVENT_MASK,
+				      &mask);
+    }
+    if (children || tree || stats)
+	w->tree_cookie = xcb_query_tree (dpy, w->window);
+    if (stats) {
+	/* fetch_position() moves this out by the border width */
+	w->trans_coords_cookie =
+	    xcb_translate_coordinates (dpy, w->window, screen->root, 0, 0);
+    }
+    if (stats || bits || events)
+	w->attr_cookie = xcb_get_window_attributes (dpy, w->window);
+    if (stats || size)
+	w->normal_hints_cookie =
+	    xcb_icccm_get_wm_normal_hints (dpy, w->window);
+    if (wm)
+	w->hints_cookie = xcb_icccm_get_wm_hints(dpy, w->window);
+    if (size)
+	w->zoom_cookie = xcb_icccm_get_wm_size_hints (dpy, w->window,
+						      XCB_ATOM_WM_ZOOM_HINTS);
+}
+
+/*
+ * Display everything asked for about a window, then forget about it
+ *
+ * Requires wininfo members initialized by prefetch_window_info()
+ */
+static void
+display_window_info (struct wininfo *w)
+{
+    if (json) {
+	json_window_info (w);
+	wininfo_wipe (w);
+	return;
+    }
+
+    profile_phase ("name");
+    profile_windows (1);
+    out_str ("\nxwininfo: Window id: ");
+    display_window_id (w, 1);
+    if (children || tree) {
+	profile_phase ("tree");
+	display_tree_info (w, tree);
+    }
+    if (stats) {
+	profile_phase ("stats");
+	display_stats_info (w);
+    }
+    if (bits) {
+	profile_phase ("bits");
+	display_bits_info (w);
+    }
+    if (events) {
+	profile_phase ("events");
+	display_events_info (w);
+    }
+    if (wm) {
+	profile_phase ("wm");
+	display_wm_info (w);
+    }
+    if (size) {
+	profile_phase ("size");
+	display_size_hints (w);
+    }
+    if (shape) {
+	profile_phase ("shape");
+	display_window_shape (w->window);
+    }
+    out_char ('\n');
+    wininfo_wipe (w);
+}
+
+/* Report a problem with one window of a -batch run and carry on */
+static void
+batch_error (const char *msg, ...)
+{
+    va_list args;
+
+    out_flush ();
+    fprintf (stderr, "%s: error: ", program_name);
+    va_start (args, msg);
+    vfprintf (stderr, msg, args);
+    va_end (args);
+    fprintf (stderr, "\n");
+}
+
+/* A window read by -batch, on its way through the pipeline */
+struct batch_entry {
+    struct wininfo			info;
+    char *				missing_name; /* named no window */
+};
+
+/*
+ * Read the next window for -batch: a line holding either a window id or
+ * a window name.  Returns 0 at the end of the input.
+ */
+static int
+read_batch_window (FILE *in, struct batch_entry *e)
+{
+    static char *line;
+    static size_t line_size;
+    ssize_t len;
+    char *end;
+
+    while ((len = getline (&line, &line_size, in)) != -1) {
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+	    line[--len] = '\0';
+	if (len == 0)
+	    continue;
+
+	e->info.window = strtoul (line, &end, 0);
+	if (*end != '\0') {
+	    e->info.window = window_with_name (dpy, screen->root, line);
+	    if (!e->info.window) {
+		e->missing_name = strdup (line);
+		if (e->missing_name == NULL)
+		    fatal_error ("Failed to allocate memory in read_batch_window");
+	    }
+	}
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Print everything asked for about each window listed in file, on one
+ * connection.  The windows go through a pipeline: as each is read all its
+ * requests are sent, its geometry among them, and by the time it reaches
+ * the front its replies should all be waiting.  Only then is the geometry
+ * checked to see that the window exists; windows that don't are reported
+ * and skipped, and the rest of their replies dropped.
+ */
+static void
+run_batch (const char *file)
+{
+    FILE *in = stdin;
+    struct batch_entry *ring, *e;
+    xcb_generic_error_t *error;
+    unsigned int ring_size = lookahead + 1, head = 0, count = 0;
+    int eof = 0;
+
+    if (strcmp (file, "-") != 0) {
+	in = fopen (file, "r");
+	if (in == NULL)
+	    fatal_error ("Can't open %s: %s", file, strerror (errno));
+    }
+    ring = calloc (ring_size, sizeof(struct batch_entry));
+    if (ring == NULL)
+	fatal_error ("Failed to allocate memory in run_batch");
+
+    for (;;) {
+	profile_phase ("batch");
+
+	/* Send everything asked for about the windows coming up */
+	while (!eof && count < ring_size) {
+	    e = &ring[(head + count) % ring_size];
+	    memset (e, 0, sizeof(struct batch_entry));
+	    if (!read_batch_window (in, e)) {
+		eof = 1;
+		break;
+	    }
+	    if (!e->missing_name) {
+		e->info.geometry_cookie = xcb_get_geometry (dpy, e->info.window);
+		prefetch_window_info (&e->info);
+	    }
+	    count++;
+	}
+	if (count == 0)
+	    break;
+	xcb_flush (dpy);
+
+	e = &ring[head];
+	if (e->missing_name) {
+	    batch_error ("No window with name \"%s\" exists!",
+			 e->missing_name);
+	    free (e->missing_name);
+	} else {
+	    error = NULL;
+	    e->info.geometry = xcb_get_geometry_reply
+		(dpy, e->info.geometry_cookie, &error);
+	    if (e->info.geometry) {
+		display_window_info (&e->info);
+	    } else {
+		discard_window_info (&e->info);
+		out_flush ();
+		if (error) {
+		    print_x_error (dpy, error);
+		    free (error);
+		}
+		batch_error ("No such window with id %s.",
+			     window_id_str (e->info.window));
+	    }
+	}
+	head = (head + 1) % ring_size;
+	count--;
+    }
+
+    free (ring);
+    if (in != stdin)
+	fclose (in);
+}
+
 int
 main (int argc, char **argv)
 {
     register int i;
-    int tree = 0, stats = 0, bits = 0, events = 0, wm = 0, size = 0, shape = 0;
-    int frame = 0, children = 0;
+    int frame = 0;
     int use_root = 0;
+    int all = 0;
     xcb_window_t window = 0;
-    char *display_name = NULL;
     const char *window_name = NULL;
+    const char *atom_cache_file = NULL;
+    const char *batch_file = NULL;
+    const char *snapshot_file = NULL;
+    const char *from_snapshot = NULL;
+    const char *record_file = NULL;
+    const char *replay_file = NULL;
+    unsigned int replay_latency = 0;
     struct wininfo wininfo;
     struct wininfo *w = &wininfo;
 
@@ -394,195 +1055,341 @@ main (int argc, char **argv)
 	    tree = 1;
 	    continue;
 	}
-	if (!strcmp (argv[i], "-stats")) {
-	    stats = 1;
+	if (!strcmp (argv[i], "-watch")) {
+	    watch = 1;
 	    continue;
 	}
-	if (!strcmp (argv[i], "-bits")) {
-	    bits = 1;
+	if (!strcmp (argv[i], "-only-viewable")) {
+	    only_viewable = 1;
 	    continue;
 	}
-	if (!strcmp (argv[i], "-events")) {
-	    events = 1;
+	if (!strcmp (argv[i], "-class")) {
+	    if (++i >= argc)
+		fatal_error("-class requires argument");
+	    class_pattern = argv[i];
 	    continue;
 	}
-	if (!strcmp (argv[i], "-wm")) {
-	    wm = 1;
+	if (!strcmp (argv[i], "-min-size")) {
+	    char *end;
+
+	    if (++i >= argc)
+		fatal_error("-min-size requires argument");
+	    min_width = strtoul(argv[i], &end, 0);
+	    if (*end != 'x' ||
+		(min_height = strtoul(end + 1, &end, 0), *end != '\0'))
+		fatal_error("-min-size must be <width>x<height>");
 	    continue;
 	}
-	if (!strcmp (argv[i], "-frame")) {
-	    frame = 1;
+	if (!strcmp (argv[i], "-maxdepth")) {
+	    if (++i >= argc)
+		fatal_error("-maxdepth requires argument");
+	    max_depth = strtoul(argv[i], NULL, 0);
+	    if (max_depth == 0)
+		fatal_error("-maxdepth must be at least 1");
 	    continue;
 	}
-	if (!strcmp (argv[i], "-size")) {
-	    size = 1;
+	if (!strcmp (argv[i], "-fields")) {
+	    char *list, *field;
+
+	    if (++i >= argc)
+		fatal_error("-fields requires argument");
+	    list = strdup (argv[i]);
+	    if (list == NULL)
+		fatal_error("Failed to allocate memory in main");
+	    tree_fields = 0;
+	    for (field = strtok (list, ","); field; field = strtok (NULL, ",")) {
+		const struct binding *b;
+
+		for (b = _tree_fields; b->name; b++)
+		    if (!strcmp (field, b->name))
+			break;
+		if (b->name == NULL)
+		    fatal_error("-fields: unknown field %s", field);
+		tree_fields |= b->code;
+	    }
+	    free (list);
 	    continue;
 	}
-	if (!strcmp (argv[i], "-shape")) {
-	    shape = 1;
+	if (!strcmp (argv[i], "-max-inflight")) {
+	    if (++i >= argc)
+		fatal_error("-max-inflight requires argument");
+	    max_inflight = strtoul(argv[i], NULL, 0);
+	    if (max_inflight == 0)
+		fatal_error("-max-inflight must be at least 1");
 	    continue;
 	}
-	if (!strcmp (argv[i], "-english")) {
-	    english = 1;
+	if (!strcmp (argv[i], "-jobs")) {
+	    if (++i >= argc)
+		fatal_error("-jobs requires argument");
+	    jobs = strtoul(argv[i], NULL, 0);
+	    if (jobs == 0)
+		fatal_error("-jobs must be at least 1");
 	    continue;
 	}
-	if (!strcmp (argv[i], "-metric")) {
-	    metric = 1;
+	if (!strcmp (argv[i], "-batch")) {
+	    if (++i >= argc)
+		fatal_error("-batch requires argument");
+	    batch_file = argv[i];
 	    continue;
 	}
-	if (!strcmp (argv[i], "-all")) {
-	    tree = stats = bits = events = wm = size = shape = 1;
+	if (!strcmp (argv[i], "-lookahead")) {
+	    if (++i >= argc)
+		fatal_error("-lookahead requires argument");
+	    lookahead = strtoul(argv[i], NULL, 0);
+	    if (lookahead == 0)
+		fatal_error("-lookahead must be at least 1");
 	    continue;
 	}
-	if (!strcmp(argv[i], "-version")) {
-	    puts(PACKAGE_STRING);
-	    exit(0);
+	if (!strcmp (argv[i], "-snapshot")) {
+	    if (++i >= argc)
+		fatal_error("-snapshot requires argument");
+	    snapshot_file = argv[i];
+	    continue;
 	}
-	fprintf (stderr, "%s: unrecognized argument %s\n\n",
-		 program_name, argv[i]);
-	usage ();
-	exit (EXIT_FAILURE);
-    }
-
-    setup_display_and_screen (display_name, &dpy, &screen);
-
-    /* preload atoms we may need later */
-    Intern_Atom (dpy, "_NET_WM_NAME");
-    Intern_Atom (dpy, "UTF8_STRING");
-    if (wm) {
-	Intern_Atom (dpy, "_NET_WM_DESKTOP");
-	Intern_Atom (dpy, "_NET_WM_WINDOW_TYPE");
-	Intern_Atom (dpy, "_NET_WM_STATE");
-	Intern_Atom (dpy, "_NET_WM_PID");
-	Intern_Atom (dpy, "_NET_FRAME_EXTENTS");
-    }
-    /* initialize scaling data */
-    scale_init(screen);
-
-    if (use_root)
-	window = screen->root;
-    else if (window_name) {
-	window = window_with_name (dpy, screen->root, window_name);
-	if (!window)
-	    fatal_error ("No window with name \"%s\" exists!", window_name);
+	if (!strcmp (argv[i], "-from-snapshot")) {
+	    if (++i >= argc)
+		fatal_error("-from-snapshot requires argument");
+	    from_snapshot = argv[i];
+	    continue;
+	}
+	if (!strcmp (argv[i], "-record")) {
+	    if (++i >= argc)
+		fatal_error("-record requires argument");
+	    record_file = argv[i];
+	    continue;
+	}
+	if (!strcmp (argv[i], "-replay")) {
+	    if (++i >= argc)
+		fatal_error("-replay requires argument");
+	    replay_file = argv[i];
+	    continue;
+	}
+	if (!strcmp (argv[i], "-replay-latency")) {
+	    if (++i >= argc)
+		fatal_error("-replay-latency requires argument");
+	    replay_latency = strtoul(argv[i], NULL, 0);
+	    continue;
+	}
+	if (!strcmp (argv[i], "-atom-cache")) {
+	    if (++i >= argc)
+		fatal_error("-atom-cache requires argument");
+	    atom_cache_file = argv[i];
+	    continue;
+	}
+	if (!strcmp (argv[i], "-json")) {
+	    json = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-profile")) {
+	    profile_start ();
+	    continue;
+	}
+	if (!strcmp (argv[i], "-ndjson")) {
+	    json = ndjson = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-stats")) {
+	    stats = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-bits")) {
+	    bits = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-events")) {
+	    events = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-wm")) {
+	    wm = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-frame")) {
+	    frame = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-size")) {
+	    size = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-shape")) {
+	    shape = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-english")) {
+	    english = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-metric")) {
+	    metric = 1;
+	    continue;
+	}
+	if (!strcmp (argv[i], "-all")) {
+	    tree = stats = bits = events = wm = size = shape = 1;
+	    all = 1;
+	    continue;
+	}
+	if (!strcmp(argv[i], "-version")) {
+	    out_str (PACKAGE_STRING "\n");
+	    exit(0);
+	}
+	fprintf (stderr, "%s: unrecognized argument %s\n\n",
+		 program_name, argv[i]);
+	usage ();
+	exit (EXIT_FAILURE);
     }
 
-    /* If no window selected on command line, let user pick one the hard way */
-    if (!window) {
-	printf ("\n"
-		"xwininfo: Please select the window about which you\n"
-		"          would like information by clicking the\n"
-		"          mouse in that window.\n");
-	Intern_Atom (dpy, "_NET_VIRTUAL_ROOTS");
-	Intern_Atom (dpy, "WM_STATE");
-	window = select_window (dpy, screen, !frame);
+    if (watch) {
+	if (batch_file)
+	    fatal_error("-watch can't be used with -batch");
+	if (only_viewable || class_pattern || min_width || min_height ||
+	    max_depth || tree_fields != TREE_FIELDS_ALL)
+	    fatal_error("-watch can't be used with -only-viewable, -class, "
+			"-min-size, -maxdepth or -fields");
+	if (!children)
+	    tree = 1;
+	jobs = 1; /* events are only sent to the connection that asked */
+    }
+
+    if (from_snapshot) {
+	if (snapshot_file)
+	    fatal_error("-snapshot can't be used with -from-snapshot");
+	if (batch_file)
+	    fatal_error("-batch can't be used with -from-snapshot");
+	if (watch)
+	    fatal_error("-watch can't be used with -from-snapshot");
+	if ((wm || shape) && !all)
+	    fatal_error("-wm and -shape can't be used with -from-snapshot");
+	wm = shape = 0; /* -all shows what snapshots hold */
+    }
+
+    if (record_file || replay_file) {
+	if (record_file && replay_file)
+	    fatal_error("-record can't be used with -replay");
+	if (from_snapshot)
+	    fatal_error("-%s can't be used with -from-snapshot",
+			record_file ? "record" : "replay");
+	jobs = 1; /* the traffic must be the same from run to run */
+	if (record_file)
+	    record_connection (record_file);
+	else
+	    replay_connection (replay_file, replay_latency);
     }
 
+    json_set_pretty (json && !ndjson);
+
     /*
      * Do the actual displaying as per parameters
      */
     if (!(children || tree || bits || events || wm || size))
 	stats = 1;
 
-    /*
-     * make sure that the window is valid
-     */
-    {
-	xcb_get_geometry_cookie_t gg_cookie =
-	    xcb_get_geometry (dpy, window);
-
-	w->geometry = xcb_get_geometry_reply(dpy, gg_cookie, &err);
-
-	if (!w->geometry) {
-	    if (err)
-		print_x_error (dpy, err);
-
-	    fatal_error ("No such window with id %s.", window_id_str (window));
+    if (from_snapshot) {
+	profile_phase ("load snapshot");
+	load_snapshot (from_snapshot);
+    } else {
+	profile_phase ("connect");
+	setup_display_and_screen (display_name, &dpy, &screen);
+	profile_phase ("atoms");
+	if (atom_cache_file)
+	    load_atom_cache (dpy, display_name, atom_cache_file);
+
+	/* preload atoms we may need later */
+	Intern_Atom (dpy, "_NET_WM_NAME");
+	Intern_Atom (dpy, "UTF8_STRING");
+	if (wm) {
+	    Intern_Atom (dpy, "_NET_WM_DESKTOP");
+	    Intern_Atom (dpy, "_NET_WM_WINDOW_TYPE");
+	    Intern_Atom (dpy, "_NET_WM_STATE");
+	    Intern_Atom (dpy, "_NET_WM_PID");
 	}
+	if (wm || stats || snapshot_file)
+	    Intern_Atom (dpy, "_NET_FRAME_EXTENTS");
     }
+    /* initialize scaling data */
+    scale_init(screen);
 
-    /* Send requests to prefetch data we'll need */
-    w->window = window;
-    w->net_wm_name_cookie = get_net_wm_name (dpy, window);
-    w->wm_name_cookie = xcb_icccm_get_wm_name (dpy, window);
-    if (children || tree)
-	w->tree_cookie = xcb_query_tree (dpy, window);
-    if (stats) {
-	w->trans_coords_cookie =
-	    xcb_translate_coordinates (dpy, window, w->geometry->root,
-				       -(w->geometry->border_width),
-				       -(w->geometry->border_width));
+    if (snapshot_file) {
+	profile_phase ("snapshot");
+	write_snapshot (snapshot_file);
+	goto done;
+    }
+    if (batch_file) {
+	run_batch (batch_file);
+	goto done;
     }
-    if (stats || bits || events)
-	w->attr_cookie = xcb_get_window_attributes (dpy, window);
-    if (stats || size)
-	w->normal_hints_cookie = xcb_icccm_get_wm_normal_hints (dpy, window);
-    if (wm) {
-	w->hints_cookie = xcb_icccm_get_wm_hints(dpy, window);
 
-	atom_net_wm_desktop = get_atom (dpy, "_NET_WM_DESKTOP");
-	if (atom_net_wm_desktop) {
-	    w->wm_desktop_cookie = xcb_get_property
-		(dpy, 0, window, atom_net_wm_desktop,
-		 XCB_ATOM_CARDINAL, 0, 4);
-	}
+    if (use_root)
+	window = screen->root;
+    else if (window_name) {
+	if (snapshot)
+	    window = snapshot_window_with_name (window_name);
+	else
+	    window = window_with_name (dpy, screen->root, window_name);
+	if (!window)
+	    fatal_error ("No window with name \"%s\" exists!", window_name);
+    }
 
-	atom_net_wm_window_type	= get_atom (dpy, "_NET_WM_WINDOW_TYPE");
-	if (atom_net_wm_window_type) {
-	    w->wm_window_type_cookie = xcb_get_property
-		(dpy, 0, window, atom_net_wm_window_type,
-		 XCB_ATOM_ATOM, 0, BUFSIZ);
-	}
+    /* There is no pointer to pick a window with in a snapshot */
+    if (!window && snapshot)
+	window = screen->root;
 
-	atom_net_wm_state = get_atom (dpy, "_NET_WM_STATE");
-	if (atom_net_wm_state) {
-	    w->wm_state_cookie = xcb_get_property
-		(dpy, 0, window, atom_net_wm_state,
-		 XCB_ATOM_ATOM, 0, BUFSIZ);
+    /* If no window selected on command line, let user pick one the hard way */
+    if (!window) {
+	static const char prompt[] = "\n"
+	    "xwininfo: Please select the window about which you\n"
+	    "          would like information by clicking the\n"
+	    "          mouse in that window.\n";
+
+	if (json)
+	    fputs (prompt, stderr);
+	else {
+	    out_str (prompt);
+	    out_flush ();
 	}
+	profile_phase ("select");
+	Intern_Atom (dpy, "_NET_VIRTUAL_ROOTS");
+	Intern_Atom (dpy, "WM_STATE");
+	window = select_window (dpy, screen, !frame);
+    }
 
-	atom_net_wm_pid	= get_atom (dpy, "_NET_WM_PID");
-	if (atom_net_wm_pid) {
-	    w->wm_pid_cookie = xcb_get_property
-		(dpy, 0, window, atom_net_wm_pid,
-		 XCB_ATOM_CARDINAL, 0, BUFSIZ);
-	    w->wm_client_machine_cookie = xcb_get_property
-		(dpy, 0, window, XCB_ATOM_WM_CLIENT_MACHINE,
-		 XCB_GET_PROPERTY_TYPE_ANY, 0, BUFSIZ);
-	}
+    /*
+     * make sure that the window is valid: its geometry is asked for along
+     * with everything else, so the whole lot takes one round trip
+     */
+    w->window = window;
+    if (snapshot) {
+	profile_phase ("validate");
+	w->geometry = snapshot_geometry (snapshot_find (window));
+	if (!w->geometry)
+	    fatal_error ("No such window with id %s.", window_id_str (window));
+    } else {
+	profile_phase ("prefetch");
+	w->geometry_cookie = xcb_get_geometry (dpy, window);
+	speculate_atom_cache (1);
+	prefetch_window_info (w);
+	speculate_atom_cache (0);
+	xcb_flush (dpy);
 
-	atom_net_frame_extents = get_atom (dpy, "_NET_FRAME_EXTENTS");
-	if (atom_net_frame_extents) {
-	    w->frame_extents_cookie = xcb_get_property
-		(dpy, 0, window, atom_net_frame_extents,
-		 XCB_ATOM_CARDINAL, 0, 4 * 4);
-	}
+	profile_phase ("validate");
+	w->geometry = xcb_get_geometry_reply(dpy, w->geometry_cookie, &err);
+	if (!w->geometry)
+	    window_request_failed (w, err, NULL);
+	if (!check_atom_cache (dpy))
+	    refetch_window_properties (w);
     }
-    if (size)
-	w->zoom_cookie = xcb_icccm_get_wm_size_hints (dpy, window,
-						      XCB_ATOM_WM_ZOOM_HINTS);
-    xcb_flush (dpy);
 
-    printf ("\nxwininfo: Window id: ");
-    display_window_id (w, 1);
-    if (children || tree)
-	display_tree_info (w, tree);
-    if (stats)
-	display_stats_info (w);
-    if (bits)
-	display_bits_info (w);
-    if (events)
-	display_events_info (w);
-    if (wm)
-	display_wm_info (w);
-    if (size)
-	display_size_hints (w);
-    if (shape)
-	display_window_shape (window);
-    printf ("\n");
+    display_window_info (w);
+    if (watch) {
+	profile_phase ("watch");
+	watch_events ();
+    }
 
-    wininfo_wipe (w);
-    xcb_disconnect (dpy);
+  done:
+    if (dpy) {
+	save_atom_cache (dpy);
+	xcb_disconnect (dpy);
+    }
 #ifdef HAVE_ICONV
     if (iconv_from_utf8 && (iconv_from_utf8 != (iconv_t) -1)) {
 	iconv_close (iconv_from_utf8);
@@ -591,22 +1398,74 @@ main (int argc, char **argv)
     exit (0);
 }
 
+/*
+ * Give up on a request about the window being shown.  If it failed
+ * because the window doesn't exist, which any of them may find first,
+ * that is what is reported, as for a bad -id.
+ */
+static void _X_NORETURN
+window_request_failed (struct wininfo *w, xcb_generic_error_t *e,
+		       const char *msg)
+{
+    if (e)
+	print_x_error (dpy, e);
+    if (msg == NULL || (e && e->error_code == XCB_WINDOW))
+	fatal_error ("No such window with id %s.", window_id_str (w->window));
+    fatal_error ("%s", msg);
+}
+
 /* Ensure win_attributes field is filled in */
 static xcb_get_window_attributes_reply_t *
 fetch_win_attributes (struct wininfo *w)
 {
     if (!w->win_attributes) {
+	if (snapshot) {
+	    w->win_attributes = snapshot_attributes (snapshot_find (w->window));
+	    if (!w->win_attributes)
+		fatal_error ("Can't get window attributes.");
+	    return w->win_attributes;
+	}
+
 	w->win_attributes =
 	    xcb_get_window_attributes_reply (dpy, w->attr_cookie, &err);
 
-	if (!w->win_attributes) {
-	    print_x_error (dpy, err);
-	    fatal_error ("Can't get window attributes.");
-	}
+	if (!w->win_attributes)
+	    window_request_failed (w, err, "Can't get window attributes.");
     }
     return w->win_attributes;
 }
 
+/* Ensure tree field is filled in */
+static xcb_query_tree_reply_t *
+fetch_tree (struct wininfo *w)
+{
+    if (!w->tree) {
+	if (snapshot) {
+	    w->tree = snapshot_tree (snapshot_find (w->window));
+	    return w->tree;
+	}
+
+	w->tree = xcb_query_tree_reply (dpy, w->tree_cookie, &err);
+	if (!w->tree)
+	    window_request_failed (w, err, "Can't query window tree.");
+    }
+    return w->tree;
+}
+
+/* Ensure frame_extents field is filled in, if the property exists */
+static xcb_get_property_reply_t *
+fetch_frame_extents (struct wininfo *w)
+{
+    if (!w->frame_extents && snapshot)
+	w->frame_extents = snapshot_frame_extents (snapshot_find (w->window));
+    if (!w->frame_extents && w->frame_extents_cookie.sequence) {
+	w->frame_extents =
+	    xcb_get_property_reply (dpy, w->frame_extents_cookie, NULL);
+	w->frame_extents_cookie.sequence = 0;
+    }
+    return w->frame_extents;
+}
+
 /* Ensure normal_hints field is filled in */
 static xcb_size_hints_t *
 fetch_normal_hints (struct wininfo *w, xcb_size_hints_t *hints_return)
@@ -614,8 +1473,15 @@ fetch_normal_hints (struct wininfo *w, xcb_size_hints_t *hints_return)
     xcb_size_hints_t hints;
 
     if (!w->normal_hints) {
-	if (xcb_icccm_get_wm_normal_hints_reply (dpy, w->normal_hints_cookie,
-						 &hints, NULL)) {
+	int got_hints;
+
+	if (snapshot)
+	    got_hints = snapshot_size_hints
+		(snapshot->normal_hints, snapshot_find (w->window), &hints);
+	else
+	    got_hints = xcb_icccm_get_wm_normal_hints_reply
+		(dpy, w->normal_hints_cookie, &hints, NULL);
+	if (got_hints) {
 	    w->normal_hints = malloc (sizeof(xcb_size_hints_t));
 	    if (w->normal_hints)
 		memcpy(w->normal_hints, &hints, sizeof(xcb_size_hints_t));
@@ -626,6 +1492,16 @@ fetch_normal_hints (struct wininfo *w, xcb_size_hints_t *hints_return)
     return w->normal_hints;
 }
 
+/* Get the zoom hints, only ever needed once */
+static int
+fetch_zoom_hints (struct wininfo *w, xcb_size_hints_t *hints_return)
+{
+    if (snapshot)
+	return snapshot_size_hints (snapshot->zoom_hints,
+				    snapshot_find (w->window), hints_return);
+    return xcb_icccm_get_wm_size_hints_reply (dpy, w->zoom_cookie,
+					      hints_return, NULL);
+}
 
 /*
  * Lookup: lookup a code in a table.
@@ -660,71 +1536,121 @@ Lookup (int code, const struct binding *table)
     return LookupL ((long)code, table);
 }
 
+/* Copies a window name out of a property reply */
+static void
+set_window_name (struct window_name *wn, const char *name, unsigned int len,
+		 xcb_atom_t encoding)
+{
+    wn->len = len;
+    wn->encoding = encoding;
+    if (len > 0) {
+	wn->name = malloc (len);
+	if (wn->name == NULL)
+	    fatal_error ("Failed to allocate memory in set_window_name");
+	memcpy (wn->name, name, len);
+    }
+}
+
 /*
- * Routine to display a window id in dec/hex with name if window has one
+ * Fetch the name of a window, preferring _NET_WM_NAME over WM_NAME.
+ * The name is copied, so the caller must free wn->name.
  *
- * Requires wininfo members initialized: window, wm_name_cookie
+ * Requires wininfo members initialized: window, net_wm_name_cookie,
+ *   wm_name_cookie
  */
-
 static void
-display_window_id (struct wininfo *w, int newline_wanted)
+fetch_window_name (xcb_connection_t *fwn_dpy, struct wininfo *w,
+		   struct window_name *wn)
 {
     xcb_icccm_get_text_property_reply_t wmn_reply;
-    uint8_t got_reply = 0;
     xcb_get_property_reply_t *prop;
-    const char *wm_name = NULL;
-    unsigned int wm_name_len = 0;
-    xcb_atom_t wm_name_encoding = XCB_NONE;
 
-    printf ("%s", window_id_str (w->window));
+    memset (wn, 0, sizeof(struct window_name));
 
-    if (!w->window) {
-	printf (" (none)");
+    if (snapshot) {
+	uint32_t i = snapshot_find (w->window);
+
+	if (i != SNAPSHOT_NONE && snapshot->name[i] != SNAPSHOT_NONE)
+	    set_window_name (wn, snapshot->strings + snapshot->name[i],
+			     snapshot->name_len[i], snapshot->name_encoding[i]);
+	return;
+    }
+
+    prop = xcb_get_property_reply (fwn_dpy, w->net_wm_name_cookie, NULL);
+    if (prop && (prop->type != XCB_NONE)) {
+	set_window_name (wn, xcb_get_property_value (prop),
+			 xcb_get_property_value_length (prop), prop->type);
+	xcb_discard_reply (fwn_dpy, w->wm_name_cookie.sequence);
+    } else if (xcb_icccm_get_wm_name_reply (fwn_dpy, w->wm_name_cookie,
+					    &wmn_reply, NULL)) {
+	/* No _NET_WM_NAME, check WM_NAME */
+	set_window_name (wn, wmn_reply.name, wmn_reply.name_len,
+			 wmn_reply.encoding);
+	xcb_icccm_get_text_property_reply_wipe (&wmn_reply);
+    }
+    free (prop);
+}
+
+/*
+ * Routine to display a window id in dec/hex with name if window has one
+ */
+static void
+print_window_id (xcb_window_t window, const struct window_name *wn,
+		 int newline_wanted)
+{
+    if (window_id_format_dec)
+	out_uint (window);
+    else
+	out_hex (window);
+
+    if (!window) {
+	out_str (" (none)");
     } else {
-	if (w->window == screen->root) {
-	    printf (" (the root window)");
-	}
-	/* Get window name if any */
-	prop = xcb_get_property_reply (dpy, w->net_wm_name_cookie, NULL);
-	if (prop && (prop->type != XCB_NONE)) {
-	    wm_name = xcb_get_property_value (prop);
-	    wm_name_len = xcb_get_property_value_length (prop);
-	    wm_name_encoding = prop->type;
-	} else { /* No _NET_WM_NAME, check WM_NAME */
-	    got_reply = xcb_icccm_get_wm_name_reply (dpy, w->wm_name_cookie,
-						     &wmn_reply, NULL);
-	    if (got_reply) {
-		wm_name = wmn_reply.name;
-		wm_name_len = wmn_reply.name_len;
-		wm_name_encoding = wmn_reply.encoding;
-	    }
+	if (window == screen->root) {
+	    out_str (" (the root window)");
 	}
-	if (wm_name_len == 0) {
-	    printf (" (has no name)");
-        } else {
-	    if (wm_name_encoding == XCB_ATOM_STRING) {
-		printf (" \"%.*s\"", wm_name_len, wm_name);
-	    } else if (wm_name_encoding == atom_utf8_string) {
-		print_utf8 (" \"", wm_name, wm_name_len,  "\"");
+	if (wn->len == 0) {
+	    out_str (" (has no name)");
+	} else {
+	    if (wn->encoding == XCB_ATOM_STRING) {
+		out_write (" \"", 2);
+		out_write (wn->name, wn->len);
+		out_char ('"');
+	    } else if (wn->encoding == atom_utf8_string) {
+		print_utf8 (" \"", wn->name, wn->len,  "\"");
 	    } else {
 		/* Encodings we don't support, including COMPOUND_TEXT */
-		const char *enc_name = get_atom_name (dpy, wm_name_encoding);
+		const char *enc_name = get_atom_name (dpy, wn->encoding);
 		if (enc_name) {
-		    printf (" (name in unsupported encoding %s)", enc_name);
+		    out_printf (" (name in unsupported encoding %s)", enc_name);
 		} else {
-		    printf (" (name in unsupported encoding ATOM 0x%x)",
-			    wm_name_encoding);
+		    out_printf (" (name in unsupported encoding ATOM 0x%x)",
+			    wn->encoding);
 		}
 	    }
 	}
-	if (got_reply)
-	    xcb_icccm_get_text_property_reply_wipe (&wmn_reply);
     }
 
     if (newline_wanted)
-	printf ("\n");
+	out_char ('\n');
+}
+
+/*
+ * Requires wininfo members initialized: window, net_wm_name_cookie,
+ *   wm_name_cookie
+ */
+static void
+display_window_id (struct wininfo *w, int newline_wanted)
+{
+    struct window_name wn;
+
+    if (w->window)
+	fetch_window_name (dpy, w, &wn);
+    else
+	memset (&wn, 0, sizeof(struct window_name));
 
-    return;
+    print_window_id (w->window, &wn, newline_wanted);
+    free (wn.name);
 }
 
 
@@ -786,95 +1712,186 @@ static const struct binding _visual_classes[] = {
 	{ 0, NULL }};
 
 /*
- * Requires wininfo members initialized:
- *   window, geometry, attr_cookie, trans_coords_cookie, normal_hints_cookie
+ * Find the window manager frame a window was reparented into, starting
+ * from its parent: the ancestor that is a child of the root.  Each
+ * ancestor's geometry is requested along with its parent, so once the
+ * frame is found its geometry is already on the way.
+ *
+ * The frame is most likely guess, the child of the root that
+ * TranslateCoordinates named over the window's corner, whose geometry
+ * goes out with the first QueryTree.  Reaching it ends the walk there,
+ * as being a child of the root it must be the frame, so the walk takes
+ * a round trip for each level between the parent and the frame, and a
+ * window reparented straight into its frame takes one in all.  The
+ * guess alone can't be trusted, though: another top-level window over
+ * the corner would be named instead, and then the walk goes on to the
+ * root.  Window managers setting _NET_FRAME_EXTENTS spare us the walk
+ * altogether.
  */
-static void
-display_stats_info (struct wininfo *w)
+static xcb_get_geometry_reply_t *
+fetch_frame_geometry (xcb_window_t ancestor, xcb_window_t root,
+		      xcb_window_t guess)
 {
-    xcb_translate_coordinates_reply_t *trans_coords;
-    xcb_get_window_attributes_reply_t *win_attributes;
-    xcb_size_hints_t hints;
-
-    int dw = screen->width_in_pixels, dh = screen->height_in_pixels;
-    int rx, ry, xright, ybelow;
-    int showright = 0, showbelow = 0;
-    xcb_window_t wmframe, parent;
-
-    trans_coords =
-	xcb_translate_coordinates_reply (dpy, w->trans_coords_cookie, NULL);
-    if (!trans_coords)
-	fatal_error ("Can't get translated coordinates.");
-
-    rx = (int16_t)trans_coords->dst_x;
-    ry = (int16_t)trans_coords->dst_y;
-    free (trans_coords);
-
-    xright = (dw - rx - w->geometry->border_width * 2 -
-	      w->geometry->width);
-    ybelow = (dh - ry - w->geometry->border_width * 2 -
-	      w->geometry->height);
-
-
-    printf ("\n");
-    printf ("  Absolute upper-left X:  %s\n", xscale (rx));
-    printf ("  Absolute upper-left Y:  %s\n", yscale (ry));
-    printf ("  Relative upper-left X:  %s\n", xscale (w->geometry->x));
-    printf ("  Relative upper-left Y:  %s\n", yscale (w->geometry->y));
-    printf ("  Width: %s\n", xscale (w->geometry->width));
-    printf ("  Height: %s\n", yscale (w->geometry->height));
-    printf ("  Depth: %d\n", w->geometry->depth);
+    xcb_get_geometry_reply_t *frame_geometry;
+    xcb_get_geometry_cookie_t guess_cookie = { 0 };
 
-    win_attributes = fetch_win_attributes (w);
+    if (snapshot) {
+	uint32_t i = snapshot_find (ancestor);
 
-    printf ("  Visual: 0x%lx\n", (unsigned long) win_attributes->visual);
-    if (screen)
-    {
-	xcb_depth_iterator_t depth_iter;
-	xcb_visualtype_t  *visual_type = NULL;
+	while (i != SNAPSHOT_NONE && snapshot->parent[i] != SNAPSHOT_NONE &&
+	       snapshot->window[snapshot->parent[i]] != root)
+	    i = snapshot->parent[i];
+	frame_geometry = snapshot_geometry (i);
+	if (!frame_geometry)
+	    fatal_error ("Can't get frame geometry.");
+	return frame_geometry;
+    }
 
-	depth_iter = xcb_screen_allowed_depths_iterator (screen);
-	for (; depth_iter.rem; xcb_depth_next (&depth_iter)) {
-	    xcb_visualtype_iterator_t visual_iter;
+    if (guess)
+	guess_cookie = xcb_get_geometry (dpy, guess);
+    for (;;) {
+	xcb_query_tree_cookie_t qt_cookie;
+	xcb_get_geometry_cookie_t geom_cookie;
+	xcb_query_tree_reply_t *tree;
+	xcb_window_t parent;
 
-	    visual_iter = xcb_depth_visuals_iterator (depth_iter.data);
-	    for (; visual_iter.rem; xcb_visualtype_next (&visual_iter)) {
-		if (win_attributes->visual == visual_iter.data->visual_id) {
-		    visual_type = visual_iter.data;
-		    break;
-		}
+	if (ancestor == guess) {
+	    frame_geometry = xcb_get_geometry_reply (dpy, guess_cookie, &err);
+	    if (!frame_geometry) {
+		print_x_error (dpy, err);
+		fatal_error ("Can't get frame geometry.");
 	    }
+	    return frame_geometry;
 	}
-	if (visual_type)
-	    printf ("  Visual Class: %s\n", Lookup (visual_type->_class,
-						    _visual_classes));
-    }
 
-    printf ("  Border width: %s\n", bscale (w->geometry->border_width));
-    printf ("  Class: %s\n",
-	    Lookup (win_attributes->_class, _window_classes));
-    printf ("  Colormap: 0x%lx (%sinstalled)\n",
-	    (unsigned long) win_attributes->colormap,
-	    win_attributes->map_is_installed ? "" : "not ");
-    printf ("  Bit Gravity State: %s\n",
-	    Lookup (win_attributes->bit_gravity, _bit_gravity_states));
-    printf ("  Window Gravity State: %s\n",
-	    Lookup (win_attributes->win_gravity, _window_gravity_states));
-    printf ("  Backing Store State: %s\n",
-	    Lookup (win_attributes->backing_store, _backing_store_states));
-    printf ("  Save Under State: %s\n",
-	    win_attributes->save_under ? "yes" : "no");
-    printf ("  Map State: %s\n",
-	    Lookup (win_attributes->map_state, _map_states));
-    printf ("  Override Redirect State: %s\n",
-	    win_attributes->override_redirect ? "yes" : "no");
-    printf ("  Corners:  +%d+%d  -%d+%d  -%d-%d  +%d-%d\n",
-	    rx, ry, xright, ry, xright, ybelow, rx, ybelow);
+	qt_cookie = xcb_query_tree (dpy, ancestor);
+	geom_cookie = xcb_get_geometry (dpy, ancestor);
+	tree = xcb_query_tree_reply (dpy, qt_cookie, &err);
+	if (!tree) {
+	    xcb_discard_reply (dpy, geom_cookie.sequence);
+	    print_x_error (dpy, err);
+	    fatal_error ("Can't query window tree.");
+	}
+	parent = tree->parent;
+	free (tree);
 
-    /*
-     * compute geometry string that would recreate window
-     */
-    printf ("  -geometry ");
+	if (parent == root || !parent) {
+	    if (guess_cookie.sequence)
+		xcb_discard_reply (dpy, guess_cookie.sequence);
+	    frame_geometry = xcb_get_geometry_reply (dpy, geom_cookie, &err);
+	    if (!frame_geometry) {
+		print_x_error (dpy, err);
+		fatal_error ("Can't get frame geometry.");
+	    }
+	    return frame_geometry;
+	}
+	xcb_discard_reply (dpy, geom_cookie.sequence);
+	ancestor = parent;
+    }
+}
+
+/*
+ * Fetch the position of a window's outer corner relative to the root,
+ * and its distance from the right and bottom edges of the screen
+ *
+ * Requires wininfo members initialized: geometry, trans_coords_cookie
+ *   (for the inside corner, relative to the default screen's root)
+ */
+static void
+fetch_position (struct wininfo *w, int *rx, int *ry, int *xright, int *ybelow)
+{
+    xcb_translate_coordinates_reply_t *trans_coords;
+
+    if (snapshot) {
+	uint32_t i = snapshot_find (w->window);
+
+	if (!(snapshot->flags[i] & SNAPSHOT_GOT_TRANS_COORDS))
+	    fatal_error ("Can't get translated coordinates.");
+	*rx = snapshot->abs_x[i] - w->geometry->border_width;
+	*ry = snapshot->abs_y[i] - w->geometry->border_width;
+    } else {
+	if (w->geometry->root != screen->root) {
+	    /* on another screen, so ask again relative to its root */
+	    xcb_discard_reply (dpy, w->trans_coords_cookie.sequence);
+	    w->trans_coords_cookie = xcb_translate_coordinates
+		(dpy, w->window, w->geometry->root, 0, 0);
+	}
+	trans_coords = xcb_translate_coordinates_reply
+	    (dpy, w->trans_coords_cookie, &err);
+	if (!trans_coords)
+	    window_request_failed (w, err, "Can't get translated coordinates.");
+
+	*rx = (int16_t) (trans_coords->dst_x - w->geometry->border_width);
+	*ry = (int16_t) (trans_coords->dst_y - w->geometry->border_width);
+	w->root_child = trans_coords->child;
+	free (trans_coords);
+    }
+
+    *xright = (screen->width_in_pixels - *rx -
+	       w->geometry->border_width * 2 - w->geometry->width);
+    *ybelow = (screen->height_in_pixels - *ry -
+	       w->geometry->border_width * 2 - w->geometry->height);
+}
+
+/* Find the description of a visual among those of the screen */
+static xcb_visualtype_t *
+find_visual_type (xcb_visualid_t visual)
+{
+    xcb_depth_iterator_t depth_iter;
+    xcb_visualtype_t  *visual_type = NULL;
+
+    depth_iter = xcb_screen_allowed_depths_iterator (screen);
+    for (; depth_iter.rem; xcb_depth_next (&depth_iter)) {
+	xcb_visualtype_iterator_t visual_iter;
+
+	visual_iter = xcb_depth_visuals_iterator (depth_iter.data);
+	for (; visual_iter.rem; xcb_visualtype_next (&visual_iter)) {
+	    if (visual == visual_iter.data->visual_id) {
+		visual_type = visual_iter.data;
+		break;
+	    }
+	}
+    }
+    return visual_type;
+}
+
+/* The name of the class of a window's visual, NULL if it isn't known */
+static const char *
+fetch_visual_class (struct wininfo *w)
+{
+    xcb_visualtype_t *visual_type;
+
+    if (snapshot) {
+	uint32_t i = snapshot_find (w->window);
+
+	if (snapshot->visual_class[i] == 0xFF)
+	    return NULL;
+	return Lookup (snapshot->visual_class[i], _visual_classes);
+    }
+
+    visual_type = find_visual_type (fetch_win_attributes (w)->visual);
+    if (visual_type)
+	return Lookup (visual_type->_class, _visual_classes);
+    return NULL;
+}
+
+/*
+ * Compute the -geometry string that would recreate a window, given the
+ * position fetch_position() found for it
+ *
+ * Requires wininfo members initialized:
+ *   window, geometry, normal_hints_cookie, tree_cookie (or tree),
+ *   frame_extents_cookie
+ */
+static void
+fetch_geometry_string (struct wininfo *w, int rx, int ry, int xright,
+		       int ybelow, char *buf, size_t bufsize)
+{
+    xcb_size_hints_t hints;
+    int dw = screen->width_in_pixels, dh = screen->height_in_pixels;
+    int width = w->geometry->width, height = w->geometry->height;
+    int showright = 0, showbelow = 0;
+    xcb_window_t parent;
 
     /* compute size in appropriate units */
     if (!fetch_normal_hints (w, &hints))
@@ -885,79 +1902,77 @@ display_stats_info (struct wininfo *w)
 	if (hints.flags &
 	    (XCB_ICCCM_SIZE_HINT_BASE_SIZE|XCB_ICCCM_SIZE_HINT_P_MIN_SIZE)) {
 	    if (hints.flags & XCB_ICCCM_SIZE_HINT_BASE_SIZE) {
-		w->geometry->width -= hints.base_width;
-		w->geometry->height -= hints.base_height;
+		width = (uint16_t) (width - hints.base_width);
+		height = (uint16_t) (height - hints.base_height);
 	    } else {
 		/* ICCCM says MinSize is default for BaseSize */
-		w->geometry->width -= hints.min_width;
-		w->geometry->height -= hints.min_height;
+		width = (uint16_t) (width - hints.min_width);
+		height = (uint16_t) (height - hints.min_height);
 	    }
 	}
-	printf ("%dx%d", w->geometry->width/hints.width_inc,
-		w->geometry->height/hints.height_inc);
-    } else
-	printf ("%dx%d", w->geometry->width, w->geometry->height);
+	width /= hints.width_inc;
+	height /= hints.height_inc;
+    }
 
     if (!(hints.flags & XCB_ICCCM_SIZE_HINT_P_WIN_GRAVITY))
 	hints.win_gravity = XCB_GRAVITY_NORTH_WEST; /* per ICCCM */
     /* find our window manager frame, if any */
-    for (wmframe = parent = w->window; parent != 0 ; wmframe = parent) {
-	xcb_query_tree_cookie_t qt_cookie;
-	xcb_query_tree_reply_t *tree;
-
-	qt_cookie = xcb_query_tree (dpy, wmframe);
-	tree = xcb_query_tree_reply (dpy, qt_cookie, &err);
-	if (!tree) {
-	    print_x_error (dpy, err);
-	    fatal_error ("Can't query window tree.");
-	}
-	parent = tree->parent;
-	free (tree);
-	if (parent == w->geometry->root || !parent)
-	    break;
-    }
-    if (wmframe != w->window) {
+    parent = fetch_tree (w)->parent;
+    if (parent != w->geometry->root && parent != 0) {
 	/* WM reparented, so find edges of the frame */
 	/* Only works for ICCCM-compliant WMs, and then only if the
 	   window has corner gravity.  We would need to know the original width
 	   of the window to correctly handle the other gravities. */
-	xcb_get_geometry_cookie_t geom_cookie;
-	xcb_get_geometry_reply_t *frame_geometry;
-
-	geom_cookie = xcb_get_geometry (dpy, wmframe);
-	frame_geometry = xcb_get_geometry_reply (dpy, geom_cookie, &err);
-
-	if (!frame_geometry) {
-	    print_x_error (dpy, err);
-	    fatal_error ("Can't get frame geometry.");
+	xcb_get_property_reply_t *extents = fetch_frame_extents (w);
+	int frame_x, frame_y, frame_xright, frame_ybelow;
+
+	if (extents && (extents->type == XCB_ATOM_CARDINAL)
+	    && (extents->format == 32) && (extents->value_len == 4)) {
+	    /* EWMH WMs tell us how far the frame extends around us */
+	    uint32_t *e = xcb_get_property_value (extents);
+
+	    frame_x = rx - (int) e[0];
+	    frame_xright = xright - (int) e[1];
+	    frame_y = ry - (int) e[2];
+	    frame_ybelow = ybelow - (int) e[3];
+	} else {
+	    xcb_get_geometry_reply_t *frame_geometry;
+
+	    frame_geometry = fetch_frame_geometry (parent, w->geometry->root,
+						   w->root_child);
+	    frame_x = frame_geometry->x;
+	    frame_xright = dw - frame_geometry->x - frame_geometry->width -
+		(2 * frame_geometry->border_width);
+	    frame_y = frame_geometry->y;
+	    frame_ybelow = dh - frame_geometry->y - frame_geometry->height -
+		(2 * frame_geometry->border_width);
+	    free (frame_geometry);
 	}
+
 	switch (hints.win_gravity) {
 	    case XCB_GRAVITY_NORTH_WEST: case XCB_GRAVITY_SOUTH_WEST:
 	    case XCB_GRAVITY_NORTH_EAST: case XCB_GRAVITY_SOUTH_EAST:
 	    case XCB_GRAVITY_WEST:
-		rx = frame_geometry->x;
+		rx = frame_x;
 	}
 	switch (hints.win_gravity) {
 	    case XCB_GRAVITY_NORTH_WEST: case XCB_GRAVITY_SOUTH_WEST:
 	    case XCB_GRAVITY_NORTH_EAST: case XCB_GRAVITY_SOUTH_EAST:
 	    case XCB_GRAVITY_EAST:
-		xright = dw - frame_geometry->x - frame_geometry->width -
-		    (2 * frame_geometry->border_width);
+		xright = frame_xright;
 	}
 	switch (hints.win_gravity) {
 	    case XCB_GRAVITY_NORTH_WEST: case XCB_GRAVITY_SOUTH_WEST:
 	    case XCB_GRAVITY_NORTH_EAST: case XCB_GRAVITY_SOUTH_EAST:
 	    case XCB_GRAVITY_NORTH:
-		ry = frame_geometry->y;
+		ry = frame_y;
 	}
 	switch (hints.win_gravity) {
 	    case XCB_GRAVITY_NORTH_WEST: case XCB_GRAVITY_SOUTH_WEST:
 	    case XCB_GRAVITY_NORTH_EAST: case XCB_GRAVITY_SOUTH_EAST:
 	    case XCB_GRAVITY_SOUTH:
-		ybelow = dh - frame_geometry->y - frame_geometry->height -
-		    (2 * frame_geometry->border_width);
+		ybelow = frame_ybelow;
 	}
-	free (frame_geometry);
     }
     /* If edge gravity, offer a corner on that edge (because the application
        programmer cares about that edge), otherwise offer upper left unless
@@ -973,17 +1988,71 @@ display_stats_info (struct wininfo *w)
 	 &&  hints.win_gravity != XCB_GRAVITY_NORTH))
 	showbelow = 1;
 
-    if (showright)
-	printf ("-%d", xright);
-    else
-	printf ("+%d", rx);
-    if (showbelow)
-	printf ("-%d", ybelow);
-    else
-	printf ("+%d", ry);
-    printf ("\n");
+    snprintf (buf, bufsize, "%dx%d%c%d%c%d", width, height,
+	      showright ? '-' : '+', showright ? xright : rx,
+	      showbelow ? '-' : '+', showbelow ? ybelow : ry);
 }
 
+/*
+ * Requires wininfo members initialized:
+ *   window, geometry, attr_cookie, trans_coords_cookie, normal_hints_cookie,
+ *   tree_cookie (or tree), frame_extents_cookie
+ */
+static void
+display_stats_info (struct wininfo *w)
+{
+    xcb_get_window_attributes_reply_t *win_attributes;
+    const char *visual_class;
+    int rx, ry, xright, ybelow;
+    char geometry[100];
+    char xbuf[SCALE_BUFSIZE], ybuf[SCALE_BUFSIZE], bbuf[SCALE_BUFSIZE];
+
+    fetch_position (w, &rx, &ry, &xright, &ybelow);
+
+    out_char ('\n');
+    out_printf ("  Absolute upper-left X:  %s\n", xscale (rx, xbuf));
+    out_printf ("  Absolute upper-left Y:  %s\n", yscale (ry, ybuf));
+    out_printf ("  Relative upper-left X:  %s\n", xscale (w->geometry->x, xbuf));
+    out_printf ("  Relative upper-left Y:  %s\n", yscale (w->geometry->y, ybuf));
+    out_printf ("  Width: %s\n", xscale (w->geometry->width, xbuf));
+    out_printf ("  Height: %s\n", yscale (w->geometry->height, ybuf));
+    out_printf ("  Depth: %d\n", w->geometry->depth);
+
+    win_attributes = fetch_win_attributes (w);
+
+    out_printf ("  Visual: 0x%lx\n", (unsigned long) win_attributes->visual);
+    visual_class = fetch_visual_class (w);
+    if (visual_class)
+	out_printf ("  Visual Class: %s\n", visual_class);
+
+    out_printf ("  Border width: %s\n", bscale (w->geometry->border_width, bbuf));
+    out_printf ("  Class: %s\n",
+	    Lookup (win_attributes->_class, _window_classes));
+    out_printf ("  Colormap: 0x%lx (%sinstalled)\n",
+	    (unsigned long) win_attributes->colormap,
+	    win_attributes->map_is_installed ? "" : "not ");
+    out_printf ("  Bit Gravity State: %s\n",
+	    Lookup (win_attributes->bit_gravity, _bit_gravity_states));
+    out_printf ("  Window Gravity State: %s\n",
+	    Lookup (win_attributes->win_gravity, _window_gravity_states));
+    out_printf ("  Backing Store State: %s\n",
+	    Lookup (win_attributes->backing_store, _backing_store_states));
+    out_printf ("  Save Under State: %s\n",
+	    win_attributes->save_under ? "yes" : "no");
+    out_printf ("  Map State: %s\n",
+	    Lookup (win_attributes->map_state, _map_states));
+    out_printf ("  Override Redirect State: %s\n",
+	    win_attributes->override_redirect ? "yes" : "no");
+    out_printf ("  Corners:  +%d+%d  -%d+%d  -%d-%d  +%d-%d\n",
+	    rx, ry, xright, ry, xright, ybelow, rx, ybelow);
+
+    /*
+     * compute geometry string that would recreate window
+     */
+    fetch_geometry_string (w, rx, ry, xright, ybelow,
+			   geometry, sizeof(geometry));
+    out_printf ("  -geometry %s\n", geometry);
+}
 
 /*
  * Display bits info:
@@ -1025,18 +2094,18 @@ display_bits_info (struct wininfo * w)
     xcb_get_window_attributes_reply_t *win_attributes
 	= fetch_win_attributes (w);
 
-    printf ("\n");
-    printf ("  Bit gravity: %s\n",
+    out_char ('\n');
+    out_printf ("  Bit gravity: %s\n",
 	    Lookup (win_attributes->bit_gravity, _gravities+1));
-    printf ("  Window gravity: %s\n",
+    out_printf ("  Window gravity: %s\n",
 	    Lookup (win_attributes->win_gravity, _gravities));
-    printf ("  Backing-store hint: %s\n",
+    out_printf ("  Backing-store hint: %s\n",
 	    Lookup (win_attributes->backing_store, _backing_store_hint));
-    printf ("  Backing-planes to be preserved: 0x%lx\n",
+    out_printf ("  Backing-planes to be preserved: 0x%lx\n",
 	    (unsigned long) win_attributes->backing_planes);
-    printf ("  Backing pixel: %ld\n",
+    out_printf ("  Backing pixel: %ld\n",
 	    (unsigned long) win_attributes->backing_pixel);
-    printf ("  Save-unders: %s\n",
+    out_printf ("  Save-unders: %s\n",
 	    Lookup (win_attributes->save_under, _bool));
 }
 
@@ -1079,7 +2148,7 @@ display_event_mask (long mask)
 
     for (bit=0, bit_mask=1; bit < sizeof(long)*8; bit++, bit_mask <<= 1)
 	if (mask & bit_mask)
-	    printf ("      %s\n",
+	    out_printf ("      %s\n",
 		    LookupL (bit_mask, _event_mask_names));
 }
 
@@ -1096,14 +2165,14 @@ display_events_info (struct wininfo *w)
     xcb_get_window_attributes_reply_t *win_attributes
 	= fetch_win_attributes (w);
 
-    printf ("\n");
-    printf ("  Someone wants these events:\n");
+    out_char ('\n');
+    out_str ("  Someone wants these events:\n");
     display_event_mask (win_attributes->all_event_masks);
 
-    printf ("  Do not propagate these events:\n");
+    out_str ("  Do not propagate these events:\n");
     display_event_mask (win_attributes->do_not_propagate_mask);
 
-    printf ("  Override redirection?: %s\n",
+    out_printf ("  Override redirection?: %s\n",
 	    Lookup (win_attributes->override_redirect, _bool));
 }
 
@@ -1114,457 +2183,2953 @@ display_events_info (struct wininfo *w)
 
 
 /*
- * Display root, parent, and (recursively) children information
- * recurse - true to show children information
+ * Tree walk engine for -tree and -children
  *
- * Requires wininfo members initialized: window, tree_cookie
+ * Rather than recursing depth-first and waiting for each window's QueryTree
+ * reply before the requests for its siblings' subtrees can be sent, windows
+ * are collected breadth-first into an array: as soon as a window's children
+ * are known, the requests for all of them are sent, so a whole level of the
+ * tree is in flight at once and a walk costs one round trip per level
+ * instead of one per window.  The results are printed afterwards, in the
+ * same depth-first stacking order the recursive walk used.
  */
+
+/* Grow the node array of a walk to hold at least one more window */
 static void
-display_tree_info (struct wininfo *w, int recurse)
+tree_walk_grow (struct tree_walk *walk)
+{
+    unsigned int size;
+
+    if (walk->num_nodes < walk->nodes_size)
+	return;
+
+    size = walk->nodes_size ? walk->nodes_size * 2 : 64;
+    walk->nodes = realloc (walk->nodes, size * sizeof(struct tree_node));
+    if (walk->nodes == NULL)
+	fatal_error ("Failed to allocate memory in tree_walk_grow");
+    walk->nodes_size = size;
+}
+
+/* Append a window to the walk, returning its index */
+static unsigned int
+tree_walk_add (struct tree_walk *walk, xcb_window_t window)
 {
-    display_tree_info_1 (w, recurse, 0);
+    unsigned int index = walk->num_nodes++;
+
+    tree_walk_grow (walk);
+    memset (&walk->nodes[index], 0, sizeof(struct tree_node));
+    walk->nodes[index].window = window;
+    return index;
 }
 
 /*
- * level - recursion level
+ * Hand the children of a window over to an idle worker, if there is one.
+ * Returns true if the window's subtree will be walked by another walk.
  */
-static void
-display_tree_info_1 (struct wininfo *w, int recurse, int level)
+static int
+tree_pool_donate (struct tree_walk *walk, unsigned int index)
 {
-    int i, j;
-    unsigned int num_children;
-    xcb_query_tree_reply_t *tree;
-
-    tree = xcb_query_tree_reply (dpy, w->tree_cookie, &err);
-    if (!tree) {
-	print_x_error (dpy, err);
-	fatal_error ("Can't query window tree.");
+    struct tree_pool *pool = walk->pool;
+    struct tree_walk *sub;
+    int donated = 0;
+
+    if (pool == NULL)
+	return 0;
+
+    pthread_mutex_lock (&pool->lock);
+    if (pool->idle > pool->queued) {
+	sub = calloc (1, sizeof(struct tree_walk));
+	if (sub == NULL)
+	    fatal_error ("Failed to allocate memory in tree_pool_donate");
+	sub->recurse = 1;
+	sub->max_inflight = walk->max_inflight;
+	sub->root = walk->root;
+	sub->what = walk->what;
+	sub->max_depth = walk->max_depth;
+	sub->only_viewable = walk->only_viewable;
+	sub->pool = pool;
+	sub->start = walk->nodes[index].window;
+	sub->start_level = walk->nodes[index].level;
+	walk->nodes[index].subtree = sub;
+
+	sub->next = pool->queue;
+	pool->queue = sub;
+	pool->queued++;
+	pthread_cond_signal (&pool->cond);
+	donated = 1;
     }
+    pthread_mutex_unlock (&pool->lock);
 
-    if (level == 0) {
-	struct wininfo rw, pw;
-	rw.window = tree->root;
-	rw.net_wm_name_cookie = get_net_wm_name (dpy, rw.window);
-	rw.wm_name_cookie = xcb_icccm_get_wm_name (dpy, rw.window);
-	pw.window = tree->parent;
-	pw.net_wm_name_cookie = get_net_wm_name (dpy, pw.window);
-	pw.wm_name_cookie = xcb_icccm_get_wm_name (dpy, pw.window);
-	xcb_flush (dpy);
-
-	printf ("\n");
-	printf ("  Root window id: ");
-	display_window_id (&rw, 1);
-	printf ("  Parent window id: ");
-	display_window_id (&pw, 1);
-    }
+    return donated;
+}
 
-    num_children = xcb_query_tree_children_length (tree);
+/* Send the requests for everything we print about a window */
+static void
+tree_walk_send (struct tree_walk *walk, unsigned int index)
+{
+    xcb_window_t window = walk->nodes[index].window;
+    /* positions are worked out, and WM_NAME asked for at the end */
+    unsigned int what = walk->what & ~(WINQUERY_POSITION | WINQUERY_WM_NAME);
+
+    /* select first, so nothing that happens once we look goes unseen */
+    if (watch)
+	watch_select (walk->dpy, window, walk->recurse);
+    if (walk->recurse &&
+	(walk->max_depth == 0 || walk->nodes[index].level < walk->max_depth) &&
+	!tree_pool_donate (walk, index))
+	what |= WINQUERY_CHILDREN;
+    winquery_submit (walk->queries,
+		     &walk->pending[index % walk->max_pending],
+		     window, walk->root, what, NULL, NULL);
+    walk->num_sent = index + 1;
+}
 
-    if (level == 0  ||  num_children > 0) {
-	printf ("     ");
-	for (j = 0; j < level; j++) printf ("   ");
-	printf ("%d child%s%s\n", num_children, num_children == 1 ? "" : "ren",
-		num_children ? ":" : ".");
+/* Add the children of a window to the walk, after all the others */
+static void
+tree_walk_add_children (struct tree_walk *walk, unsigned int index,
+			const xcb_window_t *child_list,
+			unsigned int num_children)
+{
+    unsigned int i, child, level = walk->nodes[index].level + 1;
+
+    walk->nodes[index].first_child = walk->num_nodes;
+    walk->nodes[index].num_children = num_children;
+    for (i = 0; i < num_children; i++) {
+	child = tree_walk_add (walk, child_list[i]);
+	walk->nodes[child].level = level;
+	walk->nodes[child].parent = index;
     }
+}
 
-    if (num_children > 0) {
-	xcb_window_t *child_list = xcb_query_tree_children (tree);
-	struct wininfo *children
-	    = calloc (num_children, sizeof(struct wininfo));
-
-	if (children == NULL)
-	    fatal_error ("Failed to allocate memory in display_tree_info");
-
-	for (i = (int)num_children - 1; i >= 0; i--) {
-	    struct wininfo *cw = &children[i];
+/*
+ * Find where the inside of a window's parent is on the root, from the
+ * one TranslateCoordinates request of the walk if it is the window the
+ * walk started at.  Returns false if that isn't known.
+ */
+static int
+tree_walk_origin (struct tree_walk *walk, const struct tree_node *node,
+		  int *x, int *y)
+{
+    const struct tree_node *parent = &walk->nodes[node->parent];
 
-	    cw->window = child_list[i];
-	    cw->net_wm_name_cookie = get_net_wm_name (dpy, child_list[i]);
-	    cw->wm_name_cookie = xcb_icccm_get_wm_name (dpy, child_list[i]);
-	    cw->wm_class_cookie = xcb_icccm_get_wm_class (dpy, child_list[i]);
-	    cw->geometry_cookie = xcb_get_geometry (dpy, child_list[i]);
-	    cw->trans_coords_cookie = xcb_translate_coordinates
-		(dpy, child_list[i], tree->root, 0, 0);
-	    if (recurse)
-		cw->tree_cookie = xcb_query_tree (dpy, child_list[i]);
+    if (node->parent != 0) {
+	*x = parent->abs_x;
+	*y = parent->abs_y;
+	return parent->got_trans_coords;
+    }
+    if (walk->start_origin_cookie.sequence) {
+	xcb_translate_coordinates_reply_t *trans_coords;
+
+	trans_coords = xcb_translate_coordinates_reply
+	    (walk->dpy, walk->start_origin_cookie, NULL);
+	walk->start_origin_cookie.sequence = 0;
+	walk->start_origin = trans_coords ? 1 : -1;
+	if (trans_coords) {
+	    walk->start_x = (int16_t) trans_coords->dst_x;
+	    walk->start_y = (int16_t) trans_coords->dst_y;
+	    free (trans_coords);
 	}
-	xcb_flush (dpy);
+    }
+    *x = walk->start_x;
+    *y = walk->start_y;
+    return walk->start_origin == 1;
+}
 
-	for (i = (int)num_children - 1; i >= 0; i--) {
-	    struct wininfo *cw = &children[i];
-	    int got_wm_class = 0;
-	    char *instance_name = NULL, *class_name = NULL;
-	    int instance_name_len, class_name_len;
-	    xcb_icccm_get_wm_class_reply_t classhint;
-	    xcb_get_geometry_reply_t *geometry;
-
-	    printf ("     ");
-	    for (j = 0; j < level; j++) printf ("   ");
-	    display_window_id (cw, 0);
-	    printf (": (");
-
-	    if (xcb_icccm_get_wm_class_reply (dpy, cw->wm_class_cookie,
-					&classhint, NULL)) {
-		got_wm_class = 1;
-		instance_name = classhint.instance_name;
-		class_name = classhint.class_name;
-		instance_name_len = strlen(instance_name);
-		class_name_len = strlen(class_name);
-	    }
+/* Wait for the children of the window the walk started at */
+static void
+tree_walk_collect_start (struct tree_walk *walk)
+{
+    const xcb_query_tree_reply_t *tree = walk->start_tree;
+    xcb_generic_error_t *e;
+
+    if (walk->start_attr_cookie.sequence) {
+	xcb_get_window_attributes_reply_t *attr;
+	int viewable;
+
+	attr = xcb_get_window_attributes_reply (walk->dpy,
+						walk->start_attr_cookie, NULL);
+	viewable = attr && attr->map_state == XCB_MAP_STATE_VIEWABLE;
+	free (attr);
+	if (!viewable) {
+	    xcb_discard_reply (walk->dpy, walk->start_cookie.sequence);
+	    return;
+	}
+    }
+    if (!tree)
+	tree = xcb_query_tree_reply (walk->dpy, walk->start_cookie, &e);
+    if (!tree) {
+	walk->nodes[0].tree_failed = 1;
+	walk->nodes[0].tree_error = e;
+	return;
+    }
+    walk->root = tree->root;
+    walk->parent = tree->parent;
+    if ((walk->what & WINQUERY_POSITION) && tree->children_len > 0) {
+	/* goes out with the requests for the children */
+	if (tree->parent == XCB_WINDOW_NONE)
+	    walk->start_origin = 1;	/* the root */
+	else
+	    walk->start_origin_cookie = xcb_translate_coordinates
+		(walk->dpy, walk->nodes[0].window, walk->root, 0, 0);
+    }
+    tree_walk_add_children (walk, 0, xcb_query_tree_children (tree),
+			    xcb_query_tree_children_length (tree));
+    if (tree != walk->start_tree)
+	free ((void *) tree); /* includes storage for child_list[] */
+}
 
-	    if (got_wm_class) {
-		if (instance_name)
-		    printf ("\"%.*s\" ", instance_name_len, instance_name);
-		else
-		    printf ("(none) ");
+/* Wait for the oldest WM_NAME query of a walk and store the name */
+static void
+tree_walk_collect_wm_name (struct tree_walk *walk)
+{
+    struct tree_name_query *nq;
+    struct tree_node *node;
+
+    nq = &walk->names[walk->names_collected++ % walk->max_pending];
+    walk->in_flight--;
+    winquery_wait (walk->queries, &nq->query);
+    node = &walk->nodes[nq->index];
+    node->name.name = nq->query.result.name;
+    node->name.len = nq->query.result.name_len;
+    node->name.encoding = nq->query.result.name_encoding;
+    nq->query.result.name = NULL;
+    winquery_result_wipe (&nq->query.result);
+}
 
-		if (class_name)
-		    printf ("\"%.*s\") ",  class_name_len, class_name);
-		else
-		    printf ("(none)) ");
+/*
+ * Ask for the WM_NAME of a window found without a _NET_WM_NAME.  This
+ * goes out with the requests for the next windows, and the reply is
+ * taken in once theirs have been, when it is next on the connection.
+ * It is sent as the requests of a window are collected, so it never
+ * takes the requests in flight past max_inflight.
+ */
+static void
+tree_walk_send_wm_name (struct tree_walk *walk, unsigned int index)
+{
+    struct tree_name_query *nq;
+
+    if (walk->names_sent - walk->names_collected == walk->max_pending)
+	tree_walk_collect_wm_name (walk);
+    walk->in_flight++;
+    nq = &walk->names[walk->names_sent++ % walk->max_pending];
+    nq->index = index;
+    nq->after = walk->num_sent;
+    winquery_submit (walk->queries, &nq->query, walk->nodes[index].window,
+		     walk->root, WINQUERY_WM_NAME, NULL, NULL);
+}
 
-		xcb_icccm_get_wm_class_reply_wipe (&classhint);
-	    } else
-		printf (") ");
+/* Wait for the replies to a window's requests and store the results */
+static void
+tree_walk_collect (struct tree_walk *walk, unsigned int index)
+{
+    struct winquery *q = &walk->pending[index % walk->max_pending];
+    struct winquery_result *r = &q->result;
+    struct tree_node *node = &walk->nodes[index];
 
-	    geometry = xcb_get_geometry_reply(dpy, cw->geometry_cookie, &err);
-	    if (geometry) {
-		xcb_translate_coordinates_reply_t *trans_coords;
+    walk->in_flight -= walk->requests_per_window;
+    if (index == 0) {
+	tree_walk_collect_start (walk);
+	return;
+    }
+    winquery_wait (walk->queries, q);
+
+    /* the node takes over what the result allocated */
+    node->name.name = r->name;
+    node->name.len = r->name_len;
+    node->name.encoding = r->name_encoding;
+    node->got_wm_class = !!(r->got & WINQUERY_CLASS);
+    node->instance_name = r->instance_name;
+    node->class_name = r->class_name;
+    r->name = r->instance_name = r->class_name = NULL;
+
+    if (r->got & WINQUERY_GEOMETRY) {
+	node->got_geometry = 1;
+	node->x = r->x;
+	node->y = r->y;
+	node->width = r->width;
+	node->height = r->height;
+	node->border_width = r->border_width;
+	node->depth = r->depth;
+    }
+    if ((walk->what & WINQUERY_WM_NAME) &&
+	!(r->got & WINQUERY_NET_WM_NAME) && !r->error)
+	tree_walk_send_wm_name (walk, index);
+    if (node->got_geometry && (walk->what & WINQUERY_POSITION)) {
+	int x, y;
+
+	if (tree_walk_origin (walk, node, &x, &y)) {
+	    node->got_trans_coords = 1;
+	    node->abs_x = x + node->x + node->border_width;
+	    node->abs_y = y + node->y + node->border_width;
+	}
+    }
+    if (r->got & WINQUERY_ATTRIBUTES) {
+	node->got_attributes = 1;
+	node->map_state = r->attributes->map_state;
+    }
+    node->error = r->error;
+    r->error = NULL;
+
+    if (walk->only_viewable && node->map_state != XCB_MAP_STATE_VIEWABLE)
+	; /* nothing below it can be viewable, so its children are left out */
+    else if (r->got & WINQUERY_CHILDREN)
+	tree_walk_add_children (walk, index, r->children, r->num_children);
+    else if (r->asked & WINQUERY_CHILDREN) {
+	node->tree_failed = 1;
+	node->tree_error = r->tree_error;
+	r->tree_error = NULL;
+    }
+    winquery_result_wipe (r);
+}
 
-		printf (" %ux%u+%d+%d", geometry->width, geometry->height,
-					geometry->x, geometry->y);
+/*
+ * Walk the tree below a window whose QueryTree request has already been
+ * sent, or whose reply has been stored in start_tree.  Requests are sent
+ * for windows as soon as they are discovered, as long as no more than
+ * max_inflight requests are awaiting replies.  The
+ * cookies of those windows are kept in a ring of max_pending entries, so
+ * memory for outstanding requests stays bounded however wide the tree is.
+ */
+static void
+tree_walk_run (struct tree_walk *walk, xcb_window_t window,
+	       xcb_query_tree_cookie_t tree_cookie)
+{
+    unsigned int sent, collected, flushed = 0, synced = 0;
+    unsigned int requests_per_window = walk->recurse ? 1 : 0;
+    unsigned int what = walk->what & ~(WINQUERY_POSITION | WINQUERY_WM_NAME);
+    unsigned int bit;
+
+    for (bit = 1; bit <= what; bit <<= 1)
+	if (what & bit)
+	    requests_per_window++;
+    if (requests_per_window == 0)
+	requests_per_window = 1;
+
+    walk->requests_per_window = requests_per_window;
+    walk->in_flight = requests_per_window;	/* for the first window */
+    walk->max_pending = walk->max_inflight / requests_per_window;
+    if (walk->max_pending == 0)
+	walk->max_pending = 1;
+    walk->pending = calloc (walk->max_pending, sizeof(struct winquery));
+    walk->names = calloc (walk->max_pending, sizeof(struct tree_name_query));
+    if (walk->pending == NULL || walk->names == NULL)
+	fatal_error ("Failed to allocate memory in tree_walk_run");
+    walk->queries = winquery_new (walk->dpy, atom_net_wm_name,
+				  atom_utf8_string);
+
+    tree_walk_add (walk, window);
+    walk->nodes[0].level = walk->start_level;
+    walk->start_cookie = tree_cookie;
+
+    for (sent = 1, collected = 0; collected < walk->num_nodes; collected++) {
+	while (sent < walk->num_nodes && sent - collected < walk->max_pending) {
+	    if (walk->in_flight + requests_per_window > walk->max_inflight &&
+		sent > collected)
+		break;
+	    walk->in_flight += requests_per_window;
+	    tree_walk_send (walk, sent++);
+	}
 
-		trans_coords = xcb_translate_coordinates_reply
-		    (dpy, cw->trans_coords_cookie, &err);
+	/*
+	 * Flush before waiting on a request that may not be on the wire
+	 * yet, and whenever half the window has been refilled so the
+	 * server never runs dry while we are busy collecting replies.
+	 */
+	if (collected >= flushed || sent - flushed >= walk->max_pending / 2) {
+	    xcb_flush (walk->dpy);
+	    flushed = sent;
+	}
+	if (collected >= synced) {
+	    walk->round_trips++;
+	    synced = flushed;
+	}
 
-		if (trans_coords) {
-		    int16_t abs_x = (int16_t) trans_coords->dst_x;
-		    int16_t abs_y = (int16_t) trans_coords->dst_y;
-		    int border = geometry->border_width;
+	/* whose replies come before this window's */
+	while (walk->names_collected < walk->names_sent &&
+	       walk->names[walk->names_collected % walk->max_pending].after
+	       <= collected)
+	    tree_walk_collect_wm_name (walk);
+	tree_walk_collect (walk, collected);
+    }
+    if (walk->start_origin_cookie.sequence)
+	xcb_discard_reply (walk->dpy, walk->start_origin_cookie.sequence);
+    while (walk->names_collected < walk->names_sent)
+	tree_walk_collect_wm_name (walk);
+    profile_round_trips (walk->round_trips);
+
+    winquery_free (walk->queries);
+    walk->queries = NULL;
+    free (walk->pending);
+    walk->pending = NULL;
+    free (walk->names);
+    walk->names = NULL;
+}
 
-		    printf ("  +%d+%d", abs_x - border, abs_y - border);
-		    free (trans_coords);
-		} else if (err) {
-		    print_x_error (dpy, err);
-		}
+/*
+ * Walk queued subtrees on connection c until there are none left and no
+ * walk in progress could queue any more.
+ */
+static void
+tree_pool_work (struct tree_pool *pool, xcb_connection_t *c)
+{
+    struct tree_walk *walk;
+
+    pthread_mutex_lock (&pool->lock);
+    for (;;) {
+	while (pool->queue == NULL && pool->busy > 0) {
+	    pool->idle++;
+	    pthread_cond_wait (&pool->cond, &pool->lock);
+	    pool->idle--;
+	}
+	if (pool->queue == NULL)
+	    break;
 
-		free (geometry);
-	    } else if (err) {
-		print_x_error (dpy, err);
-	    }
-	    printf ("\n");
+	walk = pool->queue;
+	pool->queue = walk->next;
+	pool->queued--;
+	pool->busy++;
+	pthread_mutex_unlock (&pool->lock);
+
+	walk->dpy = c;
+	/* a subtree is only handed over before its top's map state is in */
+	if (walk->only_viewable)
+	    walk->start_attr_cookie =
+		xcb_get_window_attributes (c, walk->start);
+	tree_walk_run (walk, walk->start, xcb_query_tree (c, walk->start));
+
+	pthread_mutex_lock (&pool->lock);
+	pool->busy--;
+    }
+    pthread_cond_broadcast (&pool->cond);
+    pthread_mutex_unlock (&pool->lock);
+}
 
-	    if (recurse)
-		display_tree_info_1 (cw, 1, level+1);
+static void *
+tree_pool_worker (void *closure)
+{
+    struct tree_pool *pool = closure;
+    xcb_connection_t *c;
 
-	    wininfo_wipe (cw);
-	}
-	free (children);
-    }
+    setup_display_and_screen (display_name, &c, NULL);
+    tree_pool_work (pool, c);
+    xcb_disconnect (c);
 
-    free (tree); /* includes storage for child_list[] */
+    return NULL;
 }
 
-
 /*
- * Display a set of size hints
+ * Walk the tree on jobs connections: the main connection walks from the
+ * starting window and the workers take over subtrees as they go idle.
  */
 static void
-display_hints (xcb_size_hints_t *hints)
+tree_walk_parallel (struct tree_walk *walk, xcb_window_t window,
+		    xcb_query_tree_cookie_t tree_cookie)
 {
-    long flags;
+    struct tree_pool pool;
+    pthread_t *workers;
+    unsigned int i, started;
+
+    memset (&pool, 0, sizeof(struct tree_pool));
+    pthread_mutex_init (&pool.lock, NULL);
+    pthread_cond_init (&pool.cond, NULL);
+    pool.busy = 1;	/* the walk on the main connection */
+
+    workers = calloc (jobs - 1, sizeof(pthread_t));
+    if (workers == NULL)
+	fatal_error ("Failed to allocate memory in tree_walk_parallel");
+    for (started = 0; started < jobs - 1; started++) {
+	if (pthread_create (&workers[started], NULL,
+			    tree_pool_worker, &pool) != 0)
+	    break;
+    }
 
-    flags = hints->flags;
+    walk->pool = &pool;
+    tree_walk_run (walk, window, tree_cookie);
 
-    if (flags & XCB_ICCCM_SIZE_HINT_US_POSITION)
-	printf ("      User supplied location: %s, %s\n",
-		xscale (hints->x), yscale (hints->y));
+    pthread_mutex_lock (&pool.lock);
+    pool.busy--;
+    pthread_mutex_unlock (&pool.lock);
+    tree_pool_work (&pool, walk->dpy);
 
-    if (flags & XCB_ICCCM_SIZE_HINT_P_POSITION)
-	printf ("      Program supplied location: %s, %s\n",
-		xscale (hints->x), yscale (hints->y));
+    for (i = 0; i < started; i++)
+	pthread_join (workers[i], NULL);
+    free (workers);
 
-    if (flags & XCB_ICCCM_SIZE_HINT_US_SIZE) {
-	printf ("      User supplied size: %s by %s\n",
-		xscale (hints->width), yscale (hints->height));
+    pthread_cond_destroy (&pool.cond);
+    pthread_mutex_destroy (&pool.lock);
+}
+
+/* Frees all members of a tree_walk struct, but not the struct itself */
+static void
+tree_walk_wipe (struct tree_walk *walk)
+{
+    unsigned int i;
+
+    for (i = 0; i < walk->num_nodes; i++) {
+	struct tree_node *node = &walk->nodes[i];
+
+	free (node->name.name);
+	free (node->instance_name);
+	free (node->class_name);
+	free (node->error);
+	free (node->tree_error);
+	if (node->subtree) {
+	    tree_walk_wipe (node->subtree);
+	    free (node->subtree);
+	}
     }
+    free (walk->nodes);
+    winquery_free (walk->queries);
+    free (walk->pending);
+}
 
-    if (flags & XCB_ICCCM_SIZE_HINT_P_SIZE)
-	printf ("      Program supplied size: %s by %s\n",
-		xscale (hints->width), yscale (hints->height));
+/*
+ * -snapshot and -from-snapshot: see struct snapshot
+ */
+enum snapshot_count {
+    PER_WINDOW, PER_HINTS, PER_EXTENTS, PER_ATOM, PER_STRING_BYTE
+};
 
-    if (flags & XCB_ICCCM_SIZE_HINT_P_MIN_SIZE)
-	printf ("      Program supplied minimum size: %s by %s\n",
-		xscale (hints->min_width), yscale (hints->min_height));
+static const struct snapshot_column {
+    size_t			offset;	/* of the pointer in struct snapshot */
+    size_t			size;	/* of each element */
+    enum snapshot_count		count;
+} snapshot_columns[] = {
+#define COLUMN(field, count) \
+    { offsetof (struct snapshot, field), \
+      sizeof(*((struct snapshot *) 0)->field), count }
+    COLUMN (hints, PER_HINTS),
+    COLUMN (extents, PER_EXTENTS),
+    COLUMN (atoms, PER_ATOM),
+    COLUMN (atom_names, PER_ATOM),
+    COLUMN (window, PER_WINDOW),
+    COLUMN (parent, PER_WINDOW),
+    COLUMN (first_child, PER_WINDOW),
+    COLUMN (num_children, PER_WINDOW),
+    COLUMN (by_id, PER_WINDOW),
+    COLUMN (name, PER_WINDOW),
+    COLUMN (name_len, PER_WINDOW),
+    COLUMN (name_encoding, PER_WINDOW),
+    COLUMN (instance_name, PER_WINDOW),
+    COLUMN (class_name, PER_WINDOW),
+    COLUMN (normal_hints, PER_WINDOW),
+    COLUMN (zoom_hints, PER_WINDOW),
+    COLUMN (frame_extents, PER_WINDOW),
+    COLUMN (visual, PER_WINDOW),
+    COLUMN (colormap, PER_WINDOW),
+    COLUMN (all_event_masks, PER_WINDOW),
+    COLUMN (backing_planes, PER_WINDOW),
+    COLUMN (backing_pixel, PER_WINDOW),
+    COLUMN (x, PER_WINDOW),
+    COLUMN (y, PER_WINDOW),
+    COLUMN (abs_x, PER_WINDOW),
+    COLUMN (abs_y, PER_WINDOW),
+    COLUMN (width, PER_WINDOW),
+    COLUMN (height, PER_WINDOW),
+    COLUMN (border_width, PER_WINDOW),
+    COLUMN (do_not_propagate_mask, PER_WINDOW),
+    COLUMN (depth, PER_WINDOW),
+    COLUMN (win_class, PER_WINDOW),
+    COLUMN (bit_gravity, PER_WINDOW),
+    COLUMN (win_gravity, PER_WINDOW),
+    COLUMN (backing_store, PER_WINDOW),
+    COLUMN (save_under, PER_WINDOW),
+    COLUMN (map_is_installed, PER_WINDOW),
+    COLUMN (map_state, PER_WINDOW),
+    COLUMN (override_redirect, PER_WINDOW),
+    COLUMN (visual_class, PER_WINDOW),
+    COLUMN (flags, PER_WINDOW),
+    COLUMN (strings, PER_STRING_BYTE),
+#undef COLUMN
+};
+#define NUM_SNAPSHOT_COLUMNS \
+    (sizeof(snapshot_columns) / sizeof(snapshot_columns[0]))
 
-    if (flags & XCB_ICCCM_SIZE_HINT_P_MAX_SIZE)
-	printf ("      Program supplied maximum size: %s by %s\n",
-		xscale (hints->max_width), yscale (hints->max_height));
+#define snapshot_column_ptr(s, c) \
+    ((void **) ((char *) (s) + snapshot_columns[c].offset))
 
-    if (flags & XCB_ICCCM_SIZE_HINT_BASE_SIZE) {
-	printf ("      Program supplied base size: %s by %s\n",
-		xscale (hints->base_width), yscale (hints->base_height));
+/* Number of elements in a column of a snapshot with this header */
+static size_t
+snapshot_column_length (const struct snapshot_header *h, unsigned int c)
+{
+    switch (snapshot_columns[c].count) {
+    case PER_WINDOW:		return h->num_windows;
+    case PER_HINTS:		return h->num_hints;
+    case PER_EXTENTS:		return (size_t) h->num_extents * 4;
+    case PER_ATOM:		return h->num_atoms;
+    case PER_STRING_BYTE:	return h->strings_size;
     }
+    return 0;
+}
 
-    if (flags & XCB_ICCCM_SIZE_HINT_P_RESIZE_INC) {
-	printf ("      Program supplied x resize increment: %s\n",
-		xscale (hints->width_inc));
-	printf ("      Program supplied y resize increment: %s\n",
-		yscale (hints->height_inc));
-	if (hints->width_inc != 0 && hints->height_inc != 0) {
-	    if (flags & XCB_ICCCM_SIZE_HINT_US_SIZE)
-		printf ("      User supplied size in resize increments:  %s by %s\n",
-			(xscale (hints->width / hints->width_inc)),
-			(yscale (hints->height / hints->height_inc)));
-	    if (flags & XCB_ICCCM_SIZE_HINT_P_SIZE)
-		printf ("      Program supplied size in resize increments:  %s by %s\n",
-			(xscale (hints->width / hints->width_inc)),
-			(yscale (hints->height / hints->height_inc)));
-	    if (flags & XCB_ICCCM_SIZE_HINT_P_MIN_SIZE)
-		printf ("      Program supplied minimum size in resize increments: %s by %s\n",
-			xscale (hints->min_width / hints->width_inc), yscale (hints->min_height / hints->height_inc));
-	    if (flags & XCB_ICCCM_SIZE_HINT_BASE_SIZE)
-		printf ("      Program supplied base size in resize increments:  %s by %s\n",
-			(xscale (hints->base_width / hints->width_inc)),
-			(yscale (hints->base_height / hints->height_inc)));
-	}
-    }
+/* Offset of a column in the file, given where the previous one ended */
+static size_t
+snapshot_column_start (size_t end, unsigned int c)
+{
+    size_t align = snapshot_columns[c].size < 4 ? snapshot_columns[c].size : 4;
 
-    if (flags & XCB_ICCCM_SIZE_HINT_P_ASPECT) {
-	printf ("      Program supplied min aspect ratio: %s/%s\n",
-		xscale (hints->min_aspect_num), yscale (hints->min_aspect_den));
-	printf ("      Program supplied max aspect ratio: %s/%s\n",
-		xscale (hints->max_aspect_num), yscale (hints->max_aspect_den));
-    }
+    return (end + align - 1) & ~(align - 1);
+}
 
-    if (flags & XCB_ICCCM_SIZE_HINT_P_WIN_GRAVITY) {
-	printf ("      Program supplied window gravity: %s\n",
-		Lookup (hints->win_gravity, _gravities));
+/*
+ * Point the columns of s into a snapshot file mapped at base, of the given
+ * size.  Returns 0 if the file is too short for what its header says.
+ */
+static int
+snapshot_layout (struct snapshot *s, char *base, size_t size)
+{
+    size_t end = sizeof(struct snapshot_header);
+    unsigned int c;
+
+    s->header = (struct snapshot_header *) base;
+    for (c = 0; c < NUM_SNAPSHOT_COLUMNS; c++) {
+	size_t start = snapshot_column_start (end, c);
+	size_t length = snapshot_column_length (s->header, c);
+
+	if (start > size || length > (size - start) / snapshot_columns[c].size)
+	    return 0;
+	*snapshot_column_ptr (s, c) = base + start;
+	end = start + length * snapshot_columns[c].size;
     }
+    return 1;
 }
 
+/* Check a string offset, and length if not NUL terminated, of a snapshot */
+#define snapshot_string_ok(s, offset, len) \
+    ((offset) == SNAPSHOT_NONE || \
+     ((offset) < (s)->header->strings_size && \
+      (len) < (s)->header->strings_size - (offset)))
 
 /*
- * Display Size Hints info
+ * Check that every index and offset in a snapshot lies within it, so the
+ * display routines can trust it like a server reply
  */
-static void
-display_size_hints (struct wininfo *w)
+static int
+snapshot_valid (const struct snapshot *s)
 {
-    xcb_size_hints_t hints;
+    const struct snapshot_header *h = s->header;
+    uint32_t i, j, n = h->num_windows;
+
+    if (n == 0 || h->strings_size == 0 ||
+	s->strings[h->strings_size - 1] != '\0' ||
+	s->window[0] != h->root || s->parent[0] != SNAPSHOT_NONE)
+	return 0;
+    for (i = 0; i < h->num_atoms; i++)
+	if (!snapshot_string_ok (s, s->atom_names[i], 0) ||
+	    s->atom_names[i] == SNAPSHOT_NONE)
+	    return 0;
+    for (i = 0; i < n; i++) {
+	if (s->first_child[i] > n || s->num_children[i] > n - s->first_child[i]
+	    || s->by_id[i] >= n
+	    || (i > 0 && s->parent[i] >= i)
+	    || !snapshot_string_ok (s, s->name[i], s->name_len[i])
+	    || !snapshot_string_ok (s, s->instance_name[i], 0)
+	    || !snapshot_string_ok (s, s->class_name[i], 0)
+	    || (s->normal_hints[i] != SNAPSHOT_NONE
+		&& s->normal_hints[i] >= h->num_hints)
+	    || (s->zoom_hints[i] != SNAPSHOT_NONE
+		&& s->zoom_hints[i] >= h->num_hints)
+	    || (s->frame_extents[i] != SNAPSHOT_NONE
+		&& s->frame_extents[i] >= h->num_extents))
+	    return 0;
+	if (i > 0 && s->window[s->by_id[i - 1]] >= s->window[s->by_id[i]])
+	    return 0;
+	for (j = 0; j < s->num_children[i]; j++)
+	    if (s->parent[s->first_child[i] + j] != i)
+		return 0;
+	/* we can only name encodings we have the names of */
+	if (s->name[i] != SNAPSHOT_NONE &&
+	    s->name_encoding[i] != XCB_ATOM_STRING &&
+	    s->name_encoding[i] != h->utf8_string) {
+	    for (j = 0; j < h->num_atoms; j++)
+		if (s->atoms[j] == s->name_encoding[i])
+		    break;
+	    if (j == h->num_atoms)
+		return 0;
+	}
+    }
+    return 1;
+}
 
-    printf ("\n");
+/*
+ * Map a snapshot written by -snapshot, and set things up so the display
+ * routines take what they would ask the server for from it instead
+ */
+static void
+load_snapshot (const char *file)
+{
+    static struct snapshot s;
+    static xcb_screen_t snapshot_screen;
+    struct stat st;
+    void *map;
+    uint32_t i;
+    int fd;
+
+    fd = open (file, O_RDONLY);
+    if (fd < 0)
+	fatal_error ("Can't open snapshot %s: %s", file, strerror (errno));
+    if (fstat (fd, &st) < 0)
+	fatal_error ("Can't read snapshot %s: %s", file, strerror (errno));
+    if (st.st_size < (off_t) sizeof(struct snapshot_header))
+	fatal_error ("%s is not a snapshot.", file);
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED)
+	fatal_error ("Can't map snapshot %s: %s", file, strerror (errno));
+
+    if (memcmp (map, SNAPSHOT_MAGIC, sizeof(s.header->magic)) ||
+	!snapshot_layout (&s, map, st.st_size) || !snapshot_valid (&s))
+	fatal_error ("%s is not a snapshot.", file);
+    snapshot = &s;
+
+    snapshot_screen.root = s.header->root;
+    snapshot_screen.width_in_pixels = s.header->width_in_pixels;
+    snapshot_screen.height_in_pixels = s.header->height_in_pixels;
+    snapshot_screen.width_in_millimeters = s.header->width_in_millimeters;
+    snapshot_screen.height_in_millimeters = s.header->height_in_millimeters;
+    screen = &snapshot_screen;
+
+    atom_utf8_string = s.header->utf8_string;
+    for (i = 0; i < s.header->num_atoms; i++)
+	add_atom_name (s.atoms[i], s.strings + s.atom_names[i]);
+}
+
+/* Index of a window in the snapshot, or SNAPSHOT_NONE if it isn't there */
+static uint32_t
+snapshot_find (xcb_window_t window)
+{
+    uint32_t lo = 0, hi = snapshot->header->num_windows;
+
+    while (lo < hi) {
+	uint32_t mid = lo + (hi - lo) / 2;
+	xcb_window_t w = snapshot->window[snapshot->by_id[mid]];
+
+	if (w == window)
+	    return snapshot->by_id[mid];
+	if (w < window)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return SNAPSHOT_NONE;
+}
+
+/* The snapshot's contents in the form of server replies, NULL if absent */
+static xcb_get_geometry_reply_t *
+snapshot_geometry (uint32_t i)
+{
+    xcb_get_geometry_reply_t *geometry;
+
+    if (i == SNAPSHOT_NONE || !(snapshot->flags[i] & SNAPSHOT_GOT_GEOMETRY))
+	return NULL;
+    geometry = calloc (1, sizeof(xcb_get_geometry_reply_t));
+    if (geometry == NULL)
+	fatal_error ("Failed to allocate memory in snapshot_geometry");
+    geometry->depth = snapshot->depth[i];
+    geometry->root = snapshot->header->root;
+    geometry->x = snapshot->x[i];
+    geometry->y = snapshot->y[i];
+    geometry->width = snapshot->width[i];
+    geometry->height = snapshot->height[i];
+    geometry->border_width = snapshot->border_width[i];
+    return geometry;
+}
+
+static xcb_get_window_attributes_reply_t *
+snapshot_attributes (uint32_t i)
+{
+    xcb_get_window_attributes_reply_t *attr;
+
+    if (i == SNAPSHOT_NONE || !(snapshot->flags[i] & SNAPSHOT_GOT_ATTRIBUTES))
+	return NULL;
+    attr = calloc (1, sizeof(xcb_get_window_attributes_reply_t));
+    if (attr == NULL)
+	fatal_error ("Failed to allocate memory in snapshot_attributes");
+    attr->backing_store = snapshot->backing_store[i];
+    attr->visual = snapshot->visual[i];
+    attr->_class = snapshot->win_class[i];
+    attr->bit_gravity = snapshot->bit_gravity[i];
+    attr->win_gravity = snapshot->win_gravity[i];
+    attr->backing_planes = snapshot->backing_planes[i];
+    attr->backing_pixel = snapshot->backing_pixel[i];
+    attr->save_under = snapshot->save_under[i];
+    attr->map_is_installed = snapshot->map_is_installed[i];
+    attr->map_state = snapshot->map_state[i];
+    attr->override_redirect = snapshot->override_redirect[i];
+    attr->colormap = snapshot->colormap[i];
+    attr->all_event_masks = snapshot->all_event_masks[i];
+    attr->do_not_propagate_mask = snapshot->do_not_propagate_mask[i];
+    return attr;
+}
+
+static xcb_query_tree_reply_t *
+snapshot_tree (uint32_t i)
+{
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    uint32_t j, n = snapshot->num_children[i];
+
+    /* laid out as the server sends it: the children follow the reply */
+    tree = calloc (1, sizeof(xcb_query_tree_reply_t) +
+		   n * sizeof(xcb_window_t));
+    if (tree == NULL)
+	fatal_error ("Failed to allocate memory in snapshot_tree");
+    tree->root = snapshot->header->root;
+    if (snapshot->parent[i] != SNAPSHOT_NONE)
+	tree->parent = snapshot->window[snapshot->parent[i]];
+    tree->children_len = n;
+    tree->length = n;
+    children = xcb_query_tree_children (tree);
+    for (j = 0; j < n; j++)
+	children[j] = snapshot->window[snapshot->first_child[i] + j];
+    return tree;
+}
+
+static xcb_get_property_reply_t *
+snapshot_frame_extents (uint32_t i)
+{
+    xcb_get_property_reply_t *prop;
+
+    if (i == SNAPSHOT_NONE || snapshot->frame_extents[i] == SNAPSHOT_NONE)
+	return NULL;
+    prop = calloc (1, sizeof(xcb_get_property_reply_t) + 4 * 4);
+    if (prop == NULL)
+	fatal_error ("Failed to allocate memory in snapshot_frame_extents");
+    prop->type = XCB_ATOM_CARDINAL;
+    prop->format = 32;
+    prop->value_len = 4;
+    prop->length = 4;
+    memcpy (xcb_get_property_value (prop),
+	    snapshot->extents + snapshot->frame_extents[i] * 4, 4 * 4);
+    return prop;
+}
+
+/* Copy size hints out of the snapshot, returning 0 if there are none */
+static int
+snapshot_size_hints (const uint32_t *column, uint32_t i,
+		     xcb_size_hints_t *hints_return)
+{
+    if (i == SNAPSHOT_NONE || column[i] == SNAPSHOT_NONE)
+	return 0;
+    memcpy (hints_return, &snapshot->hints[column[i]],
+	    sizeof(xcb_size_hints_t));
+    return 1;
+}
+
+/*
+ * Fill in a walk from the snapshot, as tree_walk_run() would have from
+ * the server
+ */
+static void
+snapshot_walk (struct tree_walk *walk, xcb_window_t window, int recurse)
+{
+    unsigned int index;
+    uint32_t i, j;
+
+    i = snapshot_find (window);
+    walk->recurse = recurse;
+    walk->root = snapshot->header->root;
+    if (snapshot->parent[i] != SNAPSHOT_NONE)
+	walk->parent = snapshot->window[snapshot->parent[i]];
+    tree_walk_add (walk, window);
+
+    for (index = 0; index < walk->num_nodes; index++) {
+	struct tree_node *node;
+	unsigned int first_child = walk->num_nodes;
+	unsigned int level = walk->nodes[index].level;
+	uint32_t num_children;
+	int viewable;
+
+	i = snapshot_find (walk->nodes[index].window);
+	viewable = (snapshot->flags[i] & SNAPSHOT_GOT_ATTRIBUTES) &&
+	    snapshot->map_state[i] == XCB_MAP_STATE_VIEWABLE;
+	if (index == 0)
+	    num_children = snapshot->num_children[i];
+	else if (!recurse || (walk->max_depth && level >= walk->max_depth) ||
+		 (walk->only_viewable && !viewable))
+	    num_children = 0;
+	else
+	    num_children = snapshot->num_children[i];
+	for (j = 0; j < num_children; j++) {
+	    unsigned int child = tree_walk_add (walk,
+		snapshot->window[snapshot->first_child[i] + j]);
+
+	    walk->nodes[child].level = level + 1;
+	}
+
+	node = &walk->nodes[index];
+	node->first_child = first_child;
+	node->num_children = num_children;
+	if (snapshot->flags[i] & SNAPSHOT_GOT_ATTRIBUTES) {
+	    node->got_attributes = 1;
+	    node->map_state = snapshot->map_state[i];
+	}
+	if (snapshot->name[i] != SNAPSHOT_NONE)
+	    set_window_name (&node->name, snapshot->strings + snapshot->name[i],
+			     snapshot->name_len[i], snapshot->name_encoding[i]);
+	if (snapshot->flags[i] & SNAPSHOT_GOT_WM_CLASS) {
+	    node->got_wm_class = 1;
+	    if (snapshot->instance_name[i] != SNAPSHOT_NONE)
+		node->instance_name =
+		    strdup (snapshot->strings + snapshot->instance_name[i]);
+	    if (snapshot->class_name[i] != SNAPSHOT_NONE)
+		node->class_name =
+		    strdup (snapshot->strings + snapshot->class_name[i]);
+	}
+	if (snapshot->flags[i] & SNAPSHOT_GOT_GEOMETRY) {
+	    node->got_geometry = 1;
+	    node->x = snapshot->x[i];
+	    node->y = snapshot->y[i];
+	    node->width = snapshot->width[i];
+	    node->height = snapshot->height[i];
+	    node->border_width = snapshot->border_width[i];
+	}
+	if (snapshot->flags[i] & SNAPSHOT_GOT_TRANS_COORDS) {
+	    node->got_trans_coords = 1;
+	    node->abs_x = snapshot->abs_x[i];
+	    node->abs_y = snapshot->abs_y[i];
+	}
+    }
+}
+
+/*
+ * Find a window by name in the snapshot, looking at windows in the same
+ * order window_with_name() does
+ */
+static xcb_window_t
+snapshot_window_with_name_1 (uint32_t i, const char *name, size_t namelen)
+{
+    uint32_t j;
+    xcb_window_t w;
+
+    if (snapshot->name[i] != SNAPSHOT_NONE && snapshot->name_len[i] == namelen
+	&& memcmp (snapshot->strings + snapshot->name[i], name, namelen) == 0)
+	return snapshot->window[i];
+
+    for (j = 0; j < snapshot->num_children[i]; j++) {
+	w = snapshot_window_with_name_1 (snapshot->first_child[i] + j,
+					 name, namelen);
+	if (w)
+	    return w;
+    }
+    return 0;
+}
+
+static xcb_window_t
+snapshot_window_with_name (const char *name)
+{
+    return snapshot_window_with_name_1 (0, name, strlen (name));
+}
+
+/*
+ * Writing a snapshot: the columns are filled in from a walk of the whole
+ * tree, plus one pass over all its windows for what the walk doesn't ask
+ * for, then written out in the order snapshot_layout() expects.
+ */
+struct snapshot_writer {
+    struct snapshot		s;
+    struct snapshot_header	h;
+    size_t			hints_size, extents_size;
+    size_t			atoms_size, strings_alloc;
+};
+
+/* Make room for one more element in a growable table */
+static void *
+snapshot_grow (void *table, size_t *size, uint32_t count, size_t element)
+{
+    if (count == *size) {
+	*size = *size ? *size * 2 : 64;
+	table = realloc (table, *size * element);
+	if (table == NULL)
+	    fatal_error ("Failed to allocate memory in snapshot_grow");
+    }
+    return table;
+}
+
+/* Add a string to the string table, returning its offset */
+static uint32_t
+snapshot_add_string (struct snapshot_writer *sw, const char *str, size_t len)
+{
+    uint32_t offset = sw->h.strings_size;
+
+    while (sw->h.strings_size + len + 1 > sw->strings_alloc) {
+	sw->strings_alloc = sw->strings_alloc ? sw->strings_alloc * 2 : 4096;
+	sw->s.strings = realloc (sw->s.strings, sw->strings_alloc);
+	if (sw->s.strings == NULL)
+	    fatal_error ("Failed to allocate memory in snapshot_add_string");
+    }
+    memcpy (sw->s.strings + offset, str, len);
+    sw->s.strings[offset + len] = '\0';
+    sw->h.strings_size += len + 1;
+    return offset;
+}
+
+static uint32_t
+snapshot_add_hints (struct snapshot_writer *sw, const xcb_size_hints_t *hints)
+{
+    sw->s.hints = snapshot_grow (sw->s.hints, &sw->hints_size,
+				 sw->h.num_hints, sizeof(xcb_size_hints_t));
+    sw->s.hints[sw->h.num_hints] = *hints;
+    return sw->h.num_hints++;
+}
+
+/* Record the name of a name's encoding, if it isn't one we convert */
+static void
+snapshot_add_encoding (struct snapshot_writer *sw, xcb_atom_t encoding)
+{
+    const char *name;
+    uint32_t i;
+
+    if (encoding == XCB_ATOM_STRING || encoding == atom_utf8_string)
+	return;
+    for (i = 0; i < sw->h.num_atoms; i++)
+	if (sw->s.atoms[i] == encoding)
+	    return;
+    name = get_atom_name (dpy, encoding);
+    if (name == NULL)
+	return;
+
+    sw->s.atoms = snapshot_grow (sw->s.atoms, &sw->atoms_size,
+				 sw->h.num_atoms, sizeof(uint32_t));
+    sw->s.atom_names = realloc (sw->s.atom_names,
+				sw->atoms_size * sizeof(uint32_t));
+    if (sw->s.atom_names == NULL)
+	fatal_error ("Failed to allocate memory in snapshot_add_encoding");
+    sw->s.atoms[sw->h.num_atoms] = encoding;
+    sw->s.atom_names[sw->h.num_atoms] =
+	snapshot_add_string (sw, name, strlen (name));
+    sw->h.num_atoms++;
+}
+
+/* Fill in the columns of one window from what the walk found */
+static void
+snapshot_add_node (struct snapshot_writer *sw, uint32_t i,
+		   const struct tree_node *node)
+{
+    struct snapshot *s = &sw->s;
+
+    s->window[i] = node->window;
+    s->first_child[i] = node->first_child;
+    s->num_children[i] = node->num_children;
+    s->name[i] = s->instance_name[i] = s->class_name[i] = SNAPSHOT_NONE;
+    if (node->name.len > 0) {
+	s->name[i] = snapshot_add_string (sw, node->name.name, node->name.len);
+	s->name_len[i] = node->name.len;
+	s->name_encoding[i] = node->name.encoding;
+	snapshot_add_encoding (sw, node->name.encoding);
+    }
+    if (node->got_wm_class) {
+	s->flags[i] |= SNAPSHOT_GOT_WM_CLASS;
+	if (node->instance_name)
+	    s->instance_name[i] = snapshot_add_string
+		(sw, node->instance_name, strlen (node->instance_name));
+	if (node->class_name)
+	    s->class_name[i] = snapshot_add_string
+		(sw, node->class_name, strlen (node->class_name));
+    }
+    if (node->got_geometry) {
+	s->flags[i] |= SNAPSHOT_GOT_GEOMETRY;
+	s->x[i] = node->x;
+	s->y[i] = node->y;
+	s->width[i] = node->width;
+	s->height[i] = node->height;
+	s->border_width[i] = node->border_width;
+	s->depth[i] = node->depth;
+    }
+    if (node->got_trans_coords) {
+	s->flags[i] |= SNAPSHOT_GOT_TRANS_COORDS;
+	s->abs_x[i] = node->abs_x;
+	s->abs_y[i] = node->abs_y;
+    }
+}
+
+/* Send the requests for what the walk didn't ask for about a window */
+static void
+snapshot_send (struct wininfo *cw, xcb_window_t window)
+{
+    memset (cw, 0, sizeof(struct wininfo));
+    cw->window = window;
+    cw->attr_cookie = xcb_get_window_attributes (dpy, window);
+    cw->normal_hints_cookie = xcb_icccm_get_wm_normal_hints (dpy, window);
+    cw->zoom_cookie = xcb_icccm_get_wm_size_hints (dpy, window,
+						   XCB_ATOM_WM_ZOOM_HINTS);
+    if (atom_net_frame_extents)
+	cw->frame_extents_cookie = xcb_get_property
+	    (dpy, 0, window, atom_net_frame_extents, XCB_ATOM_CARDINAL, 0, 4);
+}
+
+static void
+snapshot_collect (struct snapshot_writer *sw, uint32_t i, struct wininfo *cw)
+{
+    struct snapshot *s = &sw->s;
+    xcb_get_window_attributes_reply_t *attr;
+    xcb_get_property_reply_t *extents;
+    xcb_visualtype_t *visual_type;
+    xcb_size_hints_t hints;
+
+    s->normal_hints[i] = s->zoom_hints[i] = s->frame_extents[i] = SNAPSHOT_NONE;
+    s->visual_class[i] = 0xFF;
+
+    attr = xcb_get_window_attributes_reply (dpy, cw->attr_cookie, NULL);
+    if (attr) {
+	s->flags[i] |= SNAPSHOT_GOT_ATTRIBUTES;
+	s->backing_store[i] = attr->backing_store;
+	s->visual[i] = attr->visual;
+	s->win_class[i] = attr->_class;
+	s->bit_gravity[i] = attr->bit_gravity;
+	s->win_gravity[i] = attr->win_gravity;
+	s->backing_planes[i] = attr->backing_planes;
+	s->backing_pixel[i] = attr->backing_pixel;
+	s->save_under[i] = attr->save_under;
+	s->map_is_installed[i] = attr->map_is_installed;
+	s->map_state[i] = attr->map_state;
+	s->override_redirect[i] = attr->override_redirect;
+	s->colormap[i] = attr->colormap;
+	s->all_event_masks[i] = attr->all_event_masks;
+	s->do_not_propagate_mask[i] = attr->do_not_propagate_mask;
+	visual_type = find_visual_type (attr->visual);
+	if (visual_type)
+	    s->visual_class[i] = visual_type->_class;
+	free (attr);
+    }
+
+    if (xcb_icccm_get_wm_normal_hints_reply (dpy, cw->normal_hints_cookie,
+					     &hints, NULL))
+	s->normal_hints[i] = snapshot_add_hints (sw, &hints);
+    if (xcb_icccm_get_wm_size_hints_reply (dpy, cw->zoom_cookie,
+					   &hints, NULL))
+	s->zoom_hints[i] = snapshot_add_hints (sw, &hints);
+
+    if (cw->frame_extents_cookie.sequence) {
+	extents = xcb_get_property_reply (dpy, cw->frame_extents_cookie, NULL);
+	if (extents && (extents->type == XCB_ATOM_CARDINAL)
+	    && (extents->format == 32) && (extents->value_len == 4)) {
+	    sw->s.extents = snapshot_grow (sw->s.extents, &sw->extents_size,
+					   sw->h.num_extents,
+					   4 * sizeof(uint32_t));
+	    memcpy (sw->s.extents + sw->h.num_extents * 4,
+		    xcb_get_property_value (extents), 4 * sizeof(uint32_t));
+	    s->frame_extents[i] = sw->h.num_extents++;
+	}
+	free (extents);
+    }
+}
+
+static int
+snapshot_compare_ids (const void *a, const void *b)
+{
+    uint64_t ia = *(const uint64_t *) a, ib = *(const uint64_t *) b;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+/* Walk the whole tree and write it to a snapshot file */
+static void
+write_snapshot (const char *file)
+{
+    static const char zeros[4];
+    struct snapshot_writer sw;
+    struct tree_walk walk;
+    struct tree_node top;
+    struct wininfo rw, *ring;
+    xcb_get_geometry_reply_t *geometry;
+    uint64_t *ids;
+    uint32_t i, n, sent, max_pending;
+    size_t end;
+    unsigned int c;
+    char *tmp_path;
+    FILE *out;
+    int fd, written = 1, error;
+
+    atom_net_frame_extents = get_atom (dpy, "_NET_FRAME_EXTENTS");
+    atom_net_wm_name = get_atom (dpy, "_NET_WM_NAME");
+    atom_utf8_string = get_atom (dpy, "UTF8_STRING");
+
+    /* The walk only fetches the children, so ask about the root too */
+    memset (&rw, 0, sizeof(struct wininfo));
+    rw.window = screen->root;
+    rw.geometry_cookie = xcb_get_geometry (dpy, rw.window);
+    rw.net_wm_name_cookie = get_net_wm_name (dpy, rw.window);
+    rw.wm_name_cookie = xcb_icccm_get_wm_name (dpy, rw.window);
+    rw.wm_class_cookie = xcb_icccm_get_wm_class (dpy, rw.window);
+
+    memset (&walk, 0, sizeof(struct tree_walk));
+    walk.dpy = dpy;
+    walk.recurse = 1;
+    walk.max_inflight = max_inflight;
+    walk.what = TREE_FIELDS_ALL;
+    tree_walk_run (&walk, rw.window, xcb_query_tree (dpy, rw.window));
+    n = walk.num_nodes;
+
+    memset (&sw, 0, sizeof(struct snapshot_writer));
+    memcpy (sw.h.magic, SNAPSHOT_MAGIC, sizeof(sw.h.magic));
+    sw.h.num_windows = n;
+    profile_windows (n);
+    sw.h.root = screen->root;
+    sw.h.utf8_string = atom_utf8_string;
+    sw.h.width_in_pixels = screen->width_in_pixels;
+    sw.h.height_in_pixels = screen->height_in_pixels;
+    sw.h.width_in_millimeters = screen->width_in_millimeters;
+    sw.h.height_in_millimeters = screen->height_in_millimeters;
+    for (c = 0; c < NUM_SNAPSHOT_COLUMNS; c++) {
+	if (snapshot_columns[c].count != PER_WINDOW)
+	    continue;
+	*snapshot_column_ptr (&sw.s, c) = calloc (n, snapshot_columns[c].size);
+	if (*snapshot_column_ptr (&sw.s, c) == NULL)
+	    fatal_error ("Failed to allocate memory in write_snapshot");
+    }
+
+    memset (&top, 0, sizeof(struct tree_node));
+    top = walk.nodes[0];
+    fetch_window_name (dpy, &rw, &top.name);
+    geometry = xcb_get_geometry_reply (dpy, rw.geometry_cookie, NULL);
+    if (geometry) {
+	top.got_geometry = top.got_trans_coords = 1;
+	top.x = top.abs_x = geometry->x;
+	top.y = top.abs_y = geometry->y;
+	top.width = geometry->width;
+	top.height = geometry->height;
+	top.border_width = geometry->border_width;
+	top.depth = geometry->depth;
+	free (geometry);
+    }
+    xcb_discard_reply (dpy, rw.wm_class_cookie.sequence);
+    snapshot_add_node (&sw, 0, &top);
+    free (top.name.name);
+    sw.s.parent[0] = SNAPSHOT_NONE;
+    for (i = 1; i < n; i++)
+	snapshot_add_node (&sw, i, &walk.nodes[i]);
+    for (i = 0; i < n; i++) {
+	uint32_t j;
+
+	for (j = 0; j < sw.s.num_children[i]; j++)
+	    sw.s.parent[sw.s.first_child[i] + j] = i;
+    }
+
+    /* Ask about windows in a bounded ring, as the walk does */
+    max_pending = max_inflight / 4;
+    if (max_pending == 0)
+	max_pending = 1;
+    ring = calloc (max_pending, sizeof(struct wininfo));
+    if (ring == NULL)
+	fatal_error ("Failed to allocate memory in write_snapshot");
+    for (sent = 0, i = 0; i < n; i++) {
+	if (i == sent) {
+	    for (; sent < n && sent - i < max_pending; sent++)
+		snapshot_send (&ring[sent % max_pending], sw.s.window[sent]);
+	    xcb_flush (dpy);
+	}
+	snapshot_collect (&sw, i, &ring[i % max_pending]);
+    }
+    free (ring);
+    tree_walk_wipe (&walk);
+
+    /* Index the windows by id for -from-snapshot -id */
+    ids = malloc (n * sizeof(uint64_t));
+    if (ids == NULL)
+	fatal_error ("Failed to allocate memory in write_snapshot");
+    for (i = 0; i < n; i++)
+	ids[i] = ((uint64_t) sw.s.window[i] << 32) | i;
+    qsort (ids, n, sizeof(uint64_t), snapshot_compare_ids);
+    for (i = 0; i < n; i++)
+	sw.s.by_id[i] = (uint32_t) ids[i];
+    free (ids);
+
+    /* Write to a new file and move it into place, so readers never see half */
+    tmp_path = malloc (strlen (file) + sizeof(".XXXXXX"));
+    if (tmp_path == NULL)
+	fatal_error ("Failed to allocate memory in write_snapshot");
+    sprintf (tmp_path, "%s.XXXXXX", file);
+    fd = mkstemp (tmp_path);
+    if (fd < 0)
+	fatal_error ("Can't create snapshot %s: %s", file, strerror (errno));
+    out = fdopen (fd, "w");
+    if (out == NULL) {
+	error = errno;
+	close (fd);
+	unlink (tmp_path);
+	fatal_error ("Can't create snapshot %s: %s", file, strerror (error));
+    }
+
+    if (fwrite (&sw.h, sizeof(sw.h), 1, out) != 1)
+	written = 0;
+    end = sizeof(sw.h);
+    for (c = 0; c < NUM_SNAPSHOT_COLUMNS; c++) {
+	size_t start = snapshot_column_start (end, c);
+	size_t length = snapshot_column_length (&sw.h, c);
+
+	if (fwrite (zeros, 1, start - end, out) != start - end)
+	    written = 0;
+	if (length > 0 &&
+	    fwrite (*snapshot_column_ptr (&sw.s, c), snapshot_columns[c].size,
+		    length, out) != length)
+	    written = 0;
+	end = start + length * snapshot_columns[c].size;
+	free (*snapshot_column_ptr (&sw.s, c));
+    }
+    if (!written || ferror (out)) {
+	error = errno;
+	fclose (out);
+	unlink (tmp_path);
+	fatal_error ("Can't write snapshot %s: %s", file, strerror (error));
+    }
+    if (fclose (out) != 0 || rename (tmp_path, file) != 0) {
+	error = errno;
+	unlink (tmp_path);
+	fatal_error ("Can't write snapshot %s: %s", file, strerror (error));
+    }
+    free (tmp_path);
+}
+
+/*
+ * Display the line describing one child window in the tree
+ */
+static void
+display_tree_node (struct tree_node *node)
+{
+    profile_windows (1);
+    if (tree_fields & WINQUERY_NAME)
+	print_window_id (node->window, &node->name, 0);
+    else if (window_id_format_dec)
+	out_uint (node->window);
+    else
+	out_hex (node->window);
+    if (!(tree_fields & ~WINQUERY_NAME))
+	return;
+    out_char (':');
+
+    if (tree_fields & WINQUERY_CLASS) {
+	out_write (" (", 2);
+	if (node->got_wm_class) {
+	    if (node->instance_name) {
+		out_char ('"');
+		out_str (node->instance_name);
+		out_write ("\" ", 2);
+	    } else
+		out_write ("(none) ", 7);
+
+	    if (node->class_name) {
+		out_char ('"');
+		out_str (node->class_name);
+		out_write ("\")", 2);
+	    } else
+		out_write ("(none))", 7);
+	} else
+	    out_char (')');
+	if (tree_fields & WINQUERY_GEOMETRY)
+	    out_char (' ');
+    }
+
+    if (node->got_geometry) {
+	if (tree_fields & WINQUERY_GEOMETRY) {
+	    out_char (' ');
+	    out_uint (node->width);
+	    out_char ('x');
+	    out_uint (node->height);
+	    out_char ('+');
+	    out_int (node->x);
+	    out_char ('+');
+	    out_int (node->y);
+	}
+
+	if (!(tree_fields & WINQUERY_POSITION))
+	    ;
+	else if (node->got_trans_coords) {
+	    int border = node->border_width;
+
+	    out_str ((tree_fields & WINQUERY_GEOMETRY) ? "  +" : " +");
+	    out_int (node->abs_x - border);
+	    out_char ('+');
+	    out_int (node->abs_y - border);
+	} else if (node->error) {
+	    print_x_error (dpy, node->error);
+	}
+	if ((metric || english) && (tree_fields & WINQUERY_GEOMETRY))
+	    display_scaled_size (node->width, node->height);
+    } else if (node->error) {
+	print_x_error (dpy, node->error);
+    }
+}
+
+/*
+ * The requests to send about each window a walk finds: those for the
+ * fields printed, plus those for what the filters look at
+ */
+static unsigned int
+tree_fields_plan (void)
+{
+    unsigned int what = tree_fields;
+
+    /* positions are printed from the outside of the border */
+    if (what & WINQUERY_POSITION)
+	what |= WINQUERY_GEOMETRY;
+    if (only_viewable)
+	what |= WINQUERY_ATTRIBUTES;
+    if (class_pattern)
+	what |= WINQUERY_CLASS;
+    if (min_width || min_height)
+	what |= WINQUERY_GEOMETRY;
+    return what;
+}
+
+/* Whether a window found by a walk passes -only-viewable, -class and -min-size */
+static int
+tree_node_matches (const struct tree_node *node)
+{
+    if (only_viewable && node->map_state != XCB_MAP_STATE_VIEWABLE)
+	return 0;
+    if (class_pattern &&
+	!(node->instance_name &&
+	  fnmatch (class_pattern, node->instance_name, 0) == 0) &&
+	!(node->class_name &&
+	  fnmatch (class_pattern, node->class_name, 0) == 0))
+	return 0;
+    if ((min_width || min_height) &&
+	!(node->got_geometry &&
+	  node->width >= min_width && node->height >= min_height))
+	return 0;
+    return 1;
+}
+
+/*
+ * Work out which windows of a walk are printed, from the bottom up: those
+ * that match, and those that have to be to show where one that matches is.
+ */
+static void
+tree_walk_filter (struct tree_walk *walk)
+{
+    unsigned int i, j;
+
+    for (i = walk->num_nodes; i-- > 0; ) {
+	struct tree_node *node = &walk->nodes[i];
+	struct tree_walk *sub = walk;
+	struct tree_node *below = node;
+
+	if (node->subtree) {
+	    sub = node->subtree;
+	    tree_walk_filter (sub);
+	    below = &sub->nodes[0];
+	}
+	node->num_shown = 0;
+	for (j = 0; j < below->num_children; j++)
+	    node->num_shown += sub->nodes[below->first_child + j].shown;
+	node->shown = node->num_shown > 0 || below->tree_failed ||
+	    tree_node_matches (node);
+    }
+}
+
+/*
+ * Walk the tree below a window, and ask for the names of its root and
+ * parent, filling in rw and pw for display_window_id()
+ *
+ * Requires wininfo members initialized: window, tree_cookie (or tree)
+ */
+static void
+walk_tree (struct wininfo *w, int recurse, struct tree_walk *walk,
+	   struct wininfo *rw, struct wininfo *pw)
+{
+    memset (walk, 0, sizeof(struct tree_walk));
+    walk->what = tree_fields_plan ();
+    walk->max_depth = max_depth;
+    walk->only_viewable = only_viewable;
+    if (snapshot) {
+	snapshot_walk (walk, w->window, recurse);
+	tree_walk_filter (walk);
+	rw->window = walk->root;
+	pw->window = walk->parent;
+	return;
+    }
+    walk->dpy = dpy;
+    walk->recurse = recurse;
+    walk->max_inflight = max_inflight;
+    walk->start_tree = fetch_tree (w);
+    /* here, so the -jobs workers need not share the atom cache */
+    atom_net_wm_name = get_atom (dpy, "_NET_WM_NAME");
+    atom_utf8_string = get_atom (dpy, "UTF8_STRING");
+    if (recurse && jobs > 1)
+	tree_walk_parallel (walk, w->window, w->tree_cookie);
+    else
+	tree_walk_run (walk, w->window, w->tree_cookie);
+    tree_walk_filter (walk);
+
+    rw->window = walk->root;
+    rw->net_wm_name_cookie = get_net_wm_name (dpy, rw->window);
+    rw->wm_name_cookie = xcb_icccm_get_wm_name (dpy, rw->window);
+    pw->window = walk->parent;
+    pw->net_wm_name_cookie = get_net_wm_name (dpy, pw->window);
+    pw->wm_name_cookie = xcb_icccm_get_wm_name (dpy, pw->window);
+    xcb_flush (dpy);
+}
+
+/* Done with the windows found by walk_tree(), unless -watch wants them */
+static void
+walk_tree_done (struct tree_walk *walk, int recurse)
+{
+    if (watch)
+	watch_adopt (walk, recurse);
+    tree_walk_wipe (walk);
+}
+
+/*
+ * Display root, parent, and (recursively) children information
+ * recurse - true to show children information
+ *
+ * Requires wininfo members initialized: window, tree_cookie (or tree)
+ */
+static void
+display_tree_info (struct wininfo *w, int recurse)
+{
+    struct tree_walk walk;
+    struct wininfo rw, pw;
+
+    walk_tree (w, recurse, &walk, &rw, &pw);
+
+    out_char ('\n');
+    out_str ("  Root window id: ");
+    display_window_id (&rw, 1);
+    out_str ("  Parent window id: ");
+    display_window_id (&pw, 1);
+
+    display_tree_info_1 (&walk, 0, recurse, 0);
+
+    walk_tree_done (&walk, recurse);
+}
+
+/* Indent a line of the tree for the given recursion level */
+static void
+display_tree_indent (int level)
+{
+    static const char spaces[] = "                                                                ";
+    size_t len = 5 + 3 * (size_t) level;
+
+    while (len > sizeof(spaces) - 1) {
+	out_write (spaces, sizeof(spaces) - 1);
+	len -= sizeof(spaces) - 1;
+    }
+    out_write (spaces, len);
+}
+
+/*
+ * index - window in walk whose children are shown
+ * level - recursion level
+ */
+static void
+display_tree_info_1 (struct tree_walk *walk, unsigned int index,
+		     int recurse, int level)
+{
+    int i;
+    unsigned int num_children = walk->nodes[index].num_children;
+    unsigned int num_shown = walk->nodes[index].num_shown;
+    unsigned int first_child = walk->nodes[index].first_child;
+
+    if (level == 0  ||  num_shown > 0) {
+	display_tree_indent (level);
+	out_uint (num_shown);
+	out_str (num_shown == 1 ? " child" : " children");
+	out_write (num_shown ? ":\n" : ".\n", 2);
+    }
+
+    for (i = (int)num_children - 1; i >= 0; i--) {
+	struct tree_node *cw = &walk->nodes[first_child + i];
+
+	if (!cw->shown)
+	    continue;
+	display_tree_indent (level);
+	display_tree_node (cw);
+	out_char ('\n');
+
+	if (recurse) {
+	    struct tree_walk *sub = walk;
+	    unsigned int sub_index = first_child + i;
+
+	    if (cw->subtree) {
+		sub = cw->subtree;
+		sub_index = 0;
+		cw = &sub->nodes[0];
+	    }
+	    if (cw->tree_failed) {
+		print_x_error (dpy, cw->tree_error);
+		fatal_error ("Can't query window tree.");
+	    }
+	    display_tree_info_1 (sub, sub_index, 1, level+1);
+	}
+    }
+}
+
+
+/*
+ * -watch: once the tree has been printed, keep a copy of it up to date
+ * from the events the server sends about the windows in it, and print a
+ * line for each window that appears (+), disappears (-) or changes (*).
+ * Events are taken in batches: everything already queued is applied,
+ * then the names and children of any new windows are requested in one
+ * flight, and then the batch's lines are printed in the order of the
+ * events that caused them.
+ */
+#define WATCH_HASH_SIZE 4096	/* must be a power of two */
+
+struct watch_node {
+    struct tree_node			node;	/* what we print */
+    struct watch_node *			parent;
+    struct watch_node *			next;	/* in hash chain */
+    /* the children, in no particular order */
+    struct watch_node *			first_child;
+    struct watch_node *			next_sibling;
+    struct watch_node *			prev_sibling;
+    struct winquery *			fetch;	/* requests in flight */
+    uint8_t				dead;
+    uint8_t				queued;	/* has a '*' line coming */
+};
+
+struct watch_delta {
+    char				op;	/* '+', '-' or '*' */
+    uint8_t				show_parent;
+    struct watch_node *			wn;
+};
+
+static struct watch_node *watch_nodes[WATCH_HASH_SIZE];
+static struct watch_node *watch_top;	/* not printed, never dead */
+static int watch_recurse;
+static xcb_window_t watch_root;
+static xcb_translate_coordinates_cookie_t watch_top_cookie;
+static int16_t watch_top_x, watch_top_y;	/* origin of watch_top */
+
+static struct watch_delta *watch_deltas;
+static struct winquery_context *watch_queries;
+static unsigned int watch_num_deltas, watch_deltas_size;
+
+/* Ask for the events that keep a window's entry up to date */
+static void
+watch_select (xcb_connection_t *c, xcb_window_t window, int recurse)
+{
+    uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+
+    if (recurse)
+	mask |= XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+    xcb_change_window_attributes (c, window, XCB_CW_EVENT_MASK, &mask);
+}
+
+static struct watch_node *
+watch_find (xcb_window_t window)
+{
+    struct watch_node *wn;
+
+    for (wn = watch_nodes[window & (WATCH_HASH_SIZE - 1)]; wn; wn = wn->next)
+	if (wn->node.window == window)
+	    return wn;
+    return NULL;
+}
+
+/* Put a window among the children of another */
+static void
+watch_link (struct watch_node *wn, struct watch_node *parent)
+{
+    wn->parent = parent;
+    wn->prev_sibling = NULL;
+    wn->next_sibling = parent ? parent->first_child : NULL;
+    if (wn->next_sibling)
+	wn->next_sibling->prev_sibling = wn;
+    if (parent)
+	parent->first_child = wn;
+}
+
+/*
+ * Take a window out of the children of its parent, though it keeps
+ * pointing at it for where to print it until it is linked again
+ */
+static void
+watch_unlink (struct watch_node *wn)
+{
+    if (wn->prev_sibling)
+	wn->prev_sibling->next_sibling = wn->next_sibling;
+    else if (wn->parent)
+	wn->parent->first_child = wn->next_sibling;
+    if (wn->next_sibling)
+	wn->next_sibling->prev_sibling = wn->prev_sibling;
+    wn->next_sibling = wn->prev_sibling = NULL;
+}
+
+static struct watch_node *
+watch_new (xcb_window_t window, struct watch_node *parent)
+{
+    struct watch_node *wn = calloc (1, sizeof(struct watch_node));
+    unsigned int h = window & (WATCH_HASH_SIZE - 1);
+
+    if (wn == NULL)
+	fatal_error ("Failed to allocate memory in watch_new");
+    wn->node.window = window;
+    watch_link (wn, parent);
+    wn->next = watch_nodes[h];
+    watch_nodes[h] = wn;
+    return wn;
+}
+
+/* Queue a line to print about a window at the end of the batch */
+static void
+watch_queue (struct watch_node *wn, char op, int show_parent)
+{
+    struct watch_delta *d;
+
+    if (op == '*') {
+	if (wn->queued)
+	    return;
+	wn->queued = 1;
+    }
+    if (watch_num_deltas == watch_deltas_size) {
+	watch_deltas_size = watch_deltas_size ? watch_deltas_size * 2 : 64;
+	watch_deltas = realloc (watch_deltas,
+				watch_deltas_size * sizeof(struct watch_delta));
+	if (watch_deltas == NULL)
+	    fatal_error ("Failed to allocate memory in watch_queue");
+    }
+    d = &watch_deltas[watch_num_deltas++];
+    d->op = op;
+    d->show_parent = show_parent;
+    d->wn = wn;
+}
+
+/*
+ * Take a window and everything below it out of the tree, the windows
+ * below first.  They are freed once their lines are printed.
+ */
+static void
+watch_kill_subtree (struct watch_node *top)
+{
+    struct watch_node **p;
+
+    while (top->first_child)
+	watch_kill_subtree (top->first_child);
+
+    p = &watch_nodes[top->node.window & (WATCH_HASH_SIZE - 1)];
+    while (*p != top)
+	p = &(*p)->next;
+    *p = top->next;
+    watch_unlink (top);
+    top->dead = 1;
+    watch_queue (top, '-', 0);
+}
+
+/*
+ * Send the requests for what we print about a window new to the tree,
+ * or for its names again after they changed
+ */
+static void
+watch_fetch (struct watch_node *wn, int geometry, int children)
+{
+    unsigned int what = WINQUERY_NAME | WINQUERY_CLASS;
+
+    if (wn->fetch)
+	return; /* still waiting for the last lot */
+    wn->fetch = malloc (sizeof(struct winquery));
+    if (wn->fetch == NULL)
+	fatal_error ("Failed to allocate memory in watch_fetch");
+    if (geometry)
+	what |= WINQUERY_GEOMETRY;
+    if (children && watch_recurse)
+	what |= WINQUERY_CHILDREN;
+    winquery_submit (watch_queries, wn->fetch, wn->node.window, watch_root,
+		     what, NULL, NULL);
+}
+
+/* A window has come into the tree, by being created or reparented */
+static struct watch_node *
+watch_appear (xcb_window_t window, struct watch_node *parent, int geometry)
+{
+    struct watch_node *wn = watch_new (window, parent);
+
+    /* select first, so nothing that happens once we look goes unseen */
+    watch_select (dpy, window, watch_recurse);
+    watch_fetch (wn, geometry, 1);
+    watch_queue (wn, '+', 1);
+    return wn;
+}
+
+/* Wait for the replies to watch_fetch() and store the results */
+static void
+watch_collect (struct watch_node *wn)
+{
+    struct winquery *f = wn->fetch;
+    struct winquery_result *r = &f->result;
+    struct tree_node *node = &wn->node;
+    unsigned int i;
+
+    winquery_wait (watch_queries, f);
+
+    free (node->name.name);
+    free (node->instance_name);
+    free (node->class_name);
+    node->name.name = r->name;
+    node->name.len = r->name_len;
+    node->name.encoding = r->name_encoding;
+    node->got_wm_class = !!(r->got & WINQUERY_CLASS);
+    node->instance_name = r->instance_name;
+    node->class_name = r->class_name;
+    r->name = r->instance_name = r->class_name = NULL;
+
+    if (r->got & WINQUERY_GEOMETRY) {
+	node->got_geometry = 1;
+	node->x = r->x;
+	node->y = r->y;
+	node->width = r->width;
+	node->height = r->height;
+	node->border_width = r->border_width;
+    }
+
+    for (i = 0; i < r->num_children; i++)
+	if (!watch_find (r->children[i]) && !wn->dead)
+	    watch_appear (r->children[i], wn, 1);
+
+    winquery_result_wipe (r);
+    free (f);
+    wn->fetch = NULL;
+}
+
+/* Apply one event to the tree */
+static void
+watch_event (xcb_generic_event_t *event)
+{
+    struct watch_node *wn, *parent;
+
+    switch (event->response_type & ~0x80) {
+    case 0:
+	/* most likely a window that went away before we selected on it */
+	break;
+
+    case XCB_CREATE_NOTIFY: {
+	xcb_create_notify_event_t *e = (xcb_create_notify_event_t *) event;
+
+	parent = watch_find (e->parent);
+	if (!parent || (parent != watch_top && !watch_recurse)
+	    || watch_find (e->window))
+	    break;
+	wn = watch_appear (e->window, parent, 0);
+	wn->node.got_geometry = 1;
+	wn->node.x = e->x;
+	wn->node.y = e->y;
+	wn->node.width = e->width;
+	wn->node.height = e->height;
+	wn->node.border_width = e->border_width;
+	break;
+    }
+
+    case XCB_DESTROY_NOTIFY: {
+	xcb_destroy_notify_event_t *e = (xcb_destroy_notify_event_t *) event;
+
+	wn = watch_find (e->window);
+	if (wn == watch_top) {
+	    watch_top = NULL;
+	} else if (wn)
+	    watch_kill_subtree (wn); /* whose children went first */
+	break;
+    }
+
+    case XCB_REPARENT_NOTIFY: {
+	xcb_reparent_notify_event_t *e = (xcb_reparent_notify_event_t *) event;
+
+	wn = watch_find (e->window);
+	if (wn == watch_top)
+	    break;
+	parent = watch_find (e->parent);
+	if (parent && parent != watch_top && !watch_recurse)
+	    parent = NULL;
+	if (wn && parent) {
+	    /* we hear of it from both the old and the new parent */
+	    if (wn->parent == parent && wn->node.x == e->x
+		&& wn->node.y == e->y)
+		break;
+	    watch_unlink (wn);
+	    watch_link (wn, parent);
+	    wn->node.x = e->x;
+	    wn->node.y = e->y;
+	    watch_queue (wn, '*', 1);
+	} else if (wn) {
+	    watch_kill_subtree (wn);
+	} else if (parent) {
+	    watch_appear (e->window, parent, 1);
+	}
+	break;
+    }
+
+    case XCB_CONFIGURE_NOTIFY: {
+	xcb_configure_notify_event_t *e = (xcb_configure_notify_event_t *) event;
+
+	wn = watch_find (e->window);
+	if (wn == watch_top) {
+	    /* everything below has moved; find out where to */
+	    if (!watch_top_cookie.sequence)
+		watch_top_cookie = xcb_translate_coordinates
+		    (dpy, watch_top->node.window, watch_root, 0, 0);
+	    break;
+	}
+	if (!wn || (wn->node.got_geometry && wn->node.x == e->x
+		    && wn->node.y == e->y && wn->node.width == e->width
+		    && wn->node.height == e->height
+		    && wn->node.border_width == e->border_width))
+	    break; /* restacked, or not ours */
+	wn->node.got_geometry = 1;
+	wn->node.x = e->x;
+	wn->node.y = e->y;
+	wn->node.width = e->width;
+	wn->node.height = e->height;
+	wn->node.border_width = e->border_width;
+	watch_queue (wn, '*', 0);
+	break;
+    }
+
+    case XCB_GRAVITY_NOTIFY: {
+	xcb_gravity_notify_event_t *e = (xcb_gravity_notify_event_t *) event;
+
+	wn = watch_find (e->window);
+	if (!wn || wn == watch_top)
+	    break;
+	wn->node.x = e->x;
+	wn->node.y = e->y;
+	watch_queue (wn, '*', 0);
+	break;
+    }
+
+    case XCB_PROPERTY_NOTIFY: {
+	xcb_property_notify_event_t *e = (xcb_property_notify_event_t *) event;
+
+	wn = watch_find (e->window);
+	if (!wn || wn == watch_top)
+	    break;
+	if (e->atom == XCB_ATOM_WM_NAME || e->atom == XCB_ATOM_WM_CLASS
+	    || (atom_net_wm_name && e->atom == atom_net_wm_name)) {
+	    watch_fetch (wn, 0, 0);
+	    watch_queue (wn, '*', 0);
+	}
+	break;
+    }
+    }
+}
+
+/* Work out where a window's origin is from those of its ancestors */
+static int
+watch_origin (struct watch_node *wn, int *x, int *y)
+{
+    if (wn == watch_top) {
+	*x = watch_top_x;
+	*y = watch_top_y;
+	return 1;
+    }
+    if (!wn->parent || !wn->node.got_geometry
+	|| !watch_origin (wn->parent, x, y))
+	return 0;
+    *x += wn->node.x + wn->node.border_width;
+    *y += wn->node.y + wn->node.border_width;
+    return 1;
+}
+
+/* Finish off a batch of events: fetch what we need and print the lines */
+static void
+watch_flush (void)
+{
+    unsigned int i;
+
+    if (watch_top_cookie.sequence) {
+	xcb_translate_coordinates_reply_t *trans_coords;
+
+	trans_coords = xcb_translate_coordinates_reply
+	    (dpy, watch_top_cookie, NULL);
+	if (trans_coords) {
+	    watch_top_x = (int16_t) trans_coords->dst_x;
+	    watch_top_y = (int16_t) trans_coords->dst_y;
+	    free (trans_coords);
+	}
+	watch_top_cookie.sequence = 0;
+    }
+
+    /* collecting a new window may queue more below it */
+    for (i = 0; i < watch_num_deltas; i++)
+	if (watch_deltas[i].wn->fetch)
+	    watch_collect (watch_deltas[i].wn);
+
+    for (i = 0; i < watch_num_deltas; i++) {
+	struct watch_delta *d = &watch_deltas[i];
+	struct tree_node *node = &d->wn->node;
+	int x, y;
+
+	node->got_trans_coords = watch_origin (d->wn, &x, &y);
+	node->abs_x = x;
+	node->abs_y = y;
+
+	if (json) {
+	    char op[2] = { d->op, '\0' };
+
+	    json_begin_object (NULL);
+	    json_string ("op", op);
+	    json_tree_node (node);
+	    if (d->show_parent)
+		json_uint ("parent", d->wn->parent->node.window);
+	    json_end_object ();
+	} else {
+	    out_printf ("%c ", d->op);
+	    display_tree_node (node);
+	    if (d->show_parent)
+		out_printf ("  parent %s",
+			window_id_str (d->wn->parent->node.window));
+	    out_char ('\n');
+	}
+	d->wn->queued = 0;
+    }
+
+    for (i = 0; i < watch_num_deltas; i++) {
+	struct watch_node *wn = watch_deltas[i].wn;
+
+	if (watch_deltas[i].op == '-') {
+	    free (wn->node.name.name);
+	    free (wn->node.instance_name);
+	    free (wn->node.class_name);
+	    free (wn);
+	}
+    }
+    watch_num_deltas = 0;
+    out_flush ();
+}
+
+/*
+ * Take over the windows found by a walk, which were selected for events
+ * as they were found
+ */
+static void
+watch_adopt (struct tree_walk *walk, int recurse)
+{
+    struct watch_node **adopted;
+    unsigned int i, j;
+
+    adopted = calloc (walk->num_nodes, sizeof(struct watch_node *));
+    if (adopted == NULL)
+	fatal_error ("Failed to allocate memory in watch_adopt");
+
+    watch_recurse = recurse;
+    watch_root = walk->root;
+    watch_queries = winquery_new (dpy, get_atom (dpy, "_NET_WM_NAME"),
+				  get_atom (dpy, "UTF8_STRING"));
+    watch_top = adopted[0] = watch_new (walk->nodes[0].window, NULL);
+    watch_top_cookie = xcb_translate_coordinates
+	(dpy, watch_top->node.window, watch_root, 0, 0);
+
+    for (i = 0; i < walk->num_nodes; i++) {
+	struct tree_node *node = &walk->nodes[i];
+
+	for (j = 0; j < node->num_children; j++) {
+	    struct tree_node *child = &walk->nodes[node->first_child + j];
+	    struct watch_node *wn = watch_new (child->window, adopted[i]);
+
+	    adopted[node->first_child + j] = wn;
+	    wn->node = *child;
+	    wn->node.error = wn->node.tree_error = NULL;
+	    child->name.name = child->instance_name = child->class_name = NULL;
+	}
+    }
+    free (adopted);
+}
+
+/* Print changes to the tree until its top window is destroyed */
+static void
+watch_events (void)
+{
+    xcb_generic_event_t *event;
+
+    while (watch_top) {
+	watch_flush ();
+	event = xcb_wait_for_event (dpy);
+	if (event == NULL)
+	    fatal_error ("Lost connection to the X server.");
+	do {
+	    watch_event (event);
+	    free (event);
+	} while (watch_top && (event = xcb_poll_for_event (dpy)));
+    }
+    watch_flush ();
+}
+
+
+/*
+ * Display a set of size hints
+ */
+static void
+display_hints (xcb_size_hints_t *hints)
+{
+    long flags;
+    char xbuf[SCALE_BUFSIZE], ybuf[SCALE_BUFSIZE];
+
+    flags = hints->flags;
+
+    if (flags & XCB_ICCCM_SIZE_HINT_US_POSITION)
+	out_printf ("      User supplied location: %s, %s\n",
+		xscale (hints->x, xbuf), yscale (hints->y, ybuf));
+
+    if (flags & XCB_ICCCM_SIZE_HINT_P_POSITION)
+	out_printf ("      Program supplied location: %s, %s\n",
+		xscale (hints->x, xbuf), yscale (hints->y, ybuf));
+
+    if (flags & XCB_ICCCM_SIZE_HINT_US_SIZE) {
+	out_printf ("      User supplied size: %s by %s\n",
+		xscale (hints->width, xbuf), yscale (hints->height, ybuf));
+    }
+
+    if (flags & XCB_ICCCM_SIZE_HINT_P_SIZE)
+	out_printf ("      Program supplied size: %s by %s\n",
+		xscale (hints->width, xbuf), yscale (hints->height, ybuf));
+
+    if (flags & XCB_ICCCM_SIZE_HINT_P_MIN_SIZE)
+	out_printf ("      Program supplied minimum size: %s by %s\n",
+		xscale (hints->min_width, xbuf), yscale (hints->min_height, ybuf));
+
+    if (flags & XCB_ICCCM_SIZE_HINT_P_MAX_SIZE)
+	out_printf ("      Program supplied maximum size: %s by %s\n",
+		xscale (hints->max_width, xbuf), yscale (hints->max_height, ybuf));
+
+    if (flags & XCB_ICCCM_SIZE_HINT_BASE_SIZE) {
+	out_printf ("      Program supplied base size: %s by %s\n",
+		xscale (hints->base_width, xbuf), yscale (hints->base_height, ybuf));
+    }
+
+    if (flags & XCB_ICCCM_SIZE_HINT_P_RESIZE_INC) {
+	out_printf ("      Program supplied x resize increment: %s\n",
+		xscale (hints->width_inc, xbuf));
+	out_printf ("      Program supplied y resize increment: %s\n",
+		yscale (hints->height_inc, ybuf));
+	if (hints->width_inc != 0 && hints->height_inc != 0) {
+	    if (flags & XCB_ICCCM_SIZE_HINT_US_SIZE)
+		out_printf ("      User supplied size in resize increments:  %s by %s\n",
+			(xscale (hints->width / hints->width_inc, xbuf)),
+			(yscale (hints->height / hints->height_inc, ybuf)));
+	    if (flags & XCB_ICCCM_SIZE_HINT_P_SIZE)
+		out_printf ("      Program supplied size in resize increments:  %s by %s\n",
+			(xscale (hints->width / hints->width_inc, xbuf)),
+			(yscale (hints->height / hints->height_inc, ybuf)));
+	    if (flags & XCB_ICCCM_SIZE_HINT_P_MIN_SIZE)
+		out_printf ("      Program supplied minimum size in resize increments: %s by %s\n",
+			xscale (hints->min_width / hints->width_inc, xbuf), yscale (hints->min_height / hints->height_inc, ybuf));
+	    if (flags & XCB_ICCCM_SIZE_HINT_BASE_SIZE)
+		out_printf ("      Program supplied base size in resize increments:  %s by %s\n",
+			(xscale (hints->base_width / hints->width_inc, xbuf)),
+			(yscale (hints->base_height / hints->height_inc, ybuf)));
+	}
+    }
+
+    if (flags & XCB_ICCCM_SIZE_HINT_P_ASPECT) {
+	out_printf ("      Program supplied min aspect ratio: %s/%s\n",
+		xscale (hints->min_aspect_num, xbuf), yscale (hints->min_aspect_den, ybuf));
+	out_printf ("      Program supplied max aspect ratio: %s/%s\n",
+		xscale (hints->max_aspect_num, xbuf), yscale (hints->max_aspect_den, ybuf));
+    }
+
+    if (flags & XCB_ICCCM_SIZE_HINT_P_WIN_GRAVITY) {
+	out_printf ("      Program supplied window gravity: %s\n",
+		Lookup (hints->win_gravity, _gravities));
+    }
+}
+
+
+/*
+ * Display Size Hints info
+ */
+static void
+display_size_hints (struct wininfo *w)
+{
+    xcb_size_hints_t hints;
+
+    out_char ('\n');
     if (!fetch_normal_hints (w, &hints))
-	printf ("  No normal window size hints defined\n");
+	out_str ("  No normal window size hints defined\n");
+    else {
+	out_str ("  Normal window size hints:\n");
+	display_hints (&hints);
+    }
+
+    if (!fetch_zoom_hints (w, &hints))
+	out_str ("  No zoom window size hints defined\n");
     else {
-	printf ("  Normal window size hints:\n");
+	out_str ("  Zoom window size hints:\n");
 	display_hints (&hints);
     }
+}
+
+
+static void
+display_window_shape (xcb_window_t window)
+{
+    const xcb_query_extension_reply_t *shape_query;
+    xcb_shape_query_extents_cookie_t extents_cookie;
+    xcb_shape_query_extents_reply_t *extents;
+    char xbuf[SCALE_BUFSIZE], ybuf[SCALE_BUFSIZE];
+
+    shape_query = xcb_get_extension_data (dpy, &xcb_shape_id);
+    if (!shape_query->present)
+	return;
+
+    out_char ('\n');
+
+    extents_cookie = xcb_shape_query_extents (dpy, window);
+    extents = xcb_shape_query_extents_reply (dpy, extents_cookie, &err);
+
+    if (!extents) {
+	if (err)
+	    print_x_error (dpy, err);
+	else
+	{
+	    out_str ("  No window shape defined\n");
+	    out_str ("  No border shape defined\n");
+	}
+	return;
+    }
+
+    if (!extents->bounding_shaped)
+	out_str ("  No window shape defined\n");
+    else {
+	out_printf ("  Window shape extents:  %sx%s",
+		xscale (extents->bounding_shape_extents_width, xbuf),
+		yscale (extents->bounding_shape_extents_height, ybuf));
+	out_printf ("+%s+%s\n",
+		xscale (extents->bounding_shape_extents_x, xbuf),
+		yscale (extents->bounding_shape_extents_y, ybuf));
+    }
+    if (!extents->clip_shaped)
+	out_str ("  No border shape defined\n");
+    else {
+	out_printf ("  Border shape extents:  %sx%s",
+		xscale (extents->clip_shape_extents_width, xbuf),
+		yscale (extents->clip_shape_extents_height, ybuf));
+	out_printf ("+%s+%s\n",
+		xscale (extents->clip_shape_extents_x, xbuf),
+		yscale (extents->clip_shape_extents_y, ybuf));
+    }
+
+    free (extents);
+}
+
+/*
+ * Display Window Manager Info
+ *
+ * Requires wininfo members initialized:
+ *   window, hints_cookie
+ */
+static const struct binding _state_hints[] = {
+	{ XCB_ICCCM_WM_STATE_WITHDRAWN, "Withdrawn State" },
+	{ XCB_ICCCM_WM_STATE_NORMAL, "Normal State" },
+	{ XCB_ICCCM_WM_STATE_ICONIC, "Iconic State" },
+/* xwininfo previously also reported the ZoomState & InactiveState,
+   but ICCCM declared those obsolete long ago */
+	{ 0, NULL } };
+
+static void
+Display_Atom_Name (xcb_atom_t atom, const char *prefix)
+{
+    const char *atom_name = get_atom_name (dpy, atom);
+
+    if (atom_name) {
+	char *friendly_name = get_friendly_name (atom_name, prefix);
+	out_printf ("          %s\n", friendly_name);
+	free (friendly_name);
+    } else {
+	out_printf ("          (unresolvable ATOM 0x%x)\n", atom);
+    }
+}
+
+static void
+display_wm_info (struct wininfo *w)
+{
+    xcb_icccm_wm_hints_t wmhints;
+    long flags;
+    xcb_get_property_reply_t *prop, *window_type = NULL, *state = NULL;
+    int i;
+    char xbuf[SCALE_BUFSIZE], ybuf[SCALE_BUFSIZE];
+
+    /* Ask for the names of all the atoms we will list in one go */
+    if (atom_net_wm_window_type) {
+	window_type = xcb_get_property_reply (dpy, w->wm_window_type_cookie,
+					      NULL);
+	if (window_type && (window_type->type != XCB_NONE))
+	    prefetch_atom_names (dpy, xcb_get_property_value (window_type),
+				 window_type->value_len);
+    }
+    if (atom_net_wm_state) {
+	state = xcb_get_property_reply (dpy, w->wm_state_cookie, NULL);
+	if (state && (state->type != XCB_NONE))
+	    prefetch_atom_names (dpy, xcb_get_property_value (state),
+				 state->value_len);
+    }
+
+    out_char ('\n');
+    if (!xcb_icccm_get_wm_hints_reply(dpy, w->hints_cookie, &wmhints, &err))
+    {
+	out_str ("  No window manager hints defined\n");
+	if (err)
+	    print_x_error (dpy, err);
+	flags = 0;
+    } else
+	flags = wmhints.flags;
+
+    out_str ("  Window manager hints:\n");
+
+    if (flags & XCB_ICCCM_WM_HINT_INPUT)
+	out_printf ("      Client accepts input or input focus: %s\n",
+		Lookup (wmhints.input, _bool));
+
+    if (flags & XCB_ICCCM_WM_HINT_ICON_WINDOW) {
+	struct wininfo iw;
+	iw.window = wmhints.icon_window;
+	iw.net_wm_name_cookie = get_net_wm_name (dpy, iw.window);
+	iw.wm_name_cookie = xcb_icccm_get_wm_name (dpy, iw.window);
+
+	out_str ("      Icon window id: ");
+	display_window_id (&iw, 1);
+    }
+
+    if (flags & XCB_ICCCM_WM_HINT_ICON_POSITION)
+	out_printf ("      Initial icon position: %s, %s\n",
+		xscale (wmhints.icon_x, xbuf), yscale (wmhints.icon_y, ybuf));
+
+    if (flags & XCB_ICCCM_WM_HINT_STATE)
+	out_printf ("      Initial state is %s\n",
+		Lookup (wmhints.initial_state, _state_hints));
+
+    if (atom_net_wm_desktop) {
+	prop = xcb_get_property_reply (dpy, w->wm_desktop_cookie, NULL);
+	if (prop && (prop->type != XCB_NONE)) {
+	    uint32_t *desktop = xcb_get_property_value (prop);
+	    if (*desktop == 0xFFFFFFFF) {
+		out_str ("      Displayed on all desktops\n");
+	    } else {
+		out_printf ("      Displayed on desktop %d\n", *desktop);
+	    }
+	}
+	free (prop);
+    }
+
+    if (atom_net_wm_window_type) {
+	prop = window_type;
+	if (prop && (prop->type != XCB_NONE) && (prop->value_len > 0)) {
+	    xcb_atom_t *atoms = xcb_get_property_value (prop);
+	    int atom_count = prop->value_len;
+
+	    if (atom_count > 0) {
+		out_str ("      Window type:\n");
+		for (i = 0; i < atom_count; i++)
+		    Display_Atom_Name (atoms[i], "_NET_WM_WINDOW_TYPE_");
+	    }
+	}
+	free (prop);
+    }
+
+    if (atom_net_wm_state) {
+	prop = state;
+	if (prop && (prop->type != XCB_NONE) && (prop->value_len > 0)) {
+	    xcb_atom_t *atoms = xcb_get_property_value (prop);
+	    int atom_count = prop->value_len;
+
+	    if (atom_count > 0) {
+		out_str ("      Window state:\n");
+		for (i = 0; i < atom_count; i++)
+		    Display_Atom_Name (atoms[i], "_NET_WM_STATE_");
+	    }
+	}
+	free (prop);
+    }
+
+    if (atom_net_wm_pid) {
+	out_str ("      Process id: ");
+	prop = xcb_get_property_reply (dpy, w->wm_pid_cookie, NULL);
+	if (prop && (prop->type == XCB_ATOM_CARDINAL)) {
+	    uint32_t *pid = xcb_get_property_value (prop);
+	    out_printf ("%d", *pid);
+	} else {
+	    out_str ("(unknown)");
+	}
+	free (prop);
+
+	prop = xcb_get_property_reply (dpy, w->wm_client_machine_cookie, NULL);
+	if (prop && (prop->type == XCB_ATOM_STRING)) {
+	    const char *hostname = xcb_get_property_value (prop);
+	    int hostname_len = xcb_get_property_value_length (prop);
+	    out_printf (" on host %.*s", hostname_len, hostname);
+	}
+	out_char ('\n');
+	free (prop);
+    }
+
+    if (atom_net_frame_extents) {
+	prop = fetch_frame_extents (w);
+	if (prop && (prop->type == XCB_ATOM_CARDINAL)
+	    && (prop->value_len == 4)) {
+	    uint32_t *extents = xcb_get_property_value (prop);
+
+	    out_printf ("      Frame extents: %d, %d, %d, %d\n",
+		    extents[0], extents[1], extents[2], extents[3]);
+	}
+    }
+}
+
+/*
+ * -json and -ndjson: the same information as the display_* routines
+ * above, written with the streaming writer in json.c.  Sizes are always
+ * in pixels and ids always numbers, whatever -metric, -english and -int
+ * say, and each section becomes a member of the window's object.
+ */
+
+/* Write a window name, as a string if it can be converted to UTF-8 */
+static void
+json_window_name (const struct window_name *wn)
+{
+    if (wn->len == 0)
+	json_null ("name");
+    else if (wn->encoding == XCB_ATOM_STRING)
+	json_string_latin1 ("name", wn->name, wn->len);
+    else if (wn->encoding == atom_utf8_string)
+	json_string_len ("name", wn->name, wn->len);
+    else {
+	/* Encodings we don't support, including COMPOUND_TEXT */
+	json_null ("name");
+	json_string ("name_encoding", get_atom_name (dpy, wn->encoding));
+    }
+}
+
+/*
+ * Requires wininfo members initialized: window, net_wm_name_cookie,
+ *   wm_name_cookie
+ */
+static void
+json_window_id (const char *key, struct wininfo *w)
+{
+    struct window_name wn;
+
+    if (!w->window) {
+	json_null (key);
+	return;
+    }
+    fetch_window_name (dpy, w, &wn);
+    json_begin_object (key);
+    json_uint ("id", w->window);
+    json_window_name (&wn);
+    json_end_object ();
+    free (wn.name);
+}
+
+/* Write the members describing one child window in the tree */
+static void
+json_tree_node (struct tree_node *node)
+{
+    profile_windows (1);
+    json_uint ("id", node->window);
+    if (tree_fields & WINQUERY_NAME)
+	json_window_name (&node->name);
+
+    if (node->got_wm_class && (tree_fields & WINQUERY_CLASS)) {
+	json_string ("instance", node->instance_name);
+	json_string ("class", node->class_name);
+    }
+
+    if (node->got_geometry) {
+	if (tree_fields & WINQUERY_GEOMETRY) {
+	    json_int ("x", node->x);
+	    json_int ("y", node->y);
+	    json_uint ("width", node->width);
+	    json_uint ("height", node->height);
+	    json_uint ("border_width", node->border_width);
+	}
+
+	if (!(tree_fields & WINQUERY_POSITION))
+	    ;
+	else if (node->got_trans_coords) {
+	    int border = node->border_width;
+
+	    json_int ("abs_x", node->abs_x - border);
+	    json_int ("abs_y", node->abs_y - border);
+	} else if (node->error) {
+	    print_x_error (dpy, node->error);
+	}
+    } else if (node->error) {
+	print_x_error (dpy, node->error);
+    }
+}
+
+/* Find where the children of a window in a walk were collected */
+static struct tree_walk *
+json_tree_subtree (struct tree_walk *walk, unsigned int *index)
+{
+    struct tree_node *node = &walk->nodes[*index];
+
+    if (node->subtree) {
+	walk = node->subtree;
+	*index = 0;
+	node = &walk->nodes[0];
+    }
+    if (node->tree_failed) {
+	print_x_error (dpy, node->tree_error);
+	fatal_error ("Can't query window tree.");
+    }
+    return walk;
+}
+
+/*
+ * The children of a window in a walk as an array, each with its own
+ * children if recursing, in the order display_tree_info_1() lists them
+ */
+static void
+json_tree_children (struct tree_walk *walk, unsigned int index, int recurse)
+{
+    int i;
+    unsigned int num_children = walk->nodes[index].num_children;
+    unsigned int first_child = walk->nodes[index].first_child;
 
-    if (!xcb_icccm_get_wm_size_hints_reply (dpy, w->zoom_cookie, &hints, NULL))
-	printf ("  No zoom window size hints defined\n");
-    else {
-	printf ("  Zoom window size hints:\n");
-	display_hints (&hints);
+    json_begin_array ("children");
+    for (i = (int)num_children - 1; i >= 0; i--) {
+	unsigned int child = first_child + i;
+
+	if (!walk->nodes[child].shown)
+	    continue;
+	json_begin_object (NULL);
+	json_tree_node (&walk->nodes[child]);
+	if (recurse) {
+	    struct tree_walk *sub = json_tree_subtree (walk, &child);
+
+	    json_tree_children (sub, child, 1);
+	}
+	json_end_object ();
     }
+    json_end_array ();
 }
 
+/* Like json_tree_children(), but for -ndjson: each child on its own line */
+static void
+json_tree_lines (struct tree_walk *walk, unsigned int index, int recurse)
+{
+    int i;
+    xcb_window_t parent = walk->nodes[index].window;
+    unsigned int num_children = walk->nodes[index].num_children;
+    unsigned int first_child = walk->nodes[index].first_child;
+
+    for (i = (int)num_children - 1; i >= 0; i--) {
+	unsigned int child = first_child + i;
+
+	if (!walk->nodes[child].shown)
+	    continue;
+	json_begin_object (NULL);
+	json_tree_node (&walk->nodes[child]);
+	json_uint ("parent", parent);
+	json_end_object ();
+	if (recurse) {
+	    struct tree_walk *sub = json_tree_subtree (walk, &child);
+
+	    json_tree_lines (sub, child, 1);
+	}
+    }
+}
 
+/*
+ * Requires wininfo members initialized:
+ *   as for display_stats_info()
+ */
 static void
-display_window_shape (xcb_window_t window)
+json_stats_info (struct wininfo *w)
 {
-    const xcb_query_extension_reply_t *shape_query;
-    xcb_shape_query_extents_cookie_t extents_cookie;
-    xcb_shape_query_extents_reply_t *extents;
+    xcb_get_window_attributes_reply_t *win_attributes;
+    const char *visual_class;
+    int rx, ry, xright, ybelow;
+    char geometry[100];
 
-    shape_query = xcb_get_extension_data (dpy, &xcb_shape_id);
-    if (!shape_query->present)
-	return;
+    fetch_position (w, &rx, &ry, &xright, &ybelow);
+    win_attributes = fetch_win_attributes (w);
 
-    printf ("\n");
+    json_begin_object ("stats");
+    json_int ("abs_x", rx);
+    json_int ("abs_y", ry);
+    json_int ("x", w->geometry->x);
+    json_int ("y", w->geometry->y);
+    json_uint ("width", w->geometry->width);
+    json_uint ("height", w->geometry->height);
+    json_uint ("depth", w->geometry->depth);
+    json_uint ("visual", win_attributes->visual);
+    visual_class = fetch_visual_class (w);
+    if (visual_class)
+	json_string ("visual_class", visual_class);
+    json_uint ("border_width", w->geometry->border_width);
+    json_string ("class", Lookup (win_attributes->_class, _window_classes));
+    json_uint ("colormap", win_attributes->colormap);
+    json_bool ("colormap_installed", win_attributes->map_is_installed);
+    json_string ("bit_gravity",
+		 Lookup (win_attributes->bit_gravity, _bit_gravity_states));
+    json_string ("window_gravity",
+		 Lookup (win_attributes->win_gravity, _window_gravity_states));
+    json_string ("backing_store",
+		 Lookup (win_attributes->backing_store, _backing_store_states));
+    json_bool ("save_under", win_attributes->save_under);
+    json_string ("map_state",
+		 Lookup (win_attributes->map_state, _map_states));
+    json_bool ("override_redirect", win_attributes->override_redirect);
+    json_int ("right", xright);
+    json_int ("below", ybelow);
+    fetch_geometry_string (w, rx, ry, xright, ybelow,
+			   geometry, sizeof(geometry));
+    json_string ("geometry", geometry);
+    json_end_object ();
+}
 
-    extents_cookie = xcb_shape_query_extents (dpy, window);
-    extents = xcb_shape_query_extents_reply (dpy, extents_cookie, &err);
+/*
+ * Requires wininfo members initialized:
+ *   window, attr_cookie (or win_attributes)
+ */
+static void
+json_bits_info (struct wininfo *w)
+{
+    xcb_get_window_attributes_reply_t *win_attributes
+	= fetch_win_attributes (w);
 
-    if (!extents) {
-	if (err)
-	    print_x_error (dpy, err);
-	else
-	{
-	    printf ("  No window shape defined\n");
-	    printf ("  No border shape defined\n");
-	}
-	return;
-    }
+    json_begin_object ("bits");
+    json_string ("bit_gravity",
+		 Lookup (win_attributes->bit_gravity, _gravities+1));
+    json_string ("window_gravity",
+		 Lookup (win_attributes->win_gravity, _gravities));
+    json_string ("backing_store_hint",
+		 Lookup (win_attributes->backing_store, _backing_store_hint));
+    json_uint ("backing_planes", win_attributes->backing_planes);
+    json_uint ("backing_pixel", win_attributes->backing_pixel);
+    json_bool ("save_unders", win_attributes->save_under);
+    json_end_object ();
+}
 
-    if (!extents->bounding_shaped)
-	printf ("  No window shape defined\n");
-    else {
-	printf ("  Window shape extents:  %sx%s",
-		xscale (extents->bounding_shape_extents_width),
-		yscale (extents->bounding_shape_extents_height));
-	printf ("+%s+%s\n",
-		xscale (extents->bounding_shape_extents_x),
-		yscale (extents->bounding_shape_extents_y));
-    }
-    if (!extents->clip_shaped)
-	printf ("  No border shape defined\n");
-    else {
-	printf ("  Border shape extents:  %sx%s",
-		xscale (extents->clip_shape_extents_width),
-		yscale (extents->clip_shape_extents_height));
-	printf ("+%s+%s\n",
-		xscale (extents->clip_shape_extents_x),
-		yscale (extents->clip_shape_extents_y));
-    }
+static void
+json_event_mask (const char *key, long mask)
+{
+    unsigned long bit, bit_mask;
 
-    free (extents);
+    json_begin_array (key);
+    for (bit=0, bit_mask=1; bit < sizeof(long)*8; bit++, bit_mask <<= 1)
+	if (mask & bit_mask)
+	    json_string (NULL, LookupL (bit_mask, _event_mask_names));
+    json_end_array ();
 }
 
 /*
- * Display Window Manager Info
- *
  * Requires wininfo members initialized:
- *   window, hints_cookie
+ *   window, attr_cookie (or win_attributes)
  */
-static const struct binding _state_hints[] = {
-	{ XCB_ICCCM_WM_STATE_WITHDRAWN, "Withdrawn State" },
-	{ XCB_ICCCM_WM_STATE_NORMAL, "Normal State" },
-	{ XCB_ICCCM_WM_STATE_ICONIC, "Iconic State" },
-/* xwininfo previously also reported the ZoomState & InactiveState,
-   but ICCCM declared those obsolete long ago */
-	{ 0, NULL } };
+static void
+json_events_info (struct wininfo *w)
+{
+    xcb_get_window_attributes_reply_t *win_attributes
+	= fetch_win_attributes (w);
+
+    json_begin_object ("events");
+    json_event_mask ("wanted", win_attributes->all_event_masks);
+    json_event_mask ("do_not_propagate",
+		     win_attributes->do_not_propagate_mask);
+    json_bool ("override_redirect", win_attributes->override_redirect);
+    json_end_object ();
+}
 
+/* An object of two numbers, such as a position or a size */
 static void
-Display_Atom_Name (xcb_atom_t atom, const char *prefix)
+json_pair (const char *key, const char *name1, long value1,
+	   const char *name2, long value2)
 {
-    const char *atom_name = get_atom_name (dpy, atom);
+    json_begin_object (key);
+    json_int (name1, value1);
+    json_int (name2, value2);
+    json_end_object ();
+}
 
-    if (atom_name) {
-	char *friendly_name = get_friendly_name (atom_name, prefix);
-	printf ("          %s\n", friendly_name);
-	free (friendly_name);
-    } else {
-	printf ("          (unresolvable ATOM 0x%x)\n", atom);
-    }
+/* Write an array of atoms from a property, by name */
+static void
+json_atom_list (const char *key, xcb_get_property_reply_t *prop)
+{
+    xcb_atom_t *atoms = xcb_get_property_value (prop);
+    unsigned int i;
+
+    json_begin_array (key);
+    for (i = 0; i < prop->value_len; i++)
+	json_string (NULL, get_atom_name (dpy, atoms[i]));
+    json_end_array ();
 }
 
+/*
+ * Requires wininfo members initialized:
+ *   as for display_wm_info()
+ */
 static void
-display_wm_info (struct wininfo *w)
+json_wm_info (struct wininfo *w)
 {
     xcb_icccm_wm_hints_t wmhints;
-    long flags;
-    xcb_get_property_reply_t *prop;
-    int i;
+    xcb_get_property_reply_t *prop, *window_type = NULL, *state = NULL;
+
+    /* Ask for the names of all the atoms we will list in one go */
+    if (atom_net_wm_window_type) {
+	window_type = xcb_get_property_reply (dpy, w->wm_window_type_cookie,
+					      NULL);
+	if (window_type && (window_type->type != XCB_NONE))
+	    prefetch_atom_names (dpy, xcb_get_property_value (window_type),
+				 window_type->value_len);
+    }
+    if (atom_net_wm_state) {
+	state = xcb_get_property_reply (dpy, w->wm_state_cookie, NULL);
+	if (state && (state->type != XCB_NONE))
+	    prefetch_atom_names (dpy, xcb_get_property_value (state),
+				 state->value_len);
+    }
 
-    printf ("\n");
+    json_begin_object ("wm");
     if (!xcb_icccm_get_wm_hints_reply(dpy, w->hints_cookie, &wmhints, &err))
     {
-	printf ("  No window manager hints defined\n");
 	if (err)
 	    print_x_error (dpy, err);
-	flags = 0;
-    } else
-	flags = wmhints.flags;
-
-    printf ("  Window manager hints:\n");
+	json_null ("hints");
+    } else {
+	long flags = wmhints.flags;
 
-    if (flags & XCB_ICCCM_WM_HINT_INPUT)
-	printf ("      Client accepts input or input focus: %s\n",
-		Lookup (wmhints.input, _bool));
+	json_begin_object ("hints");
+	if (flags & XCB_ICCCM_WM_HINT_INPUT)
+	    json_bool ("input", wmhints.input);
 
-    if (flags & XCB_ICCCM_WM_HINT_ICON_WINDOW) {
-	struct wininfo iw;
-	iw.window = wmhints.icon_window;
-	iw.net_wm_name_cookie = get_net_wm_name (dpy, iw.window);
-	iw.wm_name_cookie = xcb_icccm_get_wm_name (dpy, iw.window);
+	if (flags & XCB_ICCCM_WM_HINT_ICON_WINDOW) {
+	    struct wininfo iw;
+	    iw.window = wmhints.icon_window;
+	    iw.net_wm_name_cookie = get_net_wm_name (dpy, iw.window);
+	    iw.wm_name_cookie = xcb_icccm_get_wm_name (dpy, iw.window);
 
-	printf ("      Icon window id: ");
-	display_window_id (&iw, 1);
-    }
+	    json_window_id ("icon_window", &iw);
+	}
 
-    if (flags & XCB_ICCCM_WM_HINT_ICON_POSITION)
-	printf ("      Initial icon position: %s, %s\n",
-		xscale (wmhints.icon_x), yscale (wmhints.icon_y));
+	if (flags & XCB_ICCCM_WM_HINT_ICON_POSITION)
+	    json_pair ("icon_position", "x", wmhints.icon_x,
+		       "y", wmhints.icon_y);
 
-    if (flags & XCB_ICCCM_WM_HINT_STATE)
-	printf ("      Initial state is %s\n",
-		Lookup (wmhints.initial_state, _state_hints));
+	if (flags & XCB_ICCCM_WM_HINT_STATE)
+	    json_string ("initial_state",
+			 Lookup (wmhints.initial_state, _state_hints));
+	json_end_object ();
+    }
 
     if (atom_net_wm_desktop) {
 	prop = xcb_get_property_reply (dpy, w->wm_desktop_cookie, NULL);
 	if (prop && (prop->type != XCB_NONE)) {
 	    uint32_t *desktop = xcb_get_property_value (prop);
-	    if (*desktop == 0xFFFFFFFF) {
-		printf ("      Displayed on all desktops\n");
-	    } else {
-		printf ("      Displayed on desktop %d\n", *desktop);
-	    }
-	}
-	free (prop);
-    }
-
-    if (atom_net_wm_window_type) {
-	prop = xcb_get_property_reply (dpy, w->wm_window_type_cookie,
-				       NULL);
-	if (prop && (prop->type != XCB_NONE) && (prop->value_len > 0)) {
-	    xcb_atom_t *atoms = xcb_get_property_value (prop);
-	    int atom_count = prop->value_len;
-
-	    if (atom_count > 0) {
-		printf ("      Window type:\n");
-		for (i = 0; i < atom_count; i++)
-		    Display_Atom_Name (atoms[i], "_NET_WM_WINDOW_TYPE_");
-	    }
+	    if (*desktop == 0xFFFFFFFF)
+		json_bool ("all_desktops", 1);
+	    else
+		json_uint ("desktop", *desktop);
 	}
 	free (prop);
     }
 
-    if (atom_net_wm_state) {
-	prop = xcb_get_property_reply (dpy, w->wm_state_cookie, NULL);
-	if (prop && (prop->type != XCB_NONE) && (prop->value_len > 0)) {
-	    xcb_atom_t *atoms = xcb_get_property_value (prop);
-	    int atom_count = prop->value_len;
+    if (window_type && (window_type->type != XCB_NONE))
+	json_atom_list ("window_type", window_type);
+    free (window_type);
 
-	    if (atom_count > 0) {
-		printf ("      Window state:\n");
-		for (i = 0; i < atom_count; i++)
-		    Display_Atom_Name (atoms[i], "_NET_WM_STATE_");
-	    }
-	}
-	free (prop);
-    }
+    if (state && (state->type != XCB_NONE))
+	json_atom_list ("state", state);
+    free (state);
 
     if (atom_net_wm_pid) {
-	printf ("      Process id: ");
 	prop = xcb_get_property_reply (dpy, w->wm_pid_cookie, NULL);
 	if (prop && (prop->type == XCB_ATOM_CARDINAL)) {
 	    uint32_t *pid = xcb_get_property_value (prop);
-	    printf ("%d", *pid);
+	    json_uint ("pid", *pid);
 	} else {
-	    printf ("(unknown)");
+	    json_null ("pid");
 	}
 	free (prop);
 
 	prop = xcb_get_property_reply (dpy, w->wm_client_machine_cookie, NULL);
-	if (prop && (prop->type == XCB_ATOM_STRING)) {
-	    const char *hostname = xcb_get_property_value (prop);
-	    int hostname_len = xcb_get_property_value_length (prop);
-	    printf (" on host %.*s", hostname_len, hostname);
-	}
-	printf ("\n");
+	if (prop && (prop->type == XCB_ATOM_STRING))
+	    json_string_latin1 ("host", xcb_get_property_value (prop),
+				xcb_get_property_value_length (prop));
 	free (prop);
     }
 
     if (atom_net_frame_extents) {
-	prop = xcb_get_property_reply (dpy, w->frame_extents_cookie, NULL);
+	prop = fetch_frame_extents (w);
 	if (prop && (prop->type == XCB_ATOM_CARDINAL)
 	    && (prop->value_len == 4)) {
 	    uint32_t *extents = xcb_get_property_value (prop);
+	    int i;
 
-	    printf ("      Frame extents: %d, %d, %d, %d\n",
-		    extents[0], extents[1], extents[2], extents[3]);
+	    json_begin_array ("frame_extents");
+	    for (i = 0; i < 4; i++)
+		json_uint (NULL, extents[i]);
+	    json_end_array ();
 	}
-	free (prop);
+    }
+    json_end_object ();
+}
+
+/* Write a set of size hints, leaving out those not set */
+static void
+json_hints (const char *key, xcb_size_hints_t *hints)
+{
+    long flags = hints->flags;
+
+    json_begin_object (key);
+    if (flags & XCB_ICCCM_SIZE_HINT_US_POSITION)
+	json_pair ("user_position", "x", hints->x, "y", hints->y);
+    if (flags & XCB_ICCCM_SIZE_HINT_P_POSITION)
+	json_pair ("program_position", "x", hints->x, "y", hints->y);
+    if (flags & XCB_ICCCM_SIZE_HINT_US_SIZE)
+	json_pair ("user_size", "width", hints->width,
+		   "height", hints->height);
+    if (flags & XCB_ICCCM_SIZE_HINT_P_SIZE)
+	json_pair ("program_size", "width", hints->width,
+		   "height", hints->height);
+    if (flags & XCB_ICCCM_SIZE_HINT_P_MIN_SIZE)
+	json_pair ("min_size", "width", hints->min_width,
+		   "height", hints->min_height);
+    if (flags & XCB_ICCCM_SIZE_HINT_P_MAX_SIZE)
+	json_pair ("max_size", "width", hints->max_width,
+		   "height", hints->max_height);
+    if (flags & XCB_ICCCM_SIZE_HINT_BASE_SIZE)
+	json_pair ("base_size", "width", hints->base_width,
+		   "height", hints->base_height);
+    if (flags & XCB_ICCCM_SIZE_HINT_P_RESIZE_INC)
+	json_pair ("resize_increment", "width", hints->width_inc,
+		   "height", hints->height_inc);
+    if (flags & XCB_ICCCM_SIZE_HINT_P_ASPECT) {
+	json_pair ("min_aspect", "num", hints->min_aspect_num,
+		   "den", hints->min_aspect_den);
+	json_pair ("max_aspect", "num", hints->max_aspect_num,
+		   "den", hints->max_aspect_den);
+    }
+    if (flags & XCB_ICCCM_SIZE_HINT_P_WIN_GRAVITY)
+	json_string ("window_gravity", Lookup (hints->win_gravity, _gravities));
+    json_end_object ();
+}
+
+static void
+json_size_hints (struct wininfo *w)
+{
+    xcb_size_hints_t hints;
+
+    json_begin_object ("size");
+    if (!fetch_normal_hints (w, &hints))
+	json_null ("normal");
+    else
+	json_hints ("normal", &hints);
+
+    if (!fetch_zoom_hints (w, &hints))
+	json_null ("zoom");
+    else
+	json_hints ("zoom", &hints);
+    json_end_object ();
+}
+
+static void
+json_shape_extents (const char *key, int shaped, int16_t x, int16_t y,
+		    uint16_t width, uint16_t height)
+{
+    if (!shaped) {
+	json_null (key);
+	return;
+    }
+    json_begin_object (key);
+    json_int ("x", x);
+    json_int ("y", y);
+    json_uint ("width", width);
+    json_uint ("height", height);
+    json_end_object ();
+}
+
+static void
+json_window_shape (xcb_window_t window)
+{
+    const xcb_query_extension_reply_t *shape_query;
+    xcb_shape_query_extents_cookie_t extents_cookie;
+    xcb_shape_query_extents_reply_t *extents;
+
+    shape_query = xcb_get_extension_data (dpy, &xcb_shape_id);
+    if (!shape_query->present)
+	return;
+
+    extents_cookie = xcb_shape_query_extents (dpy, window);
+    extents = xcb_shape_query_extents_reply (dpy, extents_cookie, &err);
+
+    if (!extents) {
+	if (err)
+	    print_x_error (dpy, err);
+	json_null ("shape");
+	return;
+    }
+
+    json_begin_object ("shape");
+    json_shape_extents ("bounding", extents->bounding_shaped,
+			extents->bounding_shape_extents_x,
+			extents->bounding_shape_extents_y,
+			extents->bounding_shape_extents_width,
+			extents->bounding_shape_extents_height);
+    json_shape_extents ("clip", extents->clip_shaped,
+			extents->clip_shape_extents_x,
+			extents->clip_shape_extents_y,
+			extents->clip_shape_extents_width,
+			extents->clip_shape_extents_height);
+    json_end_object ();
+
+    free (extents);
+}
+
+/*
+ * Write everything asked for about a window as one object.  With -ndjson
+ * the children found for -children or -tree follow it, one per line,
+ * instead of being nested inside it.
+ *
+ * Requires wininfo members initialized by prefetch_window_info()
+ */
+static void
+json_window_info (struct wininfo *w)
+{
+    struct tree_walk walk;
+    struct wininfo rw, pw;
+    struct window_name wn;
+
+    profile_phase ("name");
+    profile_windows (1);
+    fetch_window_name (dpy, w, &wn);
+    json_begin_object (NULL);
+    json_uint ("id", w->window);
+    json_window_name (&wn);
+    free (wn.name);
+
+    if (children || tree) {
+	profile_phase ("tree");
+	walk_tree (w, tree, &walk, &rw, &pw);
+	json_begin_object ("tree");
+	json_window_id ("root", &rw);
+	json_window_id ("parent", &pw);
+	if (!ndjson)
+	    json_tree_children (&walk, 0, tree);
+	json_end_object ();
+    }
+    if (stats) {
+	profile_phase ("stats");
+	json_stats_info (w);
+    }
+    if (bits) {
+	profile_phase ("bits");
+	json_bits_info (w);
+    }
+    if (events) {
+	profile_phase ("events");
+	json_events_info (w);
+    }
+    if (wm) {
+	profile_phase ("wm");
+	json_wm_info (w);
+    }
+    if (size) {
+	profile_phase ("size");
+	json_size_hints (w);
+    }
+    if (shape) {
+	profile_phase ("shape");
+	json_window_shape (w->window);
+    }
+    json_end_object ();
+
+    if (children || tree) {
+	profile_phase ("tree");
+	if (ndjson)
+	    json_tree_lines (&walk, 0, tree);
+	walk_tree_done (&walk, tree);
     }
 }
 
@@ -1575,6 +5140,10 @@ wininfo_wipe (struct wininfo *w)
     free (w->geometry);
     free (w->win_attributes);
     free (w->normal_hints);
+    free (w->tree);
+    free (w->frame_extents);
+    if (w->frame_extents_cookie.sequence)
+	xcb_discard_reply (dpy, w->frame_extents_cookie.sequence);
 }
 
 /* Gets UTF-8 encoded EMWH property _NET_WM_NAME for a window */
@@ -1596,83 +5165,89 @@ get_net_wm_name (xcb_connection_t *gnwn_dpy, xcb_window_t win)
     }
 }
 
-/* [Copied from code added by Yang Zhao to xprop/xprop.c]
- *
- * Validate a string as UTF-8 encoded according to RFC 3629
- *
- * Simply, a unicode code point (up to 21-bits long) is encoded as follows:
- *
- *    Char. number range  |        UTF-8 octet sequence
- *       (hexadecimal)    |              (binary)
- *    --------------------+---------------------------------------------
- *    0000 0000-0000 007F | 0xxxxxxx
- *    0000 0080-0000 07FF | 110xxxxx 10xxxxxx
- *    0000 0800-0000 FFFF | 1110xxxx 10xxxxxx 10xxxxxx
- *    0001 0000-0010 FFFF | 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
- *
- * Validation is done left-to-right, and an error condition, if any, refers to
- * only the left-most problem in the string.
- *
- * Return values:
- *   UTF8_VALID: Valid UTF-8 encoded string
- *   UTF8_OVERLONG: Using more bytes than needed for a code point
- *   UTF8_SHORT_TAIL: Not enough bytes in a multi-byte sequence
- *   UTF8_LONG_TAIL: Too many bytes in a multi-byte sequence
- *   UTF8_FORBIDDEN_VALUE: Forbidden prefix or code point outside 0x10FFFF
- */
-#define UTF8_VALID 0
-#define UTF8_FORBIDDEN_VALUE 1
-#define UTF8_OVERLONG 2
-#define UTF8_SHORT_TAIL 3
-#define UTF8_LONG_TAIL 4
-static int
-is_valid_utf8 (const char *string, size_t len)
-{
-    unsigned long codepoint;
-    int rem;
-    size_t i;
-    unsigned char c;
-
-    rem = 0;
-    for (i = 0; i < len; i++) {
-	c = (unsigned char) string[i];
-
-	/* Order of type check:
-	 *   - Single byte code point
-	 *   - Non-starting byte of multi-byte sequence
-	 *   - Start of 2-byte sequence
-	 *   - Start of 3-byte sequence
-	 *   - Start of 4-byte sequence
-	 */
-	if (!(c & 0x80)) {
-	    if (rem > 0) return UTF8_SHORT_TAIL;
-	    rem = 0;
-	    codepoint = c;
-	} else if ((c & 0xC0) == 0x80) {
-	    if (rem == 0) return UTF8_LONG_TAIL;
-	    rem--;
-	    codepoint |= (c & 0x3F) << (rem * 6);
-	    if (codepoint == 0) return UTF8_OVERLONG;
-	} else if ((c & 0xE0) == 0xC0) {
-	    if (rem > 0) return UTF8_SHORT_TAIL;
-	    rem = 1;
-	    codepoint = (c & 0x1F) << 6;
-	    if (codepoint == 0) return UTF8_OVERLONG;
-	} else if ((c & 0xF0) == 0xE0) {
-	    if (rem > 0) return UTF8_SHORT_TAIL;
-	    rem = 2;
-	    codepoint = (c & 0x0F) << 12;
-	} else if ((c & 0xF8) == 0xF0) {
-	    if (rem > 0) return UTF8_SHORT_TAIL;
-	    rem = 3;
-	    codepoint = (c & 0x07) << 18;
-	    if (codepoint > 0x10FFFF) return UTF8_FORBIDDEN_VALUE;
-	} else
-	    return UTF8_FORBIDDEN_VALUE;
-    }
+#ifdef HAVE_ICONV
+/*
+ * Names converted to the locale's encoding, as print_utf8 shows them,
+ * so that windows sharing a title (terminal tabs, say) are converted
+ * only once.  Each name has one slot it can be kept in, and replaces
+ * whatever name was there before.
+ */
+#define CONVERTED_CACHE_SIZE 1024	/* must be a power of two */
+
+static struct converted_name {
+    char	*name;		/* UTF-8, as in the property */
+    size_t	name_len;
+    char	*text;		/* what print_utf8 writes for it */
+    size_t	text_len;
+} converted_names[CONVERTED_CACHE_SIZE];
+
+static void
+converted_name_append (struct converted_name *c, const char *text, size_t len)
+{
+    c->text = realloc (c->text, c->text_len + len);
+    if (c->text == NULL && c->text_len + len > 0)
+	fatal_error ("Failed to allocate memory in convert_utf8");
+    memcpy (c->text + c->text_len, text, len);
+    c->text_len += len;
+}
+
+/*
+ * Convert a valid UTF-8 string with iconv_from_utf8, or find it already
+ * converted.  Parts that can't be converted are replaced by a message.
+ */
+static const struct converted_name *
+convert_utf8 (const char *u8str, size_t len)
+{
+    unsigned int h = 2166136261u;	/* FNV-1a */
+    struct converted_name *c;
+    char *inp = (char *) u8str;
+    size_t inlen = len, i;
+    char convbuf[BUFSIZ];
+    int done;
+
+    for (i = 0; i < len; i++)
+	h = (h ^ (unsigned char) u8str[i]) * 16777619u;
+    c = &converted_names[h & (CONVERTED_CACHE_SIZE - 1)];
+    if (c->name && c->name_len == len && memcmp (c->name, u8str, len) == 0)
+	return c;
+
+    free (c->name);
+    c->name = malloc (len + 1);
+    if (c->name == NULL)
+	fatal_error ("Failed to allocate memory in convert_utf8");
+    memcpy (c->name, u8str, len);
+    c->name_len = len;
+    c->text_len = 0;
+
+    /* Start from the initial shift state, whatever was converted before */
+    iconv (iconv_from_utf8, NULL, NULL, NULL, NULL);
+    do {
+	char *outp = convbuf;
+	size_t outlen = sizeof(convbuf);
+	size_t convres;
+
+	done = 1;
+	convres = iconv (iconv_from_utf8, &inp, &inlen, &outp, &outlen);
+
+	/* out of room in convbuf, so take what fits and go round again */
+	if (convres == (size_t) -1 && errno == E2BIG)
+	    done = 0;
+
+	if (convres != (size_t) -1 || !done) {
+	    converted_name_append (c, convbuf, sizeof(convbuf) - outlen);
+	} else {
+	    int n = snprintf (convbuf, sizeof(convbuf),
+			      " (failure in conversion from UTF8_STRING to %s)",
+			      user_encoding);
+
+	    if (n > 0 && (size_t) n < sizeof(convbuf))
+		converted_name_append (c, convbuf, n);
+	}
+    } while (!done);
 
-    return UTF8_VALID;
+    return c;
 }
+#endif
 
 /*
  * Converts a UTF-8 encoded string to the current locale encoding,
@@ -1685,15 +5260,15 @@ print_utf8 (const char *prefix, const char *u8str, size_t length, const char *su
     size_t inlen = length;
 
     if (is_valid_utf8 (u8str, inlen) != UTF8_VALID) {
-	printf (" (invalid UTF8_STRING)");
+	out_str (" (invalid UTF8_STRING)");
 	return;
     }
 
     if (strcmp (user_encoding, "UTF-8") == 0) {
 	/* Don't need to convert */
-	printf ("%s", prefix);
-	fwrite (u8str, 1, inlen, stdout);
-	printf ("%s", suffix);
+	out_str (prefix);
+	out_write (u8str, inlen);
+	out_str (suffix);
 	return;
     }
 
@@ -1703,37 +5278,17 @@ print_utf8 (const char *prefix, const char *u8str, size_t length, const char *su
     }
 
     if (iconv_from_utf8 != (iconv_t) -1) {
-	int done = 1;
-        char *inp = u8str;
-	char convbuf[BUFSIZ];
-	int convres;
-
-	printf ("%s", prefix);
-	do {
-	    char *outp = convbuf;
-	    size_t outlen = sizeof(convbuf);
-
-	    convres = iconv (iconv_from_utf8, &inp, &inlen, &outp, &outlen);
+	const struct converted_name *c = convert_utf8 (u8str, inlen);
 
-	    if ((convres == -1) && (errno == E2BIG)) {
-		done = 0;
-		convres = 0;
-	    }
-
-	    if (convres == 0) {
-		fwrite (convbuf, 1, sizeof(convbuf) - outlen, stdout);
-	    } else {
-		printf (" (failure in conversion from UTF8_STRING to %s)",
-			user_encoding);
-	    }
-	} while (!done);
-	printf ("%s", suffix);
+	out_str (prefix);
+	out_write (c->text, c->text_len);
+	out_str (suffix);
     } else {
-	printf (" (can't load iconv conversion for UTF8_STRING to %s)",
+	out_printf (" (can't load iconv conversion for UTF8_STRING to %s)",
 		user_encoding);
     }
 #else
-    printf (" (can't convert UTF8_STRING to %s)", user_encoding);
+    out_printf (" (can't convert UTF8_STRING to %s)", user_encoding);
 #endif
 }
 